@@ -5,17 +5,130 @@
 
 #include "glean.h"
 
-static long allocated = 0;
+/* Allocation accounting. Every allocation's size is added to a counter
+ * for its tag, and subtracted again by dealloc, so alloc_report can
+ * show which kind of data dominates. The counters are updated with
+ * relaxed atomics, since the threaded tokenizer and walker allocate
+ * concurrently.
+ *
+ * Sizes are the allocator's usable size for the block, where it's
+ * available, so frees can be counted without a header on every
+ * allocation. Elsewhere, only allocations are counted, and the
+ * current figures are an upper bound. */
+#if defined(__GLIBC__)
+#include <malloc.h>
+#define BLOCK_SIZE(p, sz) malloc_usable_size(p)
+#elif defined(__FreeBSD__)
+#include <malloc_np.h>
+#define BLOCK_SIZE(p, sz) malloc_usable_size(p)
+#elif defined(__APPLE__)
+#include <malloc/malloc.h>
+#define BLOCK_SIZE(p, sz) malloc_size(p)
+#else
+#define BLOCK_SIZE(p, sz) (sz)
+#define NO_BLOCK_SIZE
+#endif
+
+#define TAG_CT 256
+
+static size_t cur[TAG_CT], peak[TAG_CT], ct[TAG_CT];
+static size_t total, total_peak;
+static int warned;
+
+/* What each tag is used for, for the report. */
+static const char *tag_names[TAG_CT] = {
+    ['A'] = "arena chunks (words, set links)",
+    ['b'] = "buffers",
+    ['B'] = "doc ID sets",
+    ['c'] = "context",
+    ['d'] = "DB buffers",
+    ['D'] = "directories being walked",
+    ['f'] = "filenames",
+    ['F'] = "filenames, by doc ID",
+    ['g'] = "regex groups, grep state",
+    ['h'] = "hash arrays (postings)",
+    ['H'] = "hash array headers",
+    ['K'] = "term dictionaries",
+    ['m'] = "compaction files",
+    ['n'] = "names",
+    ['o'] = "set offsets",
+    ['p'] = "paths",
+    ['P'] = "forward index postings",
+    ['q'] = "workers and queues",
+    ['r'] = "filter rules",
+    ['R'] = "spilled runs",
+    ['s'] = "strings, sizes",
+    ['S'] = "set buckets and links",
+    ['t'] = "tombstones, tokens",
+    ['T'] = "threads",
+    ['v'] = "pointer arrays",
+    ['w'] = "words",
+    ['W'] = "stop word candidates",
+    ['z'] = "zlib streams",
+    ['Z'] = "compression dictionaries, training",
+};
+
+static void raise_peak(size_t *p, size_t v) {
+    size_t old = __atomic_load_n(p, __ATOMIC_RELAXED);
+    while (v > old && !__atomic_compare_exchange_n(p, &old, v, 1,
+            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+static void count_alloc(unsigned char tag, size_t sz) {
+    size_t t = __atomic_add_fetch(&total, sz, __ATOMIC_RELAXED);
+    raise_peak(&peak[tag], __atomic_add_fetch(&cur[tag], sz, __ATOMIC_RELAXED));
+    raise_peak(&total_peak, t);
+    __atomic_add_fetch(&ct[tag], 1, __ATOMIC_RELAXED);
+    if (t > ALLOC_SOFT_BUDGET && !__atomic_exchange_n(&warned, 1, __ATOMIC_RELAXED))
+        warnx("warning: over %lu MB allocated, approaching the %lu MB limit",
+            (ulong) ALLOC_SOFT_BUDGET >> 20, (ulong) MAX_MEMORY >> 20);
+}
+
+static void count_free(unsigned char tag, size_t sz) {
+    __atomic_sub_fetch(&cur[tag], sz, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&total, sz, __ATOMIC_RELAXED);
+}
 
 /* Malloc wrapper for catches failures and profiling allocations.
  * (The tag is used to mark the kind of allocation in the logs.) */
 void *alloc(size_t sz, char tag) {
     void *p = malloc(sz);
     if (p == NULL) err(1, "alloc fail");
-    if (DEBUG) {
-        fprintf(stderr, "-- Allocated %lu bytes (%c), %ld total\n",
-            sz, tag, allocated);
-        allocated += sz;
-    }
+    count_alloc(tag, BLOCK_SIZE(p, sz));
+    if (DEBUG) fprintf(stderr, "-- Allocated %lu bytes (%c), %lu total\n",
+        sz, tag, (ulong) total);
     return p;
 }
+
+void *ralloc(void *p, size_t sz, char tag) {
+    size_t old = p ? BLOCK_SIZE(p, 0) : 0;
+    void *np = realloc(p, sz);
+    if (np == NULL) err(1, "realloc fail");
+    count_free(tag, old);
+    count_alloc(tag, BLOCK_SIZE(np, sz));
+    return np;
+}
+
+void dealloc(void *p, char tag) {
+    if (p == NULL) return;
+#ifndef NO_BLOCK_SIZE
+    count_free(tag, BLOCK_SIZE(p, 0));
+#endif
+    free(p);
+}
+
+void alloc_report(FILE *f) {
+    int i;
+    fprintf(f, "-- Memory by tag:\n"
+        "   tag %12s %12s %10s\n", "current", "peak", "allocs");
+    for (i=0; i<TAG_CT; i++) {
+        if (ct[i] == 0 && cur[i] == 0) continue;
+        fprintf(f, "   %c   %12ld %12lu %10lu  %s\n", i, (long) cur[i],
+            (ulong) peak[i], (ulong) ct[i], tag_names[i] ? tag_names[i] : "");
+    }
+    fprintf(f, "   all %12lu %12lu\n", (ulong) total, (ulong) total_peak);
+#ifdef NO_BLOCK_SIZE
+    fprintf(f, "   (frees aren't counted on this platform)\n");
+#endif
+}
@@ -4,4 +4,13 @@
 /* Malloc wrapper for catches failures and profiling allocations. */
 void *alloc(size_t, char);
 
+/* Resize P, allocated by alloc with the same tag. */
+void *ralloc(void *p, size_t sz, char tag);
+
+/* Free P, allocated by alloc with the same tag. P may be NULL. */
+void dealloc(void *p, char tag);
+
+/* Print the current and peak bytes allocated for each tag to F. */
+void alloc_report(FILE *f);
+
 #endif
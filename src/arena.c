@@ -0,0 +1,83 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <assert.h>
+
+#include "glean.h"
+#include "arena.h"
+
+/* Allocations are rounded up to this. */
+#define ARENA_ALIGN sizeof(void *)
+
+/* A block of memory, bump-allocated from the front. */
+typedef struct chunk {
+    struct chunk *next;
+    size_t sz, used;
+    char *buf;
+} chunk;
+
+struct arena {
+    chunk *head;            /* current chunk; older ones follow */
+    size_t chunk_sz;
+    size_t total;           /* bytes taken from malloc */
+};
+
+static chunk *chunk_new(arena *a, size_t sz) {
+    chunk *ch = alloc(sizeof(chunk) + sz, 'A');
+    ch->buf = (char *) ch + sizeof(chunk);
+    ch->sz = sz;
+    ch->used = 0;
+    a->total += sizeof(chunk) + sz;
+    return ch;
+}
+
+arena *arena_new(size_t chunk_sz) {
+    arena *a = alloc(sizeof(arena), 'A');
+    a->head = NULL;
+    a->chunk_sz = chunk_sz ? chunk_sz : ARENA_CHUNK_SZ;
+    a->total = 0;
+    return a;
+}
+
+void *arena_alloc(arena *a, size_t sz) {
+    chunk *ch = a->head;
+    void *p;
+    assert(sizeof(chunk) % ARENA_ALIGN == 0);
+    sz = (sz + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+    /* Give large requests their own chunk, behind the current one, so
+     * its free space isn't wasted. */
+    if (sz > a->chunk_sz / 4) {
+        ch = chunk_new(a, sz);
+        ch->used = sz;
+        if (a->head) {
+            ch->next = a->head->next;
+            a->head->next = ch;
+        } else {
+            ch->next = NULL;
+            a->head = ch;
+        }
+        return ch->buf;
+    }
+
+    if (ch == NULL || ch->sz - ch->used < sz) {
+        ch = chunk_new(a, a->chunk_sz);
+        ch->next = a->head;
+        a->head = ch;
+    }
+    p = ch->buf + ch->used;
+    ch->used += sz;
+    return p;
+}
+
+size_t arena_size(arena *a) { return a->total; }
+
+void arena_free(arena *a) {
+    chunk *ch = a->head, *next;
+    while (ch) {
+        next = ch->next;
+        dealloc(ch, 'A');
+        ch = next;
+    }
+    dealloc(a, 'A');
+}
@@ -0,0 +1,23 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+/* Arena allocator, for the many small objects that live as long as
+ * the index build (words, their names, and set links). Allocation is
+ * a pointer bump, and everything is released at once by arena_free.
+ * An arena is not thread-safe: give each thread its own. */
+typedef struct arena arena;
+
+/* Create an arena that allocates CHUNK_SZ bytes at a time
+ * (or ARENA_CHUNK_SZ, if 0). */
+arena *arena_new(size_t chunk_sz);
+
+/* Allocate SZ bytes, aligned for any of the objects above. */
+void *arena_alloc(arena *a, size_t sz);
+
+/* How many bytes has the arena taken from malloc? */
+size_t arena_size(arena *a);
+
+/* Free the arena, and everything allocated from it. */
+void arena_free(arena *a);
+
+#endif
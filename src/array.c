@@ -6,6 +6,15 @@
 #include <err.h>
 #include <errno.h>
 
+/* On x86 with SSE2 (always there on x86-64), merge similar-sized arrays
+ * a block of four hashes at a time. */
+#if defined(__SSE2__)
+#define ARRAY_SSE2 1
+#include <emmintrin.h>
+#else
+#define ARRAY_SSE2 0
+#endif
+
 #include "glean.h"
 #include "array.h"
 
@@ -15,22 +24,26 @@
 
 h_array *h_array_new(uint sz) {
     h_array *a = alloc(sizeof(h_array), 'H');
-    hash_t *hs = alloc(sz * sizeof(hash_t), 'h');
+    h_array_init(a, sz);
+    return a;
+}
+
+/* Initialize an array whose header was allocated elsewhere. */
+void h_array_init(h_array *a, uint sz) {
     assert(sz > 0);
+    a->hs = alloc(sz * sizeof(hash_t), 'h');
     a->sz = sz;
     a->len = 0;
-    a->hs = hs;
-    return a;
 }
 
 static void h_array_resize(h_array *a) {
     uint i, nsz = 2*a->sz;
-    hash_t *hs = alloc(nsz * sizeof(hash_t), 'H');
+    hash_t *hs = alloc(nsz * sizeof(hash_t), 'h');
     assert(hs); assert(a);
     assert(a->hs);
     assert(a->len < nsz);
     for (i=0; i<a->len; i++) hs[i] = a->hs[i];
-    free(a->hs);
+    dealloc(a->hs, 'h');
     a->hs = hs;
     a->sz = nsz;
 }
@@ -41,6 +54,16 @@ void h_array_append(h_array *a, hash_t v) {
     a->hs[a->len++] = v;
 }
 
+/* Empty the array, releasing most of its memory. */
+void h_array_clear(h_array *a) {
+    if (a->sz > 2) {
+        dealloc(a->hs, 'h');
+        a->hs = alloc(2 * sizeof(hash_t), 'h');
+        a->sz = 2;
+    }
+    a->len = 0;
+}
+
 uint h_array_length(h_array *a) { assert(a); return a->len; }
 
 hash_t h_array_get(h_array *a, uint i) { assert(a); return a->hs[i]; }
@@ -58,7 +81,7 @@ void h_array_sort(h_array *a) {
 void h_array_uniq(h_array *a) {
     uint i, dup=0;
     hash_t last = 0, cur;
-    hash_t *curhs = a->hs, *nhs = alloc(a->sz * sizeof(hash_t), 'H');
+    hash_t *curhs = a->hs, *nhs = alloc(a->sz * sizeof(hash_t), 'h');
     for (i=0; i<a->len; i++) {
         cur = a->hs[i];
         if (i > 0 && last == cur) {
@@ -70,7 +93,7 @@ void h_array_uniq(h_array *a) {
         last = cur;
     }
     a->len -= dup;
-    free(curhs);
+    dealloc(curhs, 'h');
     a->hs = nhs;
 }
 
@@ -115,33 +138,136 @@ h_array *h_array_union(h_array *a, h_array *b) {
     return res;
 }
 
-/* Get the intersection of two sorted arrays. */
+/* Intersecting arrays this many times different in length gallops
+ * through the longer one, rather than merging. */
+#define GALLOP_RATIO 32
+
+/* Index of the first of A's hashes from LO on that's >= V, searching
+ * in exponentially growing steps, then by bisection. */
+static uint gallop(h_array *a, uint lo, hash_t v) {
+    uint step = 1, hi, mid;
+    if (lo >= a->len || a->hs[lo] >= v) return lo;
+    while (lo + step < a->len && a->hs[lo + step] < v) {
+        lo += step;
+        step *= 2;
+    }
+    hi = lo + step < a->len ? lo + step : a->len;
+    lo++;                       /* a->hs[lo] < v */
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (a->hs[mid] < v) lo = mid + 1; else hi = mid;
+    }
+    return lo;
+}
+
+#if ARRAY_SSE2
+/* Merge blocks of four hashes of A and B (sorted and unique) into OUT,
+ * comparing A's block against each rotation of B's at once, then
+ * advancing past whichever block ends first (or both). Stops when
+ * either has less than a block left, leaving *IA and *IB there for the
+ * scalar merge. Returns how many hashes were written. */
+static uint merge_sse2(h_array *a, h_array *b, hash_t *out, uint *ia, uint *ib) {
+    uint i = *ia, j = *ib, n = 0, mask;
+    hash_t amax, bmax;
+    __m128i va, vb, eq;
+    while (i + 4 <= a->len && j + 4 <= b->len) {
+        va = _mm_loadu_si128((const __m128i *) (a->hs + i));
+        vb = _mm_loadu_si128((const __m128i *) (b->hs + j));
+        eq = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi32(va, vb),
+                _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(0, 3, 2, 1)))),
+            _mm_or_si128(
+                _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(1, 0, 3, 2))),
+                _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(2, 1, 0, 3)))));
+        mask = _mm_movemask_ps(_mm_castsi128_ps(eq));
+        out[n] = a->hs[i]; n += mask & 1;
+        out[n] = a->hs[i + 1]; n += (mask >> 1) & 1;
+        out[n] = a->hs[i + 2]; n += (mask >> 2) & 1;
+        out[n] = a->hs[i + 3]; n += (mask >> 3) & 1;
+        amax = a->hs[i + 3];
+        bmax = b->hs[j + 3];
+        i += amax <= bmax ? 4 : 0;
+        j += bmax <= amax ? 4 : 0;
+    }
+    *ia = i;
+    *ib = j;
+    return n;
+}
+#endif
+
+/* Get the intersection of two sorted arrays. When one is
+ * GALLOP_RATIO times longer than the other, each of the shorter one's
+ * hashes is galloped to in the longer one, rather than walking it all;
+ * otherwise, they're merged, advancing both sides without branching
+ * (and with SSE2, four hashes at a time, as long as they're unique). */
 h_array *h_array_intersection(h_array *a, h_array *b) {
-    h_array *res;
-    uint ia = 0, ib = 0;
+    h_array *res, *t;
+    uint ia = 0, ib = 0, n = 0;
     uint lena = h_array_length(a), lenb = h_array_length(b);
     hash_t ha, hb;
-    res = h_array_new(2);
-    if (lena > 0 && lenb > 0) {
-        while (1) {
-            ha = h_array_get(a, ia);
-            hb = h_array_get(b, ib);
-            if (ha == hb) {
-                h_array_append(res, ha);
-                ia++; ib++;
-            } else if (ha < hb) {
-                ia++;
-            } else /* ha > hb */ {
-                ib++;
-            }
-            if (ia >= lena || ib >= lenb) break;
+    if (lena > lenb) {
+        t = a; a = b; b = t;
+        lena = a->len; lenb = b->len;
+    }
+    res = h_array_new(lena + 1);
+    if (lena > 0 && lenb / lena >= GALLOP_RATIO) {
+        for (ia = 0; ia < lena && ib < lenb; ia++) {
+            ha = a->hs[ia];
+            ib = gallop(b, ib, ha);
+            if (ib < lenb && b->hs[ib] == ha) res->hs[n++] = ha;
+        }
+    } else {
+#if ARRAY_SSE2
+        n = merge_sse2(a, b, res->hs, &ia, &ib);
+#endif
+        while (ia < lena && ib < lenb) {
+            ha = a->hs[ia];
+            hb = b->hs[ib];
+            res->hs[n] = ha;
+            n += ha == hb;
+            ia += ha <= hb;
+            ib += hb <= ha;
         }
     }
-    assert(res);
+    res->len = n;
     assert(h_array_length(res) <= lena && h_array_length(res) <= lenb);
     return res;
 }
 
+/* Get the intersection of the N sorted arrays in AS, starting from
+ * the shortest and galloping through the rest. */
+h_array *h_array_intersection_n(h_array **as, uint n) {
+    h_array *res, *t, *first;
+    h_array **by_len;
+    uint i, j, *pos;
+    hash_t v;
+    if (n == 0) return h_array_new(2);
+    by_len = alloc(n * sizeof(h_array *), 'H');
+    pos = alloc(n * sizeof(uint), 'H');
+    for (i=0; i<n; i++) {       /* insertion sort, by length */
+        t = as[i];
+        for (j=i; j > 0 && by_len[j - 1]->len > t->len; j--)
+            by_len[j] = by_len[j - 1];
+        by_len[j] = t;
+        pos[i] = 0;
+    }
+    first = by_len[0];
+    res = h_array_new(first->len + 1);
+    for (i=0; i<first->len; i++) {
+        v = first->hs[i];
+        for (j=1; j<n; j++) {
+            pos[j] = gallop(by_len[j], pos[j], v);
+            if (pos[j] == by_len[j]->len) goto done;
+            if (by_len[j]->hs[pos[j]] != v) break;
+        }
+        if (j == n) res->hs[res->len++] = v;
+    }
+done:
+    dealloc(by_len, 'H');
+    dealloc(pos, 'H');
+    return res;
+}
+
 /* Get an array of all values in A that are not in B.
  * Assumes both arrays are sorted. */
 h_array *h_array_complement(h_array *a, h_array *b) {
@@ -181,8 +307,14 @@ h_array *h_array_complement(h_array *a, h_array *b) {
 }
 
 void h_array_free(h_array *a) {
-    if (a->hs) free(a->hs);
-    free(a);
+    h_array_release(a);
+    dealloc(a, 'H');
+}
+
+/* Free an array's contents, but not its header. */
+void h_array_release(h_array *a) {
+    if (a->hs) dealloc(a->hs, 'h');
+    a->hs = NULL;
 }
 
 
@@ -207,7 +339,7 @@ static void v_array_resize(v_array *a) {
     assert(a->vs);
     assert(a->len < nsz);
     for (i=0; i<a->len; i++) vs[i] = a->vs[i];
-    free(a->vs);
+    dealloc(a->vs, 'v');
     a->vs = vs;
     a->sz = nsz;
 }
@@ -233,6 +365,6 @@ void v_array_free(v_array *a, v_array_free_cb *cb) {
     if (cb) {
         for (i=0; i<a->len; i++) cb(a->vs[i]);
     }
-    free(a->vs);
-    free(a);
+    dealloc(a->vs, 'v');
+    dealloc(a, 'v');
 }
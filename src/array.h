@@ -12,23 +12,38 @@ typedef struct h_array {
 } h_array;
 
 h_array *h_array_new(uint sz);
+
+/* Initialize an array whose header was allocated elsewhere
+ * (e.g. from an arena), with room for SZ hashes. */
+void h_array_init(h_array *a, uint sz);
+
 void h_array_append(h_array *a, hash_t v);
 hash_t h_array_get(h_array *a, uint i);
 uint h_array_length(h_array *a);
 
+/* Empty the array, releasing most of its memory. */
+void h_array_clear(h_array *a);
+
 /* Sort the hash array in place. */
 void h_array_sort(h_array *a);
 
 /* Remove duplicates from an array (which must be sorted). */
 void h_array_uniq(h_array *a);
 
-/* Get the union/intersection/complement of two sorted arrays. */
+/* Get the union/intersection/complement of two sorted arrays. The
+ * intersection's arrays must also be unique (i.e. sets). */
 h_array *h_array_union(h_array *a, h_array *b);
 h_array *h_array_intersection(h_array *a, h_array *b);
 h_array *h_array_complement(h_array *a, h_array *b);
 
+/* Get the intersection of the N sorted arrays in AS. */
+h_array *h_array_intersection_n(h_array **as, uint n);
+
 void h_array_free(h_array *a);
 
+/* Free the hashes of an array set up by h_array_init, but not A. */
+void h_array_release(h_array *a);
+
 /* Dynamically resized void pointer array (vector).
  * When appending, the allocated memory for VS will be
  * doubled if LEN == SZ. */
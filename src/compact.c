@@ -0,0 +1,315 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <err.h>
+#include <errno.h>
+
+#include "glean.h"
+#include "set.h"
+#include "word.h"
+#include "fname.h"
+#include "array.h"
+#include "gln_index.h"
+#include "db.h"
+#include "forward.h"
+#include "compact.h"
+#include "terms.h"
+
+/* Merging sets, for gln_index --compact.
+ *
+ * Every update (-u) adds another set to the chains in token.db and
+ * fname.db, and a query reads one bucket from each set, so lookups slow
+ * down as updates pile up. Compaction merges a run of the newest sets
+ * into one. The forward index has the names and token hashes of the
+ * live files in those sets, and the sets' term dictionaries have the
+ * tokens' names, so nothing needs to be tokenized again.
+ *
+ * Sets are picked size-tiered: starting from the newest, each older set
+ * is added to the run while it's at most COMPACT_TIER_RATIO times the
+ * size of the run so far. Small recent sets are merged often and large
+ * old ones rarely, so the set count stays logarithmic in the number of
+ * updates. With --compact=all, every set is merged.
+ *
+ * The merged files get new doc IDs, in path order, starting from the
+ * first merged set's; every set after it is replaced, so nothing else
+ * refers to the old ones. */
+
+/* A live file from one of the merged sets. */
+typedef struct merge_file {
+    fname *fn;
+    h_array *toks;
+} merge_file;
+
+/* Userdata for collect_file's forward_each. */
+typedef struct merge {
+    uint first;             /* first set being merged */
+    uint set_ct;            /* sets in the token DB */
+    ulong *toffs;           /* their offsets */
+    v_array *files;         /* merge_file *s */
+    h_array *thashes;       /* every token hash in files */
+} merge;
+
+static char *gln_path(context *c, const char *fname) {
+    int len = strlen(c->wkdir) + strlen(fname) + 2;
+    char *path = alloc(len, 'p');
+    if (len <= snprintf(path, len, "%s/%s", c->wkdir, fname)) {
+        fprintf(stderr, "snprintf error\n");
+        exit(EXIT_FAILURE);
+    }
+    return path;
+}
+
+/* Pick the first set to merge, size-tiered. SIZES has N entries. */
+static uint pick_first_set(ulong *sizes, uint n) {
+    uint first = n - 1;
+    ulong run = sizes[first];
+    while (first > 0 && sizes[first - 1] <= COMPACT_TIER_RATIO * run)
+        run += sizes[--first];
+    return first;
+}
+
+static void collect_file(fwd_record *r, void *udata) {
+    merge *m = (merge *) udata;
+    merge_file *mf;
+    uint i;
+    if (r->set < m->first || !r->live) return;
+    mf = alloc(sizeof(*mf), 'm');
+    mf->fn = fname_new((char *) r->name, r->namelen);
+    mf->toks = h_array_new(r->ct > 0 ? r->ct + 1 : 2);
+    forward_tokens(r, mf->toks);
+    for (i=0; i<h_array_length(mf->toks); i++)
+        h_array_append(m->thashes, h_array_get(mf->toks, i));
+    v_array_append(m->files, mf);
+}
+
+static int word_hash_cmp(const void *a, const void *b) {
+    hash_t ha = (*(word **) a)->hash, hb = (*(word **) b)->hash;
+    return ha < hb ? -1 : ha > hb ? 1 : 0;
+}
+
+static word *find_word(v_array *words, hash_t hash) {
+    uint lo = 0, hi = v_array_length(words), mid;
+    word *w;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        w = (word *) v_array_get(words, mid);
+        if (w->hash < hash) lo = mid + 1; else hi = mid;
+    }
+    if (lo == v_array_length(words)) return NULL;
+    w = (word *) v_array_get(words, lo);
+    return w->hash == hash ? w : NULL;
+}
+
+static int has_hash(h_array *a, hash_t hash) {
+    uint lo = 0, hi = h_array_length(a), mid;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (h_array_get(a, mid) < hash) lo = mid + 1; else hi = mid;
+    }
+    return lo < h_array_length(a) && h_array_get(a, lo) == hash;
+}
+
+/* Userdata for name_word's terms_each. */
+typedef struct word_names {
+    merge *m;
+    set *seen;
+    v_array *words;
+} word_names;
+
+static void name_word(const char *term, uint len, void *udata) {
+    word_names *wn = (word_names *) udata;
+    hash_t hash = word_hash((char *) term);
+    word *w;
+    if (!has_hash(wn->m->thashes, hash) || word_known(wn->seen, (char *) term))
+        return;
+    w = word_new_hashed((char *) term, len, 0, hash);
+    if (set_store(wn->seen, w) == TABLE_SET_FAIL) err(1, "set_store failure");
+    v_array_append(wn->words, w);
+}
+
+/* Make a word for each token hash in M, named from the merged sets'
+ * term dictionaries. Returns them in an array, sorted by hash. (If two
+ * tokens share a hash, queries can't tell them apart anyway, so the
+ * first stands in for both.) */
+static v_array *load_words(context *c, merge *m) {
+    v_array *words = v_array_new(16);
+    word_names wn;
+    word *w;
+    terms t;
+    char *buf;
+    ulong len;
+    uint i, o = 0;
+
+    h_array_sort(m->thashes);
+    h_array_uniq(m->thashes);
+    wn.m = m;
+    wn.seen = word_set_init(0);
+    wn.words = words;
+    for (i=m->first; i<m->set_ct; i++) {
+        len = db_read_terms(c, m->toffs[i], &buf);
+        if (buf == NULL) continue;
+        if (terms_open(&t, buf, len) < 0)
+            errx(1, "token.db: corrupt term dictionary, rebuild db");
+        terms_each(&t, name_word, &wn);
+        dealloc(buf, 'K');
+    }
+    set_free(wn.seen, NULL);
+
+    v_array_sort(words, word_hash_cmp);
+    for (i=0; i<words->len; i++) {
+        w = (word *) words->vs[i];
+        if (o > 0 && ((word *) words->vs[o - 1])->hash == w->hash) {
+            word_free(w);
+        } else {
+            words->vs[o++] = w;
+        }
+    }
+    words->len = o;
+    return words;
+}
+
+static int merge_file_cmp(const void *a, const void *b) {
+    return strcmp((*(merge_file **) a)->fn->name, (*(merge_file **) b)->fn->name);
+}
+
+/* Give the merged files doc IDs from c->doc_base, in path order, and
+ * return them in the files' original (forward index) order. */
+static uint *assign_doc_ids(context *c, merge *m) {
+    uint i, n = v_array_length(m->files);
+    uint *docs = alloc(n * sizeof(uint) + 1, 'm');
+    v_array *sorted = v_array_new(n + 1);
+    merge_file *mf;
+    for (i=0; i<n; i++) v_array_append(sorted, v_array_get(m->files, i));
+    v_array_sort(sorted, merge_file_cmp);
+    for (i=0; i<n; i++)
+        ((merge_file *) v_array_get(sorted, i))->fn->id = c->doc_base + i;
+    for (i=0; i<n; i++) {
+        mf = (merge_file *) v_array_get(m->files, i);
+        docs[i] = mf->fn->id;
+    }
+    c->doc_ct = n;
+    v_array_free(sorted, NULL);
+    return docs;
+}
+
+/* Build c->fn_set and c->word_set from the merged files. */
+static void build_sets(context *c, merge *m) {
+    v_array *words = load_words(c, m);
+    merge_file *mf;
+    word *w;
+    uint i, j;
+
+    for (i=0; i<v_array_length(words); i++) {
+        w = (word *) v_array_get(words, i);
+        if (set_store(c->word_set, w) == TABLE_SET_FAIL)
+            err(1, "set_store failure");
+        c->t_ct++;
+    }
+
+    for (i=0; i<v_array_length(m->files); i++) {
+        mf = (merge_file *) v_array_get(m->files, i);
+        for (j=0; j<h_array_length(mf->toks); j++) {
+            w = find_word(words, h_array_get(mf->toks, j));
+            if (w == NULL) errx(1, "term dictionaries are incomplete, rebuild db");
+            h_array_append(w->a, mf->fn->id);
+            w->count++;
+        }
+        fname_add(c->fn_set, mf->fn);
+        h_array_free(mf->toks);
+        dealloc(mf, 'm');
+    }
+    v_array_free(words, NULL);
+}
+
+/* Open a new DB file to write the merged sets into. */
+static int open_new_db(context *c, const char *fname, char **path) {
+    int fd;
+    *path = gln_path(c, fname);
+    fd = open(*path, O_RDWR | O_CREAT | O_TRUNC, 0744);
+    if (fd == -1) err(1, "%s", *path);
+    return fd;
+}
+
+/* Replace the DB at PATH, open as FD, with the new one at NPATH. */
+static void replace_db(int fd, const char *path, const char *npath) {
+    if (close(fd) == -1) err(1, "close");
+    if (rename(npath, path) == -1) err(1, "%s", path);
+}
+
+int compact_index(context *c) {
+    ulong *toffs, *foffs, *sizes;
+    char *tpath, *fpath, *ntpath, *nfpath;
+    uint i, n, first, *docs;
+    int ntfd, nffd, otfd, offd, res;
+    tombstones *t;
+    merge m;
+
+    n = db_set_offsets(c, 1, &toffs);
+    if (db_set_offsets(c, 0, &foffs) != n)
+        errx(1, "token and filename DBs don't match, rebuild db");
+    tpath = gln_path(c, ".gln/tombstones");
+    t = forward_read_tombstones(tpath);
+    dealloc(tpath, 'p');
+
+    sizes = alloc(n * sizeof(ulong), 's');
+    for (i=0; i<n; i++)
+        sizes[i] = (toffs[i + 1] - toffs[i]) + (foffs[i + 1] - foffs[i]);
+    first = (c->compact_all || n == 0) ? 0 : pick_first_set(sizes, n);
+    dealloc(sizes, 's');
+
+    if (n == 0 || (n - first < 2 && !(c->compact_all && t->len > 0))) {
+        if (c->verbose) fprintf(stderr, "-- Nothing to compact (%u sets)\n", n);
+        res = 0;
+        goto cleanup;
+    }
+    if (c->verbose || c->show_progress)
+        fprintf(stderr, "-- Merging sets %u to %u of %u\n", first, n - 1, n);
+
+    m.first = first;
+    m.set_ct = n;
+    m.toffs = toffs;
+    m.files = v_array_new(16);
+    m.thashes = h_array_new(16);
+    forward_each(c, t, collect_file, &m);
+    c->doc_base = db_set_first_doc(c, foffs[first]);
+    docs = assign_doc_ids(c, &m);
+    build_sets(c, &m);
+    v_array_free(m.files, NULL);
+    h_array_free(m.thashes);
+
+    /* Write the merged set after copies of the sets before it, then
+     * swap the new DBs in for the old ones. */
+    ntfd = open_new_db(c, ".gln/token.db.new", &ntpath);
+    nffd = open_new_db(c, ".gln/fname.db.new", &nfpath);
+    if (first > 0) {
+        db_copy_sets(c->tdb_fd, ntfd, toffs, first);
+        db_copy_sets(c->fdb_fd, nffd, foffs, first);
+    }
+    otfd = c->tdb_fd;
+    offd = c->fdb_fd;
+    c->tdb_fd = ntfd;
+    c->fdb_fd = nffd;
+    c->update = first > 0;
+    if ((res = db_write(c)) == 0) {
+        forward_compact(c, t, first, c->doc_base, docs);
+        tpath = gln_path(c, ".gln/token.db");
+        fpath = gln_path(c, ".gln/fname.db");
+        replace_db(otfd, tpath, ntpath);
+        replace_db(offd, fpath, nfpath);
+        dealloc(tpath, 'p');
+        dealloc(fpath, 'p');
+    }
+    dealloc(ntpath, 'p');
+    dealloc(nfpath, 'p');
+    dealloc(docs, 'm');
+
+cleanup:
+    forward_free_tombstones(t);
+    dealloc(toffs, 'o');
+    dealloc(foffs, 'o');
+    return res;
+}
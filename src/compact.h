@@ -0,0 +1,8 @@
+#ifndef COMPACT_H
+#define COMPACT_H
+
+/* Merge the index's newest sets into one, choosing them by size
+ * (or merge every set, if c->compact_all). Returns <0 on error. */
+int compact_index(context *c);
+
+#endif
@@ -1,6 +1,11 @@
+#if defined(__linux__)
+#define _GNU_SOURCE             /* for fallocate */
+#endif
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/uio.h>
 #include <stdint.h>
 #include <assert.h>
 #include <string.h>
@@ -8,6 +13,8 @@
 #include <errno.h>
 #include <zlib.h>
 #include <ctype.h>
+#include <limits.h>
+#include <pthread.h>
 
 #include "glean.h"
 #include "set.h"
@@ -16,11 +23,16 @@
 #include "array.h"
 #include "gln_index.h"
 #include "db.h"
+#include "spill.h"
 #include "dumphex.h"
+#include "lz.h"
+#include "dict.h"
+#include "vbyte.h"
+#include "terms.h"
 
 /*
  * $WRKDIR/.gln/
- *    tokens.db
+ *    tokens.db   (with each set's term dictionary, see terms.h)
  *    files.db
  *    timestamp   (0-byte file, used for find, when updating)
  *    config      (options used for this db)
@@ -29,7 +41,8 @@
  *    when building, tokens.db.new, files.db.new, timestamp.new
  *  */
 
-typedef ulong (pack_fun)(context *c, dbdata *d, s_link *t);
+/* Pack bucket I of a DB into d->buf. */
+typedef void (pack_fun)(context *c, dbdata *d, uint i);
 
 #define HB HASH_BYTES
 
@@ -45,22 +58,34 @@ static dbdata *init_dbdata(int fdb_fd, int tdb_fd) {
     db->dbufsz = DEF_BUF_SZ;
     db->maxbufsz = 0;
     db->o = 0;
+    db->sampling = 0;
+    db->dict = NULL;
+    db->dictlen = 0;
+    db->lzd = NULL;
+    db->zs = NULL;
     return db;
 }
 
-static z_stream strm;
+static void free_dbdata(dbdata *db) {
+    if (db->zs) {
+        (void) deflateEnd(db->zs);
+        dealloc(db->zs, 'z');
+    }
+    dealloc(db->buf, 'b');
+    dealloc(db->dbuf, 'b');
+    dealloc(db, 'd');
+}
 
-void init_zlib() {
-    int res;
-    /* custom allocators could be used here */
-    strm.zalloc = Z_NULL; strm.zfree = Z_NULL; strm.opaque = Z_NULL;
-    res = deflateInit(&strm, DEF_ZLIB_COMPRESS);
-    assert(res == Z_OK);
+/* Use dictionary DICT (of LEN bytes, or none if NULL) for DB's buckets. */
+static void use_dict(dbdata *db, const char *dict, ulong len) {
+    db->dict = dict;
+    db->dictlen = len;
+    db->lzd = dict ? lz_dict_new((const unsigned char *) dict, len) : NULL;
 }
 
-void free_zlib() {
-    int res = deflateEnd(&strm);
-    assert(res == Z_OK);
+static void drop_dict(dbdata *db) {
+    if (db->lzd) lz_dict_free(db->lzd);
+    use_dict(db, NULL, 0);
 }
 
 static void buf_int32(char *buf, u_int32_t n, ulong offset) {
@@ -93,10 +118,143 @@ static void buf_hash(char *buf, u_int32_t n, ulong offset) {
     assert(0);
 }
 
-static void write_int32(int fd, u_int32_t n) {
+
+/* Read a 4-byte int at OFFSET in the file. */
+static u_int32_t pread_int32(int fd, ulong offset) {
+    unsigned char buf[4];
+    if (pread(fd, buf, 4, offset) != 4) err(1, "pread");
+    return buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((u_int32_t) buf[3] << 24);
+}
+
+/**********
+ * Output *
+ **********/
+
+/* Write the IOVCT buffers in IOV at OFFSET, retrying after short
+ * writes. IOV is modified. */
+static void pwritev_all(int fd, struct iovec *iov, int iovct, ulong offset) {
+    ssize_t sz;
+    while (iovct > 0) {
+        sz = pwritev(fd, iov, iovct, offset);
+        if (sz < 0) {
+            if (errno == EINTR) continue;
+            err(1, "pwritev");
+        }
+        offset += sz;
+        while (iovct > 0 && (size_t) sz >= iov->iov_len) {
+            sz -= iov->iov_len;
+            iov++;
+            iovct--;
+        }
+        if (iovct > 0) {
+            iov->iov_base = (char *) iov->iov_base + sz;
+            iov->iov_len -= sz;
+        }
+    }
+}
+
+static void pwrite_all(int fd, const void *buf, size_t len, ulong offset) {
+    struct iovec iov;
+    iov.iov_base = (void *) buf;
+    iov.iov_len = len;
+    pwritev_all(fd, &iov, 1, offset);
+}
+
+/* Buffered writer for a DB file. Data is appended at the current
+ * offset, gathered into DB_WRITE_BUF_SZ writes; anything larger than
+ * the buffer is written along with it, in one pwritev. Where the
+ * filesystem supports it, space is reserved ahead of the writes (as
+ * much again as has been written, up to DB_PREALLOC_SZ), to reduce
+ * fragmentation; whatever isn't used is released by dbout_close. */
+typedef struct dbout {
+    int fd;
+    ulong start;            /* starting offset */
+    ulong o;                /* file offset of buf[0] */
+    char *buf;
+    size_t len;
+    ulong reserved;         /* space is reserved up to here */
+} dbout;
+
+static void dbout_init(dbout *out, int fd, ulong offset) {
+    out->fd = fd;
+    out->start = out->o = offset;
+    out->buf = alloc(DB_WRITE_BUF_SZ, 'b');
+    out->len = 0;
+    out->reserved = DB_PREALLOC_SZ ? offset : ULONG_MAX;
+}
+
+/* Reserve space for writes up to offset END, if supported. If it
+ * fails, don't try again; any real problem will show up when writing. */
+static void dbout_reserve(dbout *out, ulong end) {
+    ulong ahead = end - out->start;
+    if (end <= out->reserved) return;
+    if (ahead > DB_PREALLOC_SZ) ahead = DB_PREALLOC_SZ;
+#if defined(__linux__)
+    if (fallocate(out->fd, FALLOC_FL_KEEP_SIZE, out->reserved,
+            end + ahead - out->reserved) == 0) {
+        out->reserved = end + ahead;
+        return;
+    }
+#endif
+    out->reserved = ULONG_MAX;
+}
+
+/* Write LEN bytes of BUF (if any) after the buffered data. */
+static void dbout_flush_with(dbout *out, const char *buf, size_t len) {
+    struct iovec iov[2];
+    int ct = 0;
+    if (out->len + len == 0) return;
+    dbout_reserve(out, out->o + out->len + len);
+    if (out->len > 0) {
+        iov[ct].iov_base = out->buf;
+        iov[ct++].iov_len = out->len;
+    }
+    if (len > 0) {
+        iov[ct].iov_base = (void *) buf;
+        iov[ct++].iov_len = len;
+    }
+    pwritev_all(out->fd, iov, ct, out->o);
+    out->o += out->len + len;
+    out->len = 0;
+}
+
+static void dbout_write(dbout *out, const char *buf, size_t len) {
+    if (out->len + len <= DB_WRITE_BUF_SZ) {
+        memcpy(out->buf + out->len, buf, len);
+        out->len += len;
+    } else if (len >= DB_WRITE_BUF_SZ / 2) {
+        dbout_flush_with(out, buf, len);
+    } else {
+        dbout_flush_with(out, NULL, 0);
+        memcpy(out->buf, buf, len);
+        out->len = len;
+    }
+}
+
+static void dbout_int32(dbout *out, u_int32_t n) {
     char buf[4];
     buf_int32(buf, n, 0);
-    write(fd, buf, 4);
+    dbout_write(out, buf, 4);
+}
+
+/* Leave a LEN-byte gap, to be filled in later with pwrite_all. */
+static void dbout_skip(dbout *out, size_t len) {
+    dbout_flush_with(out, NULL, 0);
+    out->o += len;
+}
+
+/* Flush the buffered data, and free the buffer. The file ends where
+ * the writes did, so any unused reservation past it is released. */
+static void dbout_close(dbout *out) {
+    dbout_flush_with(out, NULL, 0);
+    if (out->reserved > out->o && out->reserved != ULONG_MAX
+        && ftruncate(out->fd, out->o) == -1)
+        err(1, "ftruncate");
+    dealloc(out->buf, 'b');
+}
+
+static void sync_fd(context *c, int fd) {
+    if (c->fsync && fsync(fd) == -1) err(1, "fsync");
 }
 
 /* Keep stats on compression ratios? */
@@ -112,8 +270,7 @@ static void grow_buf(dbdata *db, ulong sz) {
     if (nsz > MAX_MEMORY) err(1, "buffer too large");
     if (DB_DEBUG) fprintf(stderr, "-- Resizing buf from %lu to %lu\n", db->bufsz, nsz);
     assert(db->buf);
-    nbuf = realloc(db->buf, nsz);
-    if (nbuf == NULL) err(1, "realloc fail");
+    nbuf = ralloc(db->buf, nsz, 'b');
     db->buf = nbuf;
     db->bufsz += sz; /* out of memory before overflow */
 }
@@ -126,55 +283,91 @@ static void grow_dbuf(dbdata *db, ulong sz) {
     if (DB_DEBUG) fprintf(stderr, "-- Resizing dbuf from %lu to %lu\n", db->dbufsz, nsz);
     
     assert(db->dbuf);
-    ndbuf = realloc(db->dbuf, nsz);
-    if (ndbuf == NULL) {
-        fprintf(stderr, "Cannot realloc %lu bytes\n", sz);
-        err(1, "realloc fail");
-    }
+    ndbuf = ralloc(db->dbuf, nsz, 'b');
     db->dbuf = ndbuf;
     db->dbufsz += sz; /* out of memory before overflow */
 }
 
-/* Compress current buffer into destination buffer, resizing as necessary. */
+/* Compress current buffer into destination buffer, after PAD bytes,
+ * resizing as necessary. Each dbdata keeps its own deflate state, so
+ * buckets can be compressed on several threads. */
 static ulong compress_buffer(dbdata *db, int pad) {
-    ulong destlen = db->dbufsz;
-    int res, srclen = db->o;
-    if (SKIP_COMPRESS) { db->dbuf = db->buf; return db->o; }
-    
-    /* FIXME: While compress *should* just return Z_BUF_ERROR when the buffer is
-     * not large enough, it seems to cause a crash on Linux.
-     * Valgrind points to an off-by-one error occurring in compress. */
-    while (db->dbufsz < srclen) grow_dbuf(db, db->dbufsz);
+    z_stream *zs = db->zs;
+    ulong destlen, srclen = db->o;
+    int res;
     
-    if (DB_DEBUG) fprintf(stderr, "compressing: %d in dbuf of sz %lu\n", srclen, destlen);
-    res = compress((unsigned char *) db->dbuf + pad, &destlen,
-        (unsigned char *) db->buf, srclen);
-    if (DB_DEBUG) fprintf(stderr, "res:%d, destlen %lu\n", res, destlen);
-    while (res == Z_BUF_ERROR) {
-        if (DB_DEBUG) fprintf(stderr, "z_buf_error, resizing\n");
-        grow_dbuf(db, db->dbufsz); /* double size */
-        destlen = db->dbufsz;
-        res = compress((unsigned char *) db->dbuf + pad, &destlen,
-            (unsigned char *)db->buf, srclen);
-        if (DB_DEBUG) fprintf(stderr, " (r) res:%d, destlen %lu\n", res, destlen);
+    if (zs == NULL) {
+        zs = db->zs = alloc(sizeof(z_stream), 'z');
+        zs->zalloc = Z_NULL; zs->zfree = Z_NULL; zs->opaque = Z_NULL;
+        res = deflateInit(zs, DEF_ZLIB_COMPRESS);
+    } else {
+        res = deflateReset(zs);
     }
+    if (res == Z_OK && db->dict)
+        res = deflateSetDictionary(zs, (const Bytef *) db->dict, db->dictlen);
+    if (res != Z_OK) errx(1, "zlib error: %d", res);
     
-    if (DB_DEBUG) printf("In: %ld\tOut: %ld\tRes: %d\n", db->o, destlen, res);
-    if (res != Z_OK) {
+    while (db->dbufsz < pad + deflateBound(zs, srclen))
+        grow_dbuf(db, db->dbufsz);
+    zs->next_in = (Bytef *) db->buf;
+    zs->avail_in = srclen;
+    zs->next_out = (Bytef *) db->dbuf + pad;
+    zs->avail_out = db->dbufsz - pad;
+    if (DB_DEBUG) fprintf(stderr, "compressing: %lu in dbuf of sz %lu\n",
+        srclen, db->dbufsz);
+    res = deflate(zs, Z_FINISH);
+    if (res != Z_STREAM_END) {
         fprintf(stderr, "ZLib error: %d\n", res);
-        fprintf(stderr, "in buf: %d, out buf: %lu, destlen: %lu\n",
-            srclen, db->dbufsz, destlen);
+        fprintf(stderr, "in buf: %lu, out buf: %lu\n", srclen, db->dbufsz);
         exit(1);
     }
-    assert(res == Z_OK);
+    destlen = zs->total_out;
+    if (DB_DEBUG) printf("In: %ld\tOut: %ld\tRes: %d\n", db->o, destlen, res);
 #if PROFILE_COMPRESSION
-    db_bytes_in += db->o;
-    db_bytes_out += destlen;
+    __atomic_add_fetch(&db_bytes_in, db->o, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&db_bytes_out, destlen, __ATOMIC_RELAXED);
 #endif
-    db->maxbufsz = srclen > db->maxbufsz ? srclen : db->maxbufsz;
     return destlen;
 }
 
+/* Compress the current buffer with lz.c, as compress_buffer does.
+ * Returns 0 if that wouldn't save any space. */
+static ulong lz_buffer(dbdata *db, int pad) {
+    while (db->dbufsz < pad + db->o) grow_dbuf(db, db->dbufsz);
+    return lz_compress(db->lzd, (unsigned char *) db->buf, db->o,
+        (unsigned char *) db->dbuf + pad, db->o - 1);
+}
+
+/* Encode the current buffer into the destination buffer, after its
+ * header: [codec ID/1]['X' * (DB_X_CT - 1)][encoded byte count/4].
+ * Buckets of at most DB_RAW_MAX_SZ bytes, or that don't compress,
+ * are stored raw. Returns the bucket's total length. */
+static ulong encode_bucket(context *c, dbdata *db) {
+    int i, xo = DB_X_CT, pad = xo + 4;
+    char codec = c->codec;
+    ulong len = 0;
+    if (db->o <= DB_RAW_MAX_SZ || SKIP_COMPRESS) codec = CODEC_RAW;
+    if (codec == CODEC_LZ) {
+        len = lz_buffer(db, pad);
+    } else if (codec == CODEC_ZLIB) {
+        len = compress_buffer(db, pad);
+    }
+    if (len == 0 || len >= db->o) {
+        codec = CODEC_RAW;
+        while (db->dbufsz < pad + db->o) grow_dbuf(db, db->dbufsz);
+        memcpy(db->dbuf + pad, db->buf, db->o);
+        len = db->o;
+    } else if (db->o > db->maxbufsz) {
+        db->maxbufsz = db->o;
+    }
+    if (DB_DEBUG) fprintf(stderr, "Adding %c bucket, length %lu (0x%04lx)\n",
+        codec, len, len);
+    db->dbuf[0] = codec;
+    for (i=1; i<xo; i++) db->dbuf[i] = 'X';
+    buf_int32(db->dbuf, len, xo); /* encoded byte count at head */
+    return len + pad;
+}
+
 
 /******************/
 /* Database files */
@@ -191,56 +384,33 @@ void db_init_files(context *c) {
 
 static char *gln_file_header = "glnF " GLN_VERSION_STRING " ";
 
-static ulong pack_fname_bucket(context *c, dbdata* db, s_link *tl) {
+static void pack_fname_bucket(context *c, dbdata* db, uint b) {
     fname *fn;
-    s_link *cur;
     char *name;
-    hash_t fhash;
-    ulong co = 0, lo = 0, len;  /* current + last offsets */
-    int i, link=0, xo=DB_X_CT;
+    uint i, id = b * FNAME_BUCKET_CT, ct = c->doc_ct - id;
+    ulong len;
     
     /* filename bucket buffer format:
-     * [byte length for compressed bucket/4]
-     * This portion is deflated:
-     *   [next fname offset (relative), or NULL/4]
-     *    Repeated: [hash/4] [fname and \0]
+     * [codec/1][byte length for encoded bucket/4]
+     * This portion is encoded (see encode_bucket):
+     *   [offset of each name (relative)/4, in doc ID order]
+     *   Repeated: [fname and \0]
+     * Doc IDs whose files were skipped get an empty name.
      */
     assert(db->o == 0);
-    for (cur = tl; cur != NULL; cur = cur->next) {
-        fn = (fname *)cur->key;
-        name = fn->name;
+    if (ct > FNAME_BUCKET_CT) ct = FNAME_BUCKET_CT;
+    while (db->bufsz <= ct * 4) grow_buf(db, db->bufsz);
+    db->o = ct * 4;
+    for (i=0; i<ct; i++) {
+        fn = c->docs[id + i];
+        name = fn ? fn->name : "";
         len = strlen(name) + 1;
-        if (DB_DEBUG && 0)
-            fprintf(stderr, "Packing link %d starting at %lu\n", link++, db->o);
-        
-        while (db->bufsz <= db->o + (4 + HB + len + 4 + xo))
-            grow_buf(db, db->bufsz);
-        
-        co = db->o;
-        buf_int32(db->buf, co, lo);   /* prev->this */
-        buf_int32(db->buf, 0, co);    /* set to 0 (for now) */
-        db->o += 4;
-        
-        fhash = word_hash(name);
-        buf_hash(db->buf, fhash, db->o);
-        db->o += HB;
-        if (DB_DEBUG) fprintf(stderr, "  %lu (+%ld) -> %04x : %s\n",
-            len, db->o, fhash, name);
-        
-        if (DB_DEBUG) fprintf(stderr, "bufsz: %lu, db->o: %lu, len: %lu\n", db->bufsz, db->o, len);
-        while (db->bufsz <= db->o + len) { grow_buf(db, db->bufsz); }
-        
-        if (DB_DEBUG) fprintf(stderr, "old o: %lu, plus len: %lu\n", co, len);
+        while (db->bufsz <= db->o + len) grow_buf(db, db->bufsz);
+        buf_int32(db->buf, db->o, i * 4);
         memcpy(db->buf + db->o, name, len);
-        db->o += len + 1;
-        
-        lo = co;
+        if (DB_DEBUG) fprintf(stderr, "  doc %u -> %s\n", c->doc_base + id + i, name);
+        db->o += len;
     }
-    len = compress_buffer(db, xo + 4); /* +4: shift to include data length */
-    if (DB_DEBUG) fprintf(stderr, "Adding compressed buffer length %lu (0x%04lx)\n", len, len);
-    for (i=0; i<xo; i++) db->dbuf[i] = 'X';
-    buf_int32(db->dbuf, len, xo); /* compressed byte count at head */
-    return len + 4 + xo;
 }
 
 
@@ -250,22 +420,50 @@ static ulong pack_fname_bucket(context *c, dbdata* db, s_link *tl) {
 
 static char *gln_token_header = "glnT " GLN_VERSION_STRING " ";
 
-static ulong pack_token_bucket(context *c, dbdata* db, s_link *tl) {
+/* Most space pack_postings could need for N doc IDs. */
+static ulong posting_bound(uint n) {
+    uint blocks = (n + POSTING_BLOCK_CT - 1) / POSTING_BLOCK_CT;
+    return VBYTE_BOUND(n) + (blocks > 1 ? blocks * 9 : 0);
+}
+
+/* Write A's (sorted) doc IDs to BUF, in blocks if there are more
+ * than POSTING_BLOCK_CT. Returns the length. */
+static ulong pack_postings(h_array *a, char *buf) {
+    uint i, n, blocks = (a->len + POSTING_BLOCK_CT - 1) / POSTING_BLOCK_CT;
+    ulong o = blocks * 8;
+    if (blocks <= 1) return vbyte_encode(a->hs, a->len, (unsigned char *) buf);
+    for (i=0; i<blocks; i++) {
+        n = a->len - i * POSTING_BLOCK_CT;
+        if (n > POSTING_BLOCK_CT) n = POSTING_BLOCK_CT;
+        o += vbyte_encode(a->hs + i * POSTING_BLOCK_CT, n,
+            (unsigned char *) buf + o);
+        buf_int32(buf, a->hs[i * POSTING_BLOCK_CT + n - 1], i * 8);
+        buf_int32(buf, o - blocks * 8, i * 8 + 4);
+    }
+    return o;
+}
+
+static void pack_token_bucket(context *c, dbdata* db, uint b) {
+    s_link *tl = c->word_set->b[b];
     word *w;
     s_link *cur;
-    ulong co = 0, lo = 0, len;  /* current + last word offsets */
-    ulong lho = 0, hashct;           /* last hash offset */
-    int i, link = 0, xo=DB_X_CT;
+    ulong co = 0, lo = 0;       /* current + last word offsets */
+    int i, link = 0;
     hash_t hash;
     h_array *a;
     
 #define DEBUG_WD 0
     
     /* token bucket buffer format:
-     * [byte length for compressed bucket/4]
-     * This portion is deflated:
+     * [codec/1][byte length for encoded bucket/4]
+     * This portion is encoded (see encode_bucket):
      *   [next word offset (relative), or NULL/4]
-     *   [word hash/HB] [file hash count/2] [file hashes/HB*N]
+     *   [word hash/HB] [doc ID count/4]
+     *   [doc IDs, sorted, in Stream VByte (see vbyte.h)]
+     * Past POSTING_BLOCK_CT doc IDs, they're split into blocks
+     * of that many, each coded on its own, after a skip table:
+     *   [per block: last doc ID/4, end of block (relative)/4]
+     *   [blocks]
      */
     assert(db->o == 0);
     for (cur = tl; cur != NULL; cur = cur->next) {
@@ -273,14 +471,16 @@ static ulong pack_token_bucket(context *c, dbdata* db, s_link *tl) {
             fprintf(stderr, "Packing link %d starting at %lu\n", link++, db->o);
         
         w = (word *) cur->key;
-        fprintf(c->tlog, "%s\n", w->name); /* append words to log */
-        hash = word_hash(w->name);
+        if (c->spill && !db->sampling) spill_load(c->spill, w);
+        hash = w->hash;
         a = w->a;
         assert(a);
         if (DEBUG_WD) fprintf(stderr, "Word is %s (%04x): %u occs (%d), ",
             w->name, hash, w->count, w->stop);
         
-        while (db->bufsz <= db->o + (4 + HB + 2 + a->len*HB)) {
+        h_array_sort(a);
+        h_array_uniq(a);
+        while (db->bufsz <= db->o + (4 + HB + 4 + posting_bound(a->len))) {
             grow_buf(db, db->bufsz); /* 2*sz */
         }
         
@@ -292,34 +492,26 @@ static ulong pack_token_bucket(context *c, dbdata* db, s_link *tl) {
         buf_hash(db->buf, hash, db->o);
         db->o += HB;
         
-        lho = db->o;    /* save offset; hash count goes here later */
-        db->o += 2;
-        hashct = 0;
-        for (i=0; i<a->len; i++) {
-            hashct++;
-            buf_hash(db->buf, h_array_get(a, i), db->o); /* file hashes */
-            db->o += HB;
-            if (DEBUG_WD) fprintf(stderr, " %04x", h_array_get(a, i));
+        buf_int32(db->buf, a->len, db->o); /* doc ID count */
+        db->o += 4;
+        db->o += pack_postings(a, db->buf + db->o);
+        if (DEBUG_WD) {
+            for (i=0; i<a->len; i++) fprintf(stderr, " %04x", h_array_get(a, i));
+            fprintf(stderr, "\n");
         }
-        if (DEBUG_WD) fprintf(stderr, "\n");
         if (w->stop) { /* extremely common token -> skip it */
-            fprintf(c->swlog, "%s\n", w->name); /* add to stop word log */
+            if (!db->sampling)
+                fprintf(c->swlog, "%s\n", w->name); /* add to stop word log */
             if (DEBUG)
                 fprintf(stderr, "Skipping stop word '%s', %u instances\n",
                     w->name, w->count);
             db->o = co; /* roll back */
         } else {
-            buf_int16(db->buf, hashct, lho); /* hash count */
-            if (DEBUG) fprintf(stderr, " -- hash count: %lu\n\n", hashct);
+            if (DEBUG) fprintf(stderr, " -- hash count: %u\n\n", a->len);
         }
+        if (c->spill && !db->sampling) h_array_clear(a);
         lo = co;
     }
-    
-    len = compress_buffer(db, xo + 4); /* +4: shift to include data length */
-    if (DB_DEBUG) fprintf(stderr, "Adding compressed buffer length %lu (0x%04lx)\n", len, len);
-    for (i=0; i<xo; i++) db->dbuf[i] = 'X';
-    buf_int32(db->dbuf, len, xo); /* compressed byte count at head */
-    return len + 4 + xo;
 }
 
 
@@ -330,83 +522,464 @@ static ulong pack_token_bucket(context *c, dbdata* db, s_link *tl) {
 static void update_max_bufsize(int fd, int offset, ulong sz) {
     char buf[4];
     buf_int32(buf, sz, 0);
-    /* TODO, when updating, compare */
-    lseek(fd, offset, SEEK_SET);
-    write(fd, buf, 4);
+    pwrite_all(fd, buf, 4, offset);
 }
 
-static void write_set_data(context *c, dbdata *db, int fd, set *s,
-                             char *header, pack_fun *pack) {
-    int i;
+/* Check an existing DB's header, and find the offset of its last set.
+ * Its current max buffer size is saved in *MAXBUFSZ. */
+static ulong find_last_set(int fd, char *header, ulong *maxbufsz) {
+    uint len = strlen(header);
+    char *buf = alloc(len, 'b');
+    ulong o, next;
+    if (pread(fd, buf, len, 0) != len || strncmp(buf, header, len) != 0)
+        errx(1, "can't update: bad header or DB version, rebuild db");
+    dealloc(buf, 'b');
+    *maxbufsz = pread_int32(fd, len);
+    o = pread_int32(fd, len + 4);
+    while ((next = pread_int32(fd, o)) != 0) o = next;
+    return o;
+}
+
+/* Read the preset dictionary from an existing DB's header into *DICT,
+ * and return its length. (DBs from before dictionaries have none.) */
+static ulong read_dict(int fd, char *header, char **dict) {
+    uint len = strlen(header);
+    ulong dictlen;
+    *dict = NULL;
+    if (pread_int32(fd, len + 4) <= len + 8) return 0;
+    dictlen = pread_int32(fd, len + 8);
+    if (dictlen == 0) return 0;
+    *dict = alloc(dictlen, 'Z');
+    if (pread(fd, *dict, dictlen, len + 12) != dictlen)
+        errx(1, "can't update: truncated dictionary, rebuild db");
+    return dictlen;
+}
+
+/* Train a preset dictionary on a sample of the BUCKET_CT buckets, evenly
+ * spaced, packed but not compressed. Buckets small enough to be
+ * stored raw are skipped. Returns its length, and the dictionary in
+ * *DICT. (When postings have been spilled, they aren't sampled.) */
+static ulong train_dict(context *c, dbdata *db, uint bucket_ct, pack_fun *pack,
+                        char **dict) {
+    unsigned char *samples = alloc(DB_DICT_SAMPLE_SZ, 'Z');
+    size_t *lens = alloc(DB_DICT_SAMPLE_CT * sizeof(size_t), 'Z');
+    size_t len = 0, cap;
+    uint i, ct = 0, step = bucket_ct / DB_DICT_SAMPLE_CT + 1;
+    ulong dictlen;
+    
+    db->sampling = 1;
+    for (i=0; i < bucket_ct && ct < DB_DICT_SAMPLE_CT; i += step) {
+        db->o = 0;
+        pack(c, db, i);
+        if (db->o <= DB_RAW_MAX_SZ || len + db->o > DB_DICT_SAMPLE_SZ) continue;
+        memcpy(samples + len, db->buf, db->o);
+        len += db->o;
+        lens[ct++] = db->o;
+    }
+    db->sampling = 0;
+    
+    /* Keep the dictionary small next to the data it's for. */
+    cap = len / DB_DICT_SAMPLE_RATIO;
+    if (cap > DB_DICT_SZ) cap = DB_DICT_SZ;
+    *dict = alloc(DB_DICT_SZ, 'Z');
+    dictlen = dict_train(samples, lens, ct, (unsigned char *) *dict, cap);
+    if (DB_DEBUG) fprintf(stderr, "Trained %lu byte dictionary on %u buckets "
+        "(%zu bytes)\n", dictlen, ct, len);
+    dealloc(lens, 'Z');
+    dealloc(samples, 'Z');
+    return dictlen;
+}
+
+/* Get the offsets of each set in a DB, oldest first, followed by the
+ * end of the file. Returns the set count. */
+static uint set_offsets(int fd, char *header, ulong **offsets) {
+    uint len = strlen(header), ct = 0, sz = 8;
+    ulong o, maxbufsz, *offs = alloc(sz * sizeof(ulong), 'o');
+    (void) find_last_set(fd, header, &maxbufsz);
+    for (o = pread_int32(fd, len + 4); o != 0; o = pread_int32(fd, o)) {
+        if (ct + 1 >= sz) {
+            sz *= 2;
+            offs = ralloc(offs, sz * sizeof(ulong), 'o');
+        }
+        offs[ct++] = o;
+    }
+    offs[ct] = lseek(fd, 0, SEEK_END);
+    *offsets = offs;
+    return ct;
+}
+
+uint db_set_offsets(context *c, int token, ulong **offsets) {
+    if (token) return set_offsets(c->tdb_fd, gln_token_header, offsets);
+    return set_offsets(c->fdb_fd, gln_file_header, offsets);
+}
+
+/* Count the sets already in the token DB. */
+uint db_set_count(context *c) {
+    ulong *offsets;
+    uint ct = db_set_offsets(c, 1, &offsets);
+    dealloc(offsets, 'o');
+    return ct;
+}
+
+void db_copy_sets(int from, int to, ulong *offsets, uint keep) {
+    char buf[BUFSIZ];
+    ulong o = 0, end = offsets[keep];
+    ssize_t sz;
+    assert(keep > 0);
+    while (o < end) {
+        sz = pread(from, buf, end - o < BUFSIZ ? end - o : BUFSIZ, o);
+        if (sz <= 0) err(1, "pread");
+        pwrite_all(to, buf, sz, o);
+        o += sz;
+    }
+    buf_int32(buf, 0, 0);       /* unlink the sets after KEEP */
+    pwrite_all(to, buf, 4, offsets[keep - 1]);
+}
+
+uint db_set_first_doc(context *c, ulong offset) {
+    return pread_int32(c->fdb_fd, offset + 8);
+}
+
+ulong db_read_terms(context *c, ulong offset, char **buf) {
+    ulong o = pread_int32(c->tdb_fd, offset + 16), len;
+    *buf = NULL;
+    if (o == 0) return 0;
+    len = pread_int32(c->tdb_fd, o);
+    *buf = alloc(len, 'K');
+    if (pread(c->tdb_fd, *buf, len, o) != len)
+        errx(1, "token.db: truncated term dictionary, rebuild db");
+    return len;
+}
+
+uint db_next_doc(context *c) {
+    ulong maxbufsz, o = find_last_set(c->fdb_fd, gln_file_header, &maxbufsz);
+    return pread_int32(c->fdb_fd, o + 8) + pread_int32(c->fdb_fd, o + 12);
+}
+
+/* Note that bucket I's data starts at the current offset DB->fo, then
+ * advance past its LEN bytes. */
+static void note_bucket(dbdata *db, char *bkbuf, int i, uint len) {
+    buf_int32(bkbuf, db->fo, i * 4);
+    if (DB_DEBUG) fprintf(stderr, "Wrote %ld (0x%04lx) to bkbuf at %d\n",
+        db->fo, db->fo, i * 4);
+    if (DB_DEBUG) fprintf(stderr, "Bucket %d packed to %u (0x%x) bytes "
+        "starting at %lu (0x%04lx)\n\n",
+        i, len, len, db->fo, db->fo);
+    db->fo += len;
+}
+
+/* For each bucket, add all its info into a buffer, deflate it,
+ * append to the database file, and set the offset to it. */
+static void write_buckets(context *c, dbdata *db, dbout *out, uint ct,
+                          pack_fun *pack, char *bkbuf) {
+    uint i, len;
+    for (i=0; i<ct; i++) {
+        if (DB_DEBUG) fprintf(stderr, "-- bucket #%u\n", i);
+        db->o = 0;
+        pack(c, db, i);
+        len = encode_bucket(c, db);
+        if (0) dumphex(stderr, db->dbuf, len);
+        dbout_write(out, db->dbuf, len);
+        if (DB_DEBUG) fprintf(stderr, "len (inc. header) is %d\n", len);
+        note_bucket(db, bkbuf, i, len);
+    }
+}
+
+
+/* Packing buckets in parallel.
+ *
+ * Compressing every bucket is the longest serial part of the build, so
+ * with more than one worker (-w), buckets are packed and compressed on
+ * c->w_ct threads, each with its own dbdata buffers. Threads take
+ * batches of PACK_BATCH_CT consecutive buckets, and append the
+ * compressed buckets to the batch's output buffer; the calling thread
+ * writes the batches out in order, filling in the bucket offsets as
+ * before. Threads stay at most PACK_BATCH_AHEAD batches per thread
+ * ahead of the writer, so only a few batches are held in memory.
+ *
+ * Packing only reads the set, except for the stop word log (each line
+ * is written by one fprintf, so they interleave by line) and each
+ * word's own postings, when spilled. */
+
+/* A batch of buckets, compressed back to back. */
+typedef struct pack_batch {
+    int done;
+    char *out;
+    ulong len, sz;
+    uint lens[PACK_BATCH_CT];   /* each bucket's length */
+} pack_batch;
+
+/* State shared by the packing threads and the writer. */
+typedef struct pack_pool {
+    context *c;
+    uint ct;                    /* bucket count */
+    pack_fun *pack;
+    pthread_mutex_t lock;       /* guards everything below */
+    pthread_cond_t cond;        /* a batch was packed or written */
+    uint next;                  /* next batch to pack */
+    uint written;               /* batches written */
+    uint batch_ct;
+    uint ahead;                 /* max batches packed but not written */
+    pack_batch *bs;
+    ulong maxbufsz;
+    const char *dict;           /* preset dictionary */
+    ulong dictlen;
+} pack_pool;
+
+static void pool_lock(pack_pool *p) {
+    if (pthread_mutex_lock(&p->lock) != 0) errx(1, "mutex lock");
+}
+
+static void pool_unlock(pack_pool *p) {
+    if (pthread_mutex_unlock(&p->lock) != 0) errx(1, "mutex unlock");
+}
+
+static void pool_wait(pack_pool *p) {
+    if (pthread_cond_wait(&p->cond, &p->lock) != 0) errx(1, "cond wait");
+}
+
+static void pool_signal(pack_pool *p) {
+    if (pthread_cond_broadcast(&p->cond) != 0) errx(1, "cond broadcast");
+}
+
+/* Pack batch B's buckets with DB's buffers, appending to its output. */
+static void pack_batch_buckets(pack_pool *p, dbdata *db, uint b) {
+    pack_batch *pb = &p->bs[b];
+    uint i, j, end = (b + 1) * PACK_BATCH_CT;
+    ulong len;
+    if (end > p->ct) end = p->ct;
+    pb->sz = DEF_BUF_SZ;
+    pb->out = alloc(pb->sz, 'b');
+    pb->len = 0;
+    for (i = b * PACK_BATCH_CT, j = 0; i < end; i++, j++) {
+        db->o = 0;
+        p->pack(p->c, db, i);
+        len = encode_bucket(p->c, db);
+        while (pb->len + len > pb->sz) {
+            pb->sz *= 2;
+            pb->out = ralloc(pb->out, pb->sz, 'b');
+        }
+        memcpy(pb->out + pb->len, db->dbuf, len);
+        pb->len += len;
+        pb->lens[j] = len;
+    }
+}
+
+static void *pack_thread_main(void *v) {
+    pack_pool *p = (pack_pool *) v;
+    dbdata *db = init_dbdata(-1, -1);
+    uint b;
+    use_dict(db, p->dict, p->dictlen);
+    for (;;) {
+        pool_lock(p);
+        while (p->next < p->batch_ct && p->next >= p->written + p->ahead)
+            pool_wait(p);
+        if (p->next == p->batch_ct) { pool_unlock(p); break; }
+        b = p->next++;
+        pool_unlock(p);
+
+        pack_batch_buckets(p, db, b);
+
+        pool_lock(p);
+        p->bs[b].done = 1;
+        pool_signal(p);
+        pool_unlock(p);
+    }
+    pool_lock(p);
+    if (db->maxbufsz > p->maxbufsz) p->maxbufsz = db->maxbufsz;
+    pool_unlock(p);
+    drop_dict(db);
+    free_dbdata(db);
+    return NULL;
+}
+
+/* Same as write_buckets, but packing on a pool of threads. */
+static void write_buckets_threaded(context *c, dbdata *db, dbout *out, uint ct,
+                                   pack_fun *pack, char *bkbuf) {
+    pthread_t *ts = alloc(sizeof(pthread_t) * c->w_ct, 'T');
+    pack_batch *pb;
+    pack_pool p;
+    uint b, j, i = 0;
+    int t, res;
+
+    p.c = c;
+    p.ct = ct;
+    p.pack = pack;
+    p.next = p.written = 0;
+    p.batch_ct = (ct + PACK_BATCH_CT - 1) / PACK_BATCH_CT;
+    p.ahead = PACK_BATCH_AHEAD * c->w_ct;
+    p.bs = alloc(p.batch_ct * sizeof(pack_batch), 'b');
+    p.maxbufsz = db->maxbufsz;
+    p.dict = db->dict;
+    p.dictlen = db->dictlen;
+    for (b=0; b<p.batch_ct; b++) p.bs[b].done = 0;
+    if (pthread_mutex_init(&p.lock, NULL) != 0) errx(1, "mutex init");
+    if (pthread_cond_init(&p.cond, NULL) != 0) errx(1, "cond init");
+
+    for (t=0; t<c->w_ct; t++) {
+        if ((res = pthread_create(&ts[t], NULL, pack_thread_main, &p)) != 0) {
+            errno = res;
+            err(1, "pthread_create");
+        }
+    }
+
+    for (b=0; b<p.batch_ct; b++) {
+        pb = &p.bs[b];
+        pool_lock(&p);
+        while (!pb->done) pool_wait(&p);
+        pool_unlock(&p);
+
+        dbout_write(out, pb->out, pb->len);
+        for (j=0; i < ct && j < PACK_BATCH_CT; i++, j++)
+            note_bucket(db, bkbuf, i, pb->lens[j]);
+        dealloc(pb->out, 'b');
+
+        pool_lock(&p);
+        p.written++;
+        pool_signal(&p);
+        pool_unlock(&p);
+    }
+
+    for (t=0; t<c->w_ct; t++) {
+        if ((res = pthread_join(ts[t], NULL)) != 0) {
+            errno = res;
+            err(1, "pthread_join");
+        }
+    }
+    db->maxbufsz = p.maxbufsz;
+    pthread_mutex_destroy(&p.lock);
+    pthread_cond_destroy(&p.cond);
+    dealloc(p.bs, 'b');
+    dealloc(ts, 'T');
+}
+
+static int cmp_term(const void *a, const void *b) {
+    return terms_cmp(*(char **) a, *(char **) b);
+}
+
+/* Encode the set's vocabulary as a term dictionary, into *BUF.
+ * Returns its length. */
+static ulong build_terms(context *c, char **buf) {
+    v_array *names = v_array_new(c->word_set->sz + 1);
+    s_link *cur;
+    uint b;
+    ulong len;
+    for (b=0; b<c->word_set->sz; b++)
+        for (cur = c->word_set->b[b]; cur != NULL; cur = cur->next)
+            v_array_append(names, ((word *) cur->key)->name);
+    qsort(names->vs, names->len, sizeof(char *), cmp_term);
+    len = terms_encode((char **) names->vs, names->len, buf);
+    v_array_free(names, NULL);
+    return len;
+}
+
+static void write_set_data(context *c, dbdata *db, int fd, uint ct,
+                             char *header, pack_fun *pack, int with_terms) {
     /* buffer for offsets to buckets */
-    uint bk_buf_sz = s->sz * 4;
+    uint bk_buf_sz = ct * 4;
     uint bk_buf_offset, len = strlen(header);
     char *bkbuf = alloc(bk_buf_sz, 'b');
+    ulong set_o, last_set = 0, old_maxbufsz = 0, dictlen = 0;
+    ulong terms_o = 0, terms_len;
+    char buf[4], *dict = NULL, *terms = NULL;
+    dbout out;
     int xo;
     xo=DB_X_CT;
     
     /* Table format:
      * gln[F or T] [VERSION] [max buffer size/4] [byte offset of first set]
+     * [dictionary length/4] [preset dictionary]
      *
      * Table format:
      * [absolute byte position of next set (or NULL)]
      * [set size/4]
+     * [first doc ID/4] [doc ID count/4]
+     * [absolute offset of the term dictionary, or NULL/4]
      * [set of absolute offsets to each bucket's data/(bucket count * 4)]
+     * [buckets] [term dictionary, in the token DB]
      */
-    /* FIXME: just truncate db for now; append later. */
-    lseek(fd, 0, SEEK_SET);
-    db->fo = 0;
-    write(fd, header, len);
-    write_int32(fd, 0);             /* max buffer size will go here later */
-    db->fo = len + 4;
-    
-    write_int32(fd, db->fo + 4);    /* offset of first set */
-    db->fo += 4;
-    if (DB_DEBUG) fprintf(stderr, "Writing int32 for offset: %ld (0x%04lx)\n",
-        db->fo + 4 + xo, db->fo + 4 + xo);
+    if (c->update) {
+        /* Append a new set to the end of the chain. */
+        last_set = find_last_set(fd, header, &old_maxbufsz);
+        dictlen = read_dict(fd, header, &dict);
+        db->fo = lseek(fd, 0, SEEK_END);
+        if (db->fo > UINT32_MAX) errx(1, "DB too large to update, rebuild db");
+        dbout_init(&out, fd, db->fo);
+    } else {
+        if (!SKIP_COMPRESS) dictlen = train_dict(c, db, ct, pack, &dict);
+        db->fo = 0;
+        dbout_init(&out, fd, 0);
+        dbout_write(&out, header, len);
+        dbout_int32(&out, 0);       /* max buffer size will go here later */
+        db->fo = len + 4;
+        
+        dbout_int32(&out, db->fo + 8 + dictlen);  /* offset of first set */
+        db->fo += 4;
+        dbout_int32(&out, dictlen);
+        if (dictlen > 0) dbout_write(&out, dict, dictlen);
+        db->fo += 4 + dictlen;
+        if (DB_DEBUG) fprintf(stderr, "Writing int32 for offset: %ld (0x%04lx)\n",
+            db->fo + 4 + xo, db->fo + 4 + xo);
+    }
+    set_o = db->fo;
     
-    write_int32(fd, 0);             /* next set offset -> NULL, for now */
+    dbout_int32(&out, 0);           /* next set offset -> NULL, for now */
     db->fo += 4;
     
-    write_int32(fd, bk_buf_sz);     /* set size */
-    db->fo += 4;
+    dbout_int32(&out, bk_buf_sz);   /* set size */
+    dbout_int32(&out, c->doc_base);
+    dbout_int32(&out, c->doc_ct);
+    dbout_int32(&out, 0);           /* term dictionary offset, later */
+    db->fo += 16;
     if (DB_DEBUG) fprintf(stderr, "bk_buf_sz is %d (0x%04x)\n", bk_buf_sz, bk_buf_sz);
     
-    lseek(fd, bk_buf_sz, SEEK_CUR);
+    dbout_skip(&out, bk_buf_sz);
+    use_dict(db, dict, dictlen);
     
     bk_buf_offset = db->fo;         /* will write offsets here later */
     db->fo += bk_buf_sz;
     
-    /* For each bucket, add all its info into a buffer, deflate it,
-     * append to the database file, and set the offset to it. */
-    for (i=0; i<s->sz; i++) {
-        if (DB_DEBUG) fprintf(stderr, "-- bucket #%d\n", i);
-        db->o = 0;
-        len = pack(c, db, s->b[i]);
-        if (0) dumphex(stderr, db->dbuf, len);
-        write(fd, db->dbuf, len);
-        if (DB_DEBUG) fprintf(stderr, "len (inc. header) is %d\n", len);
-        
-        buf_int32(bkbuf, db->fo, i * 4);
-        if (DB_DEBUG) fprintf(stderr, "Wrote %ld (0x%04lx) to bkbuf at %d\n",
-            db->fo, db->fo, i * 4);
-        if (DB_DEBUG) fprintf(stderr, "Bucket %d packed to %u (0x%x) bytes "
-            "starting at %lu (0x%04lx)\n\n",
-            i, len, len, db->fo, db->fo);
-        db->fo += len;
+    if (c->w_ct > 1 && ct > PACK_BATCH_CT) {
+        write_buckets_threaded(c, db, &out, ct, pack, bkbuf);
+    } else {
+        write_buckets(c, db, &out, ct, pack, bkbuf);
+    }
+    if (with_terms) {
+        terms_o = db->fo;
+        terms_len = build_terms(c, &terms);
+        dbout_write(&out, terms, terms_len);
+        db->fo += terms_len;
+        dealloc(terms, 'K');
     }
+    dbout_close(&out);
+    assert(out.o == db->fo);
+    drop_dict(db);
+    if (dict) dealloc(dict, 'Z');
     
-    update_max_bufsize(fd, strlen(header), db->maxbufsz);
-    lseek(fd, bk_buf_offset, SEEK_SET);
+    update_max_bufsize(fd, strlen(header),
+        db->maxbufsz > old_maxbufsz ? db->maxbufsz : old_maxbufsz);
     
     if (DB_DEBUG) fprintf(stderr, "Max buffer size is %lu (0x%04lx).\n",
         db->maxbufsz, db->maxbufsz);
-    write(fd, bkbuf, bk_buf_sz);
+    pwrite_all(fd, bkbuf, bk_buf_sz, bk_buf_offset);
     if (DB_DEBUG) {
         fprintf(stderr, "\nOffset table:\n");
         dumphex(stderr, bkbuf, bk_buf_sz);
     }
-    free(bkbuf);
+    dealloc(bkbuf, 'b');
+    if (terms_o > 0) {
+        buf_int32(buf, terms_o, 0);
+        pwrite_all(fd, buf, 4, set_o + 16);
+    }
+    
+    /* Only link the new set into the chain once it's complete
+     * (and, with --fsync, on disk). */
+    sync_fd(c, fd);
+    if (c->update) {
+        buf_int32(buf, set_o, 0);
+        pwrite_all(fd, buf, 4, last_set);
+        sync_fd(c, fd);
+    }
 }
 
 
@@ -414,9 +987,17 @@ static void write_set_data(context *c, dbdata *db, int fd, set *s,
  * Main *
  ********/
 
+/* Note filename F in c->docs, by doc ID. */
+static void add_doc(void *f, void *udata) {
+    context *c = (context *) udata;
+    fname *fn = (fname *) f;
+    assert(fn->id >= c->doc_base && fn->id - c->doc_base < c->doc_ct);
+    c->docs[fn->id - c->doc_base] = fn;
+}
+
 int db_write(context *c) {
     dbdata *db = init_dbdata(c->fdb_fd, c->tdb_fd);
-    init_zlib();
+    uint i;
     
     /* TODO try opening existing file, else write it */
     /* write_file_header(); */
@@ -427,14 +1008,21 @@ int db_write(context *c) {
         set_stats(c->word_set, 0);
     }
     
-    write_set_data(c, db, db->ffd, c->fn_set, gln_file_header, pack_fname_bucket);
-    write_set_data(c, db, db->tfd, c->word_set, gln_token_header, pack_token_bucket);
+    c->docs = alloc(c->doc_ct * sizeof(fname *) + 1, 'F');
+    for (i=0; i<c->doc_ct; i++) c->docs[i] = NULL;
+    set_apply(c->fn_set, add_doc, c);
+    write_set_data(c, db, db->ffd, (c->doc_ct + FNAME_BUCKET_CT - 1) / FNAME_BUCKET_CT,
+        gln_file_header, pack_fname_bucket, 0);
+    dealloc(c->docs, 'F');
+    c->docs = NULL;
+    write_set_data(c, db, db->tfd, c->word_set->sz, gln_token_header,
+        pack_token_bucket, 1);
     
 #if PROFILE_COMPRESSION
     printf("Totals: IN: %lu\tOUT: %lu\t%.2f\n",
         db_bytes_in, db_bytes_out, db_bytes_out / (1.0*db_bytes_in));
 #endif
-    free_zlib();
+    free_dbdata(db);
     return 0;
 }
 
@@ -4,6 +4,17 @@
 /* Starting value for compression buffers (resized on demand). */
 #define DEF_BUF_SZ 128
 
+/* Bucket codecs, recorded in the first byte of each bucket. */
+#define CODEC_ZLIB 'X'          /* zlib (the only one in older DBs) */
+#define CODEC_LZ 'L'            /* lz.c: larger, but faster to decode */
+#define CODEC_RAW 'R'           /* uncompressed */
+#define DEF_CODEC CODEC_LZ
+
+/* Each set starts with [next set/4][bucket table size/4][first doc
+ * ID/4][doc ID count/4][term dictionary offset/4], followed by the
+ * bucket table. (Only token DB sets have term dictionaries.) */
+#define DB_SET_HEADER_SZ 20
+
 typedef struct dbdata {
     int ffd;                /* filename db file descriptor */
     ulong fo;               /* filename db offset */
@@ -16,18 +27,41 @@ typedef struct dbdata {
     char *dbuf;             /* deflation buffer */
     ulong dbufsz;
     ulong maxbufsz;         /* largest buffer needed for deflating */
+    int sampling;           /* packing samples for the dictionary? */
+    const char *dict;       /* preset dictionary, or NULL */
+    ulong dictlen;
+    struct lz_dict *lzd;    /* dict, indexed for lz_compress */
+    struct z_stream_s *zs;  /* deflate state, once needed */
 } dbdata;
 
-/* Init/free internal structures for zlib compression. */
-void init_zlib();
-void free_zlib();
-
 /* Initialize new database files. */
 void db_init_files(context *c);
 
 /* Write the data set. */
 int db_write(context *c);
 
+/* Count the sets already in the token DB. */
+uint db_set_count(context *c);
+
+/* Get the offset of each set in the token (if TOKEN) or filename DB,
+ * oldest first, followed by the end of the file. Returns the set count. */
+uint db_set_offsets(context *c, int token, ulong **offsets);
+
+/* Get the first doc ID of the set at OFFSET in the filename DB. */
+uint db_set_first_doc(context *c, ulong offset);
+
+/* Read the term dictionary (see terms.h) of the set at OFFSET in the
+ * token DB into *BUF (tag 'K'), and return its length. Sets without
+ * one give NULL and 0. */
+ulong db_read_terms(context *c, ulong offset, char **buf);
+
+/* Get the doc ID after those used by every set in the filename DB. */
+uint db_next_doc(context *c);
+
+/* Copy the first KEEP sets of DB file FROM into TO, given FROM's
+ * set OFFSETS. More sets can then be added to TO with db_write. */
+void db_copy_sets(int from, int to, ulong *offsets, uint keep);
+
 /* Get the default DB base path. */
 char *db_default_gln_dir();
 
@@ -0,0 +1,114 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+
+#include "glean.h"
+#include "dict.h"
+
+/* Dictionaries are assembled from segments of the samples, chosen by
+ * how many of the samples share their substrings (roughly as zstd's
+ * "cover" trainer does):
+ *
+ * 1. Count how many samples contain each DICT_KMER-byte substring
+ *    (by hash, so unrelated substrings occasionally add up).
+ * 2. Split the samples into one stretch per segment that will fit,
+ *    and take the DICT_SEG_SZ bytes in each stretch whose substrings
+ *    have the highest total count.
+ * 3. Once a segment is taken, its substrings count for nothing, so
+ *    later segments don't repeat it.
+ *
+ * Segments are put in order of increasing score, since both codecs
+ * reach the end of the dictionary most cheaply. */
+
+#define DICT_KMER 6
+#define DICT_SEG_SZ 48
+#define DICT_HASH_LOG 18
+
+typedef struct segment {
+    size_t o;
+    ulong score;
+} segment;
+
+static uint32_t kmer_hash(const unsigned char *p) {
+    uint32_t h = 2166136261U;
+    int i;
+    for (i=0; i<DICT_KMER; i++) h = (h ^ p[i]) * 16777619U;
+    return h >> (32 - DICT_HASH_LOG);
+}
+
+static int seg_score_cmp(const void *a, const void *b) {
+    ulong sa = ((segment *) a)->score, sb = ((segment *) b)->score;
+    return sa < sb ? -1 : sa > sb ? 1 : 0;
+}
+
+size_t dict_train(const unsigned char *buf, const size_t *lens, uint ct,
+        unsigned char *dict, size_t cap) {
+    size_t total = 0, o, p, end, stretch, seg_ct, len = 0;
+    uint32_t *freq, *last, *hs;
+    uint i, j, n = 0;
+    segment *segs, best;
+    ulong score;
+
+    for (i=0; i<ct; i++) total += lens[i];
+    if (total < DICT_KMER || cap < DICT_SEG_SZ) return 0;
+    if (total <= cap) {         /* it all fits */
+        memcpy(dict, buf, total);
+        return total;
+    }
+
+    /* Hash every k-mer (0 marks those crossing into the next sample),
+     * and count the samples each appears in. */
+    freq = alloc(sizeof(uint32_t) << DICT_HASH_LOG, 'Z');
+    last = alloc(sizeof(uint32_t) << DICT_HASH_LOG, 'Z');
+    hs = alloc(total * sizeof(uint32_t), 'Z');
+    memset(freq, 0, sizeof(uint32_t) << DICT_HASH_LOG);
+    memset(last, 0, sizeof(uint32_t) << DICT_HASH_LOG);
+    for (i=0, o=0; i<ct; o += lens[i++]) {
+        for (p=o; p < o + lens[i]; p++) {
+            if (p + DICT_KMER > o + lens[i]) { hs[p] = 0; continue; }
+            hs[p] = kmer_hash(buf + p) | 1;
+            if (last[hs[p]] != i + 1) {
+                last[hs[p]] = i + 1;
+                freq[hs[p]]++;
+            }
+        }
+    }
+
+    /* Take the best-scoring segment in each stretch. */
+    seg_ct = cap / DICT_SEG_SZ;
+    stretch = total / seg_ct;
+    if (stretch < DICT_SEG_SZ) stretch = DICT_SEG_SZ;
+    segs = alloc(seg_ct * sizeof(segment), 'Z');
+    for (o=0; o + DICT_SEG_SZ <= total && n < seg_ct; o += stretch) {
+        end = o + stretch < total ? o + stretch : total;
+        score = 0;
+        for (p=o; p < o + DICT_SEG_SZ; p++) if (hs[p]) score += freq[hs[p]];
+        best.o = o;
+        best.score = score;
+        for (p=o + 1; p + DICT_SEG_SZ <= end; p++) {
+            if (hs[p - 1]) score -= freq[hs[p - 1]];
+            if (hs[p + DICT_SEG_SZ - 1]) score += freq[hs[p + DICT_SEG_SZ - 1]];
+            if (score > best.score) {
+                best.o = p;
+                best.score = score;
+            }
+        }
+        /* A segment whose substrings are all unique won't help. */
+        if (best.score <= DICT_SEG_SZ - DICT_KMER + 1) continue;
+        for (p=best.o; p < best.o + DICT_SEG_SZ; p++) if (hs[p]) freq[hs[p]] = 0;
+        segs[n++] = best;
+    }
+
+    qsort(segs, n, sizeof(segment), seg_score_cmp);
+    for (j=0; j<n; j++) {
+        memcpy(dict + len, buf + segs[j].o, DICT_SEG_SZ);
+        len += DICT_SEG_SZ;
+    }
+    dealloc(segs, 'Z');
+    dealloc(hs, 'Z');
+    dealloc(last, 'Z');
+    dealloc(freq, 'Z');
+    return len;
+}
@@ -0,0 +1,14 @@
+#ifndef DICT_H
+#define DICT_H
+
+/* Training preset dictionaries for bucket compression. Each bucket is
+ * compressed on its own, so without one, every bucket has to relearn
+ * the same path prefixes and common file hashes. */
+
+/* Train a dictionary of at most CAP bytes into DICT, from the CT
+ * samples concatenated in BUF, whose lengths are in LENS. Returns the
+ * dictionary's length (0 if there is nothing worth keeping). */
+size_t dict_train(const unsigned char *buf, const size_t *lens, uint ct,
+    unsigned char *dict, size_t cap);
+
+#endif
@@ -0,0 +1,508 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+
+/* As in array.c, with SSE2 similar-sized arrays are merged a block at
+ * a time -- eight IDs, here. */
+#if defined(__SSE2__)
+#define DOCSET_SSE2 1
+#include <emmintrin.h>
+#else
+#define DOCSET_SSE2 0
+#endif
+
+#include "glean.h"
+#include "array.h"
+#include "docset.h"
+
+/* A docset is a sorted array of containers, by key (the high 16 bits
+ * of their IDs). A container with at most DOCSET_ARRAY_MAX IDs is an
+ * array of their low 16 bits, sorted; past that, it's a bitmap.
+ * Containers are never empty. */
+
+#define BITMAP_WORDS (65536 / 64)
+#define KEY(doc) ((doc) >> 16)
+#define LOW(doc) ((doc) & 0xffff)
+
+/* Intersecting arrays this many times different in size gallops
+ * through the larger one, as with h_arrays. */
+#define GALLOP_RATIO 32
+
+typedef struct container {
+    uint16_t key;
+    int bitmap;             /* bits, rather than vals? */
+    uint card;              /* ID count */
+    uint sz;                /* vals allocated */
+    union {
+        uint16_t *vals;
+        uint64_t *bits;
+    } d;
+} container;
+
+struct docset {
+    container *cs;
+    uint len;
+    uint sz;
+};
+
+#if defined(__GNUC__)
+#define POPCOUNT(w) __builtin_popcountll(w)
+#define CTZ(w) __builtin_ctzll(w)
+#else
+static int POPCOUNT(uint64_t w) {
+    int n = 0;
+    for (; w; w &= w - 1) n++;
+    return n;
+}
+
+static int CTZ(uint64_t w) {
+    int n = 0;
+    for (; (w & 1) == 0; w >>= 1) n++;
+    return n;
+}
+#endif
+
+docset *docset_new(void) {
+    docset *s = alloc(sizeof(*s), 'B');
+    s->len = 0;
+    s->sz = 4;
+    s->cs = alloc(s->sz * sizeof(container), 'B');
+    return s;
+}
+
+static void free_container(container *c) {
+    dealloc(c->bitmap ? (void *) c->d.bits : (void *) c->d.vals, 'B');
+}
+
+void docset_free(docset *s) {
+    uint i;
+    for (i=0; i<s->len; i++) free_container(&s->cs[i]);
+    dealloc(s->cs, 'B');
+    dealloc(s, 'B');
+}
+
+
+/**************
+ * Containers *
+ **************/
+
+static void init_array(container *c, uint16_t key, uint sz) {
+    c->key = key;
+    c->bitmap = 0;
+    c->card = 0;
+    c->sz = sz;
+    c->d.vals = alloc(sz * sizeof(uint16_t), 'B');
+}
+
+static void init_bitmap(container *c, uint16_t key) {
+    c->key = key;
+    c->bitmap = 1;
+    c->card = 0;
+    c->sz = 0;
+    c->d.bits = alloc(BITMAP_WORDS * sizeof(uint64_t), 'B');
+    memset(c->d.bits, 0, BITMAP_WORDS * sizeof(uint64_t));
+}
+
+static void copy_container(container *dst, const container *src) {
+    if (src->bitmap) {
+        init_bitmap(dst, src->key);
+        memcpy(dst->d.bits, src->d.bits, BITMAP_WORDS * sizeof(uint64_t));
+    } else {
+        init_array(dst, src->key, src->card);
+        memcpy(dst->d.vals, src->d.vals, src->card * sizeof(uint16_t));
+    }
+    dst->card = src->card;
+}
+
+static int test_bit(const container *c, uint16_t v) {
+    return (c->d.bits[v >> 6] >> (v & 63)) & 1;
+}
+
+static void set_bit(container *c, uint16_t v) {
+    uint64_t *w = &c->d.bits[v >> 6], m = (uint64_t) 1 << (v & 63);
+    if ((*w & m) == 0) c->card++;
+    *w |= m;
+}
+
+static void to_bitmap(container *c) {
+    container b;
+    uint i;
+    init_bitmap(&b, c->key);
+    for (i=0; i<c->card; i++) set_bit(&b, c->d.vals[i]);
+    free_container(c);
+    *c = b;
+}
+
+/* Count a bitmap's IDs, and make it an array if there are few enough. */
+static void recount(container *c) {
+    container a;
+    uint i, n = 0;
+    uint64_t w;
+    for (i=0; i<BITMAP_WORDS; i++) n += POPCOUNT(c->d.bits[i]);
+    c->card = n;
+    if (n > DOCSET_ARRAY_MAX) return;
+    init_array(&a, c->key, n > 0 ? n : 1);
+    for (i=0; i<BITMAP_WORDS; i++)
+        for (w = c->d.bits[i]; w != 0; w &= w - 1)
+            a.d.vals[a.card++] = i * 64 + CTZ(w);
+    free_container(c);
+    *c = a;
+}
+
+/* Index of the first of the N sorted VALS >= V. */
+static uint lower_bound(const uint16_t *vals, uint n, uint16_t v) {
+    uint lo = 0, hi = n, mid;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (vals[mid] < v) lo = mid + 1; else hi = mid;
+    }
+    return lo;
+}
+
+/* Index of the first of the N sorted VALS from LO on that's >= V,
+ * searching in exponentially growing steps. */
+static uint gallop(const uint16_t *vals, uint lo, uint n, uint16_t v) {
+    uint step = 1, hi;
+    if (lo >= n || vals[lo] >= v) return lo;
+    while (lo + step < n && vals[lo + step] < v) {
+        lo += step;
+        step *= 2;
+    }
+    hi = lo + step < n ? lo + step : n;
+    return lo + 1 + lower_bound(vals + lo + 1, hi - lo - 1, v);
+}
+
+static void container_add(container *c, uint16_t v) {
+    uint i;
+    if (c->bitmap) { set_bit(c, v); return; }
+    i = c->card > 0 && c->d.vals[c->card - 1] < v
+        ? c->card : lower_bound(c->d.vals, c->card, v);
+    if (i < c->card && c->d.vals[i] == v) return;
+    if (c->card == DOCSET_ARRAY_MAX) {
+        to_bitmap(c);
+        set_bit(c, v);
+        return;
+    }
+    if (c->card == c->sz) {
+        c->sz *= 2;
+        c->d.vals = ralloc(c->d.vals, c->sz * sizeof(uint16_t), 'B');
+    }
+    memmove(c->d.vals + i + 1, c->d.vals + i, (c->card - i) * sizeof(uint16_t));
+    c->d.vals[i] = v;
+    c->card++;
+}
+
+static int container_has(const container *c, uint16_t v) {
+    uint i;
+    if (c->bitmap) return test_bit(c, v);
+    i = lower_bound(c->d.vals, c->card, v);
+    return i < c->card && c->d.vals[i] == v;
+}
+
+/* Does C hold any ID from LO to HI (low bits, inclusive)? */
+static int container_has_range(const container *c, uint16_t lo, uint16_t hi) {
+    uint i, wlo = lo >> 6, whi = hi >> 6;
+    uint64_t mlo = ~(uint64_t) 0 << (lo & 63);
+    uint64_t mhi = ~(uint64_t) 0 >> (63 - (hi & 63));
+    if (!c->bitmap) {
+        i = lower_bound(c->d.vals, c->card, lo);
+        return i < c->card && c->d.vals[i] <= hi;
+    }
+    if (wlo == whi) return (c->d.bits[wlo] & mlo & mhi) != 0;
+    if (c->d.bits[wlo] & mlo) return 1;
+    for (i=wlo + 1; i<whi; i++)
+        if (c->d.bits[i]) return 1;
+    return (c->d.bits[whi] & mhi) != 0;
+}
+
+#if DOCSET_SSE2
+/* Rotate V's eight 16-bit lanes by N, a constant. */
+#define ROTATE16(v, n) \
+    _mm_or_si128(_mm_srli_si128(v, 2 * (n)), _mm_slli_si128(v, 16 - 2 * (n)))
+
+/* Merge blocks of eight of array containers X and Y's IDs into OUT,
+ * comparing X's block against each rotation of Y's at once, then
+ * advancing past whichever block ends first (or both). Stops when
+ * either has less than a block left, leaving *IX and *IY there for
+ * the scalar merge. Returns how many IDs were written. */
+static uint and_sse2(const container *x, const container *y, uint16_t *out,
+                     uint *ix, uint *iy) {
+    uint i = *ix, j = *iy, n = 0, mask, k;
+    uint16_t xmax, ymax;
+    __m128i vx, vy, eq;
+    while (i + 8 <= x->card && j + 8 <= y->card) {
+        vx = _mm_loadu_si128((const __m128i *) (x->d.vals + i));
+        vy = _mm_loadu_si128((const __m128i *) (y->d.vals + j));
+        eq = _mm_or_si128(
+            _mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi16(vx, vy),
+                    _mm_cmpeq_epi16(vx, ROTATE16(vy, 1))),
+                _mm_or_si128(_mm_cmpeq_epi16(vx, ROTATE16(vy, 2)),
+                    _mm_cmpeq_epi16(vx, ROTATE16(vy, 3)))),
+            _mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi16(vx, ROTATE16(vy, 4)),
+                    _mm_cmpeq_epi16(vx, ROTATE16(vy, 5))),
+                _mm_or_si128(_mm_cmpeq_epi16(vx, ROTATE16(vy, 6)),
+                    _mm_cmpeq_epi16(vx, ROTATE16(vy, 7)))));
+        mask = _mm_movemask_epi8(eq);   /* two bits per lane */
+        for (k=0; k<8; k++) {
+            out[n] = x->d.vals[i + k];
+            n += (mask >> (2 * k)) & 1;
+        }
+        xmax = x->d.vals[i + 7];
+        ymax = y->d.vals[j + 7];
+        i += xmax <= ymax ? 8 : 0;
+        j += ymax <= xmax ? 8 : 0;
+    }
+    *ix = i;
+    *iy = j;
+    return n;
+}
+#endif
+
+/* X = X & Y. Arrays of very different sizes gallop through the larger
+ * one; otherwise they merge, without branching (and with SSE2, eight
+ * IDs at a time). */
+static void container_and(container *x, const container *y) {
+    container a;
+    uint i, j, o = 0;
+    uint16_t xv, yv;
+    if (x->bitmap && y->bitmap) {
+        for (i=0; i<BITMAP_WORDS; i++) x->d.bits[i] &= y->d.bits[i];
+        recount(x);
+    } else if (y->bitmap) {
+        for (i=0; i<x->card; i++)
+            if (test_bit(y, x->d.vals[i])) x->d.vals[o++] = x->d.vals[i];
+        x->card = o;
+    } else if (x->bitmap) {
+        init_array(&a, x->key, y->card > 0 ? y->card : 1);
+        for (i=0; i<y->card; i++)
+            if (test_bit(x, y->d.vals[i])) a.d.vals[a.card++] = y->d.vals[i];
+        free_container(x);
+        *x = a;
+    } else if (x->card > 0 && y->card / x->card >= GALLOP_RATIO) {
+        for (i=j=0; i<x->card && j<y->card; i++) {
+            j = gallop(y->d.vals, j, y->card, x->d.vals[i]);
+            if (j < y->card && y->d.vals[j] == x->d.vals[i])
+                x->d.vals[o++] = x->d.vals[i];
+        }
+        x->card = o;
+    } else if (y->card > 0 && x->card / y->card >= GALLOP_RATIO) {
+        for (i=j=0; j<y->card && i<x->card; j++) {
+            i = gallop(x->d.vals, i, x->card, y->d.vals[j]);
+            if (i < x->card && x->d.vals[i] == y->d.vals[j])
+                x->d.vals[o++] = y->d.vals[j];
+        }
+        x->card = o;
+    } else {
+        init_array(&a, x->key, (x->card < y->card ? x->card : y->card) + 1);
+        i = j = 0;
+#if DOCSET_SSE2
+        a.card = and_sse2(x, y, a.d.vals, &i, &j);
+#endif
+        while (i < x->card && j < y->card) {
+            xv = x->d.vals[i];
+            yv = y->d.vals[j];
+            a.d.vals[a.card] = xv;
+            a.card += xv == yv;
+            i += xv <= yv;
+            j += yv <= xv;
+        }
+        free_container(x);
+        *x = a;
+    }
+}
+
+/* X = X | Y. */
+static void container_or(container *x, const container *y) {
+    container a;
+    uint i, j;
+    if (x->bitmap && y->bitmap) {
+        for (i=0; i<BITMAP_WORDS; i++) x->d.bits[i] |= y->d.bits[i];
+        recount(x);
+    } else if (x->bitmap) {
+        for (i=0; i<y->card; i++) set_bit(x, y->d.vals[i]);
+    } else if (y->bitmap) {
+        copy_container(&a, y);
+        for (i=0; i<x->card; i++) set_bit(&a, x->d.vals[i]);
+        free_container(x);
+        *x = a;
+    } else if (x->card + y->card > DOCSET_ARRAY_MAX) {
+        to_bitmap(x);
+        for (i=0; i<y->card; i++) set_bit(x, y->d.vals[i]);
+        if (x->card <= DOCSET_ARRAY_MAX) recount(x);
+    } else {
+        init_array(&a, x->key, x->card + y->card > 0 ? x->card + y->card : 1);
+        for (i=j=0; i<x->card || j<y->card; ) {
+            if (j == y->card || (i < x->card && x->d.vals[i] < y->d.vals[j])) {
+                a.d.vals[a.card++] = x->d.vals[i++];
+            } else if (i == x->card || x->d.vals[i] > y->d.vals[j]) {
+                a.d.vals[a.card++] = y->d.vals[j++];
+            } else {
+                a.d.vals[a.card++] = x->d.vals[i++];
+                j++;
+            }
+        }
+        free_container(x);
+        *x = a;
+    }
+}
+
+/* X = X & ~Y. */
+static void container_andnot(container *x, const container *y) {
+    uint i, j, o = 0;
+    if (x->bitmap && y->bitmap) {
+        for (i=0; i<BITMAP_WORDS; i++) x->d.bits[i] &= ~y->d.bits[i];
+        recount(x);
+    } else if (x->bitmap) {
+        for (i=0; i<y->card; i++)
+            x->d.bits[y->d.vals[i] >> 6] &= ~((uint64_t) 1 << (y->d.vals[i] & 63));
+        recount(x);
+    } else if (y->bitmap) {
+        for (i=0; i<x->card; i++)
+            if (!test_bit(y, x->d.vals[i])) x->d.vals[o++] = x->d.vals[i];
+        x->card = o;
+    } else {
+        for (i=j=0; i<x->card; i++) {
+            while (j < y->card && y->d.vals[j] < x->d.vals[i]) j++;
+            if (j == y->card || y->d.vals[j] != x->d.vals[i])
+                x->d.vals[o++] = x->d.vals[i];
+        }
+        x->card = o;
+    }
+}
+
+
+/************
+ * Docsets *
+ ************/
+
+/* Index of the first container with key >= KEY. */
+static uint find_key(const docset *s, uint16_t key) {
+    uint lo = 0, hi = s->len, mid;
+    if (s->len > 0 && s->cs[s->len - 1].key < key) return s->len;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (s->cs[mid].key < key) lo = mid + 1; else hi = mid;
+    }
+    return lo;
+}
+
+static void grow(docset *s, uint len) {
+    if (len <= s->sz) return;
+    while (s->sz < len) s->sz *= 2;
+    s->cs = ralloc(s->cs, s->sz * sizeof(container), 'B');
+}
+
+void docset_add(docset *s, uint doc) {
+    uint16_t key = KEY(doc);
+    uint i = find_key(s, key);
+    if (i == s->len || s->cs[i].key != key) {
+        grow(s, s->len + 1);
+        memmove(s->cs + i + 1, s->cs + i, (s->len - i) * sizeof(container));
+        init_array(&s->cs[i], key, 4);
+        s->len++;
+    }
+    container_add(&s->cs[i], LOW(doc));
+}
+
+void docset_add_sorted(docset *s, const hash_t *docs, uint n) {
+    uint i;
+    for (i=0; i<n; i++) docset_add(s, docs[i]);
+}
+
+int docset_has(docset *s, uint doc) {
+    uint i = find_key(s, KEY(doc));
+    return i < s->len && s->cs[i].key == KEY(doc)
+        && container_has(&s->cs[i], LOW(doc));
+}
+
+int docset_has_range(docset *s, uint lo, uint hi) {
+    uint i;
+    container *c;
+    if (lo > hi) return 0;
+    for (i = find_key(s, KEY(lo)); i < s->len && s->cs[i].key <= KEY(hi); i++) {
+        c = &s->cs[i];
+        if (container_has_range(c, c->key == KEY(lo) ? LOW(lo) : 0,
+                c->key == KEY(hi) ? LOW(hi) : 0xffff))
+            return 1;
+    }
+    return 0;
+}
+
+uint docset_count(docset *s) {
+    uint i, n = 0;
+    for (i=0; i<s->len; i++) n += s->cs[i].card;
+    return n;
+}
+
+void docset_and(docset *a, docset *b) {
+    uint i, j = 0, o = 0;
+    for (i=0; i<a->len; i++) {
+        while (j < b->len && b->cs[j].key < a->cs[i].key) j++;
+        if (j < b->len && b->cs[j].key == a->cs[i].key)
+            container_and(&a->cs[i], &b->cs[j]);
+        else
+            a->cs[i].card = 0;
+        if (a->cs[i].card == 0) {
+            free_container(&a->cs[i]);
+        } else {
+            a->cs[o++] = a->cs[i];
+        }
+    }
+    a->len = o;
+}
+
+void docset_andnot(docset *a, docset *b) {
+    uint i, j = 0, o = 0;
+    for (i=0; i<a->len; i++) {
+        while (j < b->len && b->cs[j].key < a->cs[i].key) j++;
+        if (j < b->len && b->cs[j].key == a->cs[i].key)
+            container_andnot(&a->cs[i], &b->cs[j]);
+        if (a->cs[i].card == 0) {
+            free_container(&a->cs[i]);
+        } else {
+            a->cs[o++] = a->cs[i];
+        }
+    }
+    a->len = o;
+}
+
+void docset_or(docset *a, docset *b) {
+    uint sz = a->len + b->len + 1;
+    container *cs = alloc(sz * sizeof(container), 'B');
+    uint i = 0, j = 0, o = 0;
+    while (i < a->len || j < b->len) {
+        if (j == b->len || (i < a->len && a->cs[i].key < b->cs[j].key)) {
+            cs[o++] = a->cs[i++];
+        } else if (i == a->len || a->cs[i].key > b->cs[j].key) {
+            copy_container(&cs[o++], &b->cs[j++]);
+        } else {
+            container_or(&a->cs[i], &b->cs[j++]);
+            cs[o++] = a->cs[i++];
+        }
+    }
+    dealloc(a->cs, 'B');
+    a->cs = cs;
+    a->len = o;
+    a->sz = sz;
+}
+
+void docset_append_to(docset *s, h_array *a) {
+    uint i, j, base;
+    uint64_t w;
+    container *c;
+    for (i=0; i<s->len; i++) {
+        c = &s->cs[i];
+        base = (uint) c->key << 16;
+        if (!c->bitmap) {
+            for (j=0; j<c->card; j++) h_array_append(a, base | c->d.vals[j]);
+            continue;
+        }
+        for (j=0; j<BITMAP_WORDS; j++)
+            for (w = c->d.bits[j]; w != 0; w &= w - 1)
+                h_array_append(a, base | (j * 64 + CTZ(w)));
+    }
+}
@@ -0,0 +1,46 @@
+#ifndef DOCSET_H
+#define DOCSET_H
+
+/* Sets of doc IDs, for combining query results.
+ *
+ * IDs are split by their high 16 bits into containers, roaring-style.
+ * Each container holds the low 16 bits of its IDs either as a sorted
+ * array (up to DOCSET_ARRAY_MAX of them) or as a 65536-bit bitmap, so
+ * sparse sets stay small and dense ones (a common token, or a broad
+ * -s or OR query) cost at most 8 KB per 65536 docs. AND, OR, and AND
+ * NOT work a container at a time, in place, and bitmaps are combined
+ * a 64-bit word at a time. */
+
+/* Containers with more IDs than this are bitmaps. */
+#define DOCSET_ARRAY_MAX 4096
+
+struct h_array;
+
+typedef struct docset docset;
+
+docset *docset_new(void);
+
+/* Add DOC. Adding IDs in ascending order is fastest. */
+void docset_add(docset *s, uint doc);
+
+/* Add the N (sorted) IDs at DOCS. */
+void docset_add_sorted(docset *s, const hash_t *docs, uint n);
+
+int docset_has(docset *s, uint doc);
+
+/* Does S hold any ID from LO to HI (inclusive)? */
+int docset_has_range(docset *s, uint lo, uint hi);
+
+uint docset_count(docset *s);
+
+/* A = A & B, A | B, or A & ~B. B is unchanged. */
+void docset_and(docset *a, docset *b);
+void docset_or(docset *a, docset *b);
+void docset_andnot(docset *a, docset *b);
+
+/* Append S's IDs, in order, to A. */
+void docset_append_to(docset *s, struct h_array *a);
+
+void docset_free(docset *s);
+
+#endif
@@ -4,96 +4,74 @@
 #include <string.h>
 #include <unistd.h>
 #include <stdint.h>
-#include <sys/wait.h>
-#include <sys/socket.h>
 #include <err.h>
 #include <errno.h>
-#include <signal.h>
 
 #include "glean.h"
 #include "set.h"
 #include "fname.h"
 #include "array.h"
 #include "gln_index.h"
-#include "nextline.h"
+#include "rules.h"
+#include "filter.h"
+#include "walk.h"
 
-/* Open a gln_filter co-process, saving its pid in PID and
- * returning its file descriptor. */
-int filter_open_coprocess(int *pid) {
-    int res, sv[2];
-    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) err(1, "socketpair");
-    res = fork();
-    if (res == -1) {
-        err(1, "fork");
-    } else if (res == 0) {  /* child */
-        dup2(sv[1], STDIN_FILENO),
-          dup2(sv[1], STDOUT_FILENO);
-        if (execlp("gln_filter", "gln_filter", (char *)NULL) == -1)
-            err(1, "filter execlp fail (is gln_filter in your path?");
-    }
-    *pid = res;
-    return sv[0];
+/* Load and compile the index/ignore rules (see gln_filter(1)). */
+void filter_init(context *c) {
+    int debug = DEBUG || getenv("GLN_FILTER_DEBUG") != NULL;
+    c->rules = rules_new(debug);
+    rules_read(c->rules, rules_config_file());
+    rules_compile(c->rules);
 }
 
-/* Should a given file be skipped, according to filtering rules? */
-static int should_skip(int fd, char *fname, int len) {
-    char buf[4096];
-    int sz;
-    strncpy(buf, fname, len);
-    buf[len-1] = '\n'; buf[len] = '\0';    /* for getline */
-    sz = write(fd, buf, len);
-    assert(sz > 0);
-    sz = read(fd, buf, 4095);
-    assert(sz > 0);
-    buf[sz] = '\0';
-    if (strncmp(buf, "ignore", sz - 1) == 0) return 1;
-    if (strncmp(buf, "index", sz - 1) == 0) return 0;
-    fprintf(stderr, "Bad filter response: %s\n"
-        "currently only 'ignore' and 'index' are supported.\n", buf);
+/* Should PATH be skipped, according to filtering rules? RD is the cached
+ * state for PATH's directory, or NULL. Safe to call from several threads. */
+int filter_should_skip(context *c, const rules_dir *rd, const char *path) {
+    const char *action = rules_match(c->rules, rd, path);
+    if (strcmp(action, "ignore") == 0) return 1;
+    if (strcmp(action, "index") == 0) return 0;
+    fprintf(stderr, "Bad filter action: %s\n"
+        "currently only 'ignore' and 'index' are supported.\n", action);
     return 1;
 }
 
-/* Read input from the gln_filter co-process and
- * enqueue files to be indexed.
+/* Should the directory DPATH (ending in '/') be skipped whole? Only if
+ * the filtering rules would ignore every file in it. */
+int filter_should_prune(context *c, const char *dpath) {
+    return rules_prune_dir(c->rules, dpath);
+}
+
+/* Give each enqueued file the next doc ID, in path order. */
+static void assign_doc_ids(context *c) {
+    uint i;
+    v_array_sort(c->fnames, fname_name_cmp);
+    for (i=0; i<v_array_length(c->fnames); i++)
+        ((fname *) v_array_get(c->fnames, i))->id = c->doc_base + i;
+    c->doc_ct = v_array_length(c->fnames);
+}
+
+/* Walk the index root, checking paths against the filter rules,
+ * and enqueue files to be indexed, largest first.
  * Returns <0 on error. */
 int filter_enqueue_files(context *c) {
-    char *buf;
-    size_t len;
-    fname *fn;
-    uint ct=0, sp = (c->verbose || c->show_progress);
-    int skip = 0;
-    if (c->find == NULL) {
-        fprintf(stderr, "Failed to start 'find' process.\n");
-        return -1;
-    }
+    int ct;
+    uint sp = (c->verbose || c->show_progress);
     
     if (sp) fprintf(stderr, "-- Enqueueing all files to index...\n");
     
-    while ((buf = nextline(c->find, &len)) != NULL) {
-        skip = should_skip(c->filter_fd, buf, len);
-        if (buf[len - 1] == '\n') buf[len - 1] = '\0';
-        if (skip) {
-            if (c->verbose || DEBUG)
-                fprintf(stderr, "Ignoring: %s\n", buf);
-        } else {
-            fn = fname_new(buf, len);
-            v_array_append(c->fnames, fn);
-            if (c->verbose > 1) fprintf(stderr, "Appended: %d %s\n",
-                v_array_length(c->fnames), fn->name);
-            ct++;
-            if (ct % ENQUEUE_PROGRESS_CT == 0)
-                fprintf(stderr, "%u files enqueued so far...\n", ct);
-        }
-    }
+    if ((ct = walk_tree(c)) < 0) return -1;
+    
+    rules_free(c->rules);
+    c->rules = NULL;
     
-    /* clean up find & filter processes */
-    if (close(c->filter_fd) == -1) err(1, "close");
-    if ((kill(c->filter_pid, SIGKILL)) == -1) err(1, "kill");
-    if ((wait(NULL) == -1)) err(1, "wait");
-    c->find = NULL;
+    assign_doc_ids(c);
     
+    /* Schedule the largest files first, so that one big file doesn't
+     * leave a long single-worker tail at the end of the build. */
+    v_array_sort(c->fnames, fname_size_cmp);
+    c->f_tail = v_array_length(c->fnames);
     c->tick_max = v_array_length(c->fnames) / 100;
     
-    if (sp) fprintf(stderr, "-- %u files enqueued.\n", ct);
+    if (sp) fprintf(stderr, "-- %d files enqueued.\n", ct);
     return 0;
 }
@@ -1,12 +1,19 @@
 #ifndef FILTER_H
 #define FILTER_H
 
-/* Open a gln_filter co-process, saving its pid in PID and
- * returning its file descriptor. */
-int filter_open_coprocess(int *pid);
+/* Load and compile the index/ignore rules (see gln_filter(1)). */
+void filter_init(context *c);
 
-/* Read input from the gln_filter co-process and
- * enqueue files to be indexed.
+/* Should PATH be skipped, according to filtering rules? RD is the cached
+ * state for PATH's directory, or NULL. Safe to call from several threads. */
+int filter_should_skip(context *c, const rules_dir *rd, const char *path);
+
+/* Should the directory DPATH (ending in '/') be skipped whole? Only if
+ * the filtering rules would ignore every file in it. */
+int filter_should_prune(context *c, const char *dpath);
+
+/* Walk the index root, checking paths against the filter rules,
+ * and enqueue files to be indexed, largest first.
  * Returns <0 on error. */
 int filter_enqueue_files(context *c);
 
@@ -35,13 +35,28 @@ fname *fname_new(char *n, size_t len) {
     strncpy(name, n, len); /* strlcpy */
     name[len] = '\0';
     res->name = name;
+    res->size = 0;
+    res->id = 0;
     return res;
 }
 
+/* Compare fname pointers (as in a v_array) by name. */
+int fname_name_cmp(const void *a, const void *b) {
+    return strcmp((*(fname **)a)->name, (*(fname **)b)->name);
+}
+
+/* Compare fname pointers (as in a v_array) by size, largest first,
+ * then by name. */
+int fname_size_cmp(const void *a, const void *b) {
+    fname *fa = *(fname **)a, *fb = *(fname **)b;
+    if (fa->size != fb->size) return fa->size < fb->size ? 1 : -1;
+    return strcmp(fa->name, fb->name);
+}
+
 void fname_free_cb(void *f) {
     fname *fn = (fname *)f;
-    free(fn->name);
-    free(fn);
+    dealloc(fn->name, 'n');
+    dealloc(fn, 'f');
 }
 
 /* Add filename F to the set. */
@@ -4,6 +4,8 @@
 /* Box the filename pointer in a struct, for added typechecking. */
 typedef struct fname {
     char *name;
+    ulong size;             /* file size, for scheduling */
+    uint id;                /* doc ID, in postings */
 } fname;
 
 /* Make a new filename set. */
@@ -15,6 +17,13 @@ fname *fname_new(char *n, size_t len);
 /* Add filename F to the set. */
 fname *fname_add(set *s, fname *f);
 
+/* Compare fname pointers (as in a v_array) by name. */
+int fname_name_cmp(const void *a, const void *b);
+
+/* Compare fname pointers (as in a v_array) by size, largest first,
+ * then by name. */
+int fname_size_cmp(const void *a, const void *b);
+
 /* Callback for freeing filenames in an fname* set. */
 void fname_free_cb(void *f);
 
@@ -0,0 +1,512 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <err.h>
+#include <errno.h>
+
+#include "glean.h"
+#include "set.h"
+#include "word.h"
+#include "fname.h"
+#include "array.h"
+#include "gln_index.h"
+#include "db.h"
+#include "spill.h"
+#include "forward.h"
+
+/*
+ * forward.db format:
+ *    glnW [VERSION]
+ *    Repeated, one per file per set:
+ *      [set number/4] [doc ID/4] [name length/2] [name]
+ *      [token count/4] [token hashes, sorted, as varint deltas]
+ *
+ * tombstones format:
+ *    glnD [VERSION]
+ *    Repeated: [doc ID/4]
+ *
+ * Both are only ever appended to (or truncated by a full rebuild).
+ */
+
+static char *fwd_header = "glnW " GLN_VERSION_STRING " ";
+static char *tomb_header = "glnD " GLN_VERSION_STRING " ";
+
+/* A token posting, inverted to sort by file. */
+typedef struct posting {
+    uint doc;
+    hash_t whash;
+} posting;
+
+/* Postings for every file in the set being written. */
+typedef struct postings {
+    posting *ps;
+    ulong len;
+    ulong sz;
+} postings;
+
+/* Userdata for compact_record's forward_each. */
+typedef struct compact_udata {
+    uint first;
+    uint *docs;             /* merged files' new doc IDs */
+    uint di;
+    FILE *f;
+} compact_udata;
+
+/* Userdata for writing forward records. */
+typedef struct record_udata {
+    context *c;
+    FILE *f;
+    h_array *toks;          /* current file's token hashes */
+    h_array *empty;
+    postings *p;            /* all postings, by file */
+    v_array *fnames;        /* or, when spilled: files sorted by doc ID */
+    uint fi;                /* next file to write */
+    h_array *stops;         /* stop word hashes, sorted */
+    uint cur;               /* current file's doc ID */
+} record_udata;
+
+static char *gln_path(context *c, const char *fname) {
+    int len = strlen(c->wkdir) + strlen(fname) + 2;
+    char *path = alloc(len, 'p');
+    if (len <= snprintf(path, len, "%s/%s", c->wkdir, fname)) {
+        fprintf(stderr, "snprintf error\n");
+        exit(EXIT_FAILURE);
+    }
+    return path;
+}
+
+/* Read all of PATH into a new buffer. Returns NULL if it doesn't exist. */
+static unsigned char *read_file(const char *path, size_t *len) {
+    unsigned char *buf;
+    struct stat sb;
+    ssize_t res;
+    size_t o = 0;
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        if (errno == ENOENT) return NULL;
+        err(1, "%s", path);
+    }
+    if (fstat(fd, &sb) == -1) err(1, "%s", path);
+    buf = alloc(sb.st_size + 1, 'b');
+    while (o < sb.st_size) {
+        res = read(fd, buf + o, sb.st_size - o);
+        if (res == -1 && errno == EINTR) continue;
+        if (res <= 0) err(1, "%s", path);
+        o += res;
+    }
+    if (close(fd) == -1) err(1, "close");
+    *len = o;
+    return buf;
+}
+
+static void check_header(const char *path, unsigned char *buf, size_t len,
+                         const char *header) {
+    size_t hlen = strlen(header);
+    if (len < hlen || memcmp(buf, header, hlen) != 0)
+        errx(1, "%s: bad header or DB version, rebuild db", path);
+}
+
+static void put_int(FILE *f, u_int32_t n, int bytes) {
+    int i;
+    for (i=0; i<bytes; i++) {
+        if (putc(n & 0xff, f) == EOF) err(1, "putc");
+        n >>= 8;
+    }
+}
+
+static void put_varint(FILE *f, u_int32_t n) {
+    while (n >= 0x80) {
+        if (putc((n & 0x7f) | 0x80, f) == EOF) err(1, "putc");
+        n >>= 7;
+    }
+    if (putc(n, f) == EOF) err(1, "putc");
+}
+
+/* Read a BYTES-byte int at *O, advancing it. */
+static u_int32_t get_int(unsigned char *buf, size_t len, size_t *o, int bytes) {
+    u_int32_t n = 0;
+    int i;
+    if (*o + bytes > len) errx(1, "truncated forward index, rebuild db");
+    for (i=bytes-1; i>=0; i--) n = (n << 8) | buf[*o + i];
+    *o += bytes;
+    return n;
+}
+
+static u_int32_t get_varint(unsigned char *buf, size_t len, size_t *o) {
+    u_int32_t n = 0;
+    int shift = 0;
+    for (;;) {
+        if (*o >= len || shift > 28) errx(1, "truncated forward index, rebuild db");
+        n |= (u_int32_t) (buf[*o] & 0x7f) << shift;
+        if ((buf[(*o)++] & 0x80) == 0) return n;
+        shift += 7;
+    }
+}
+
+
+/**************
+ * Tombstones *
+ **************/
+
+static int cmp_doc(const void *va, const void *vb) {
+    uint a = *(const uint *) va, b = *(const uint *) vb;
+    return a < b ? -1 : a > b ? 1 : 0;
+}
+
+tombstones *forward_read_tombstones(const char *path) {
+    tombstones *t = alloc(sizeof(*t), 't');
+    size_t len, o, hlen = strlen(tomb_header);
+    unsigned char *buf = read_file(path, &len);
+    uint i, n = 0;
+    t->docs = NULL;
+    t->len = 0;
+    if (buf == NULL) return t;
+    check_header(path, buf, len, tomb_header);
+
+    t->docs = alloc(((len - hlen) / 4 + 1) * sizeof(uint), 't');
+    for (o = hlen; o < len; n++) t->docs[n] = get_int(buf, len, &o, 4);
+    dealloc(buf, 'b');
+
+    qsort(t->docs, n, sizeof(uint), cmp_doc);
+    for (i=0; i<n; i++) {
+        if (t->len > 0 && t->docs[t->len - 1] == t->docs[i]) continue;
+        t->docs[t->len++] = t->docs[i];
+    }
+    return t;
+}
+
+int forward_is_dead(tombstones *t, uint doc) {
+    uint lo = 0, hi = t->len, mid;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (t->docs[mid] < doc) lo = mid + 1; else hi = mid;
+    }
+    return lo < t->len && t->docs[lo] == doc;
+}
+
+void forward_free_tombstones(tombstones *t) {
+    if (t->docs) dealloc(t->docs, 't');
+    dealloc(t, 't');
+}
+
+
+/***********
+ * Reading *
+ ***********/
+
+void forward_each(context *c, tombstones *t, forward_each_cb *cb, void *udata) {
+    char *path = gln_path(c, ".gln/forward.db");
+    size_t len, o, start;
+    unsigned char *buf = read_file(path, &len);
+    fwd_record r;
+    uint i;
+
+    if (buf == NULL) { dealloc(path, 'p'); return; }
+    check_header(path, buf, len, fwd_header);
+    o = strlen(fwd_header);
+    while (o < len) {
+        start = o;
+        r.set = get_int(buf, len, &o, 4);
+        r.doc = get_int(buf, len, &o, 4);
+        r.namelen = get_int(buf, len, &o, 2);
+        r.name = (char *) buf + o;
+        if ((o += r.namelen) > len) errx(1, "truncated forward index, rebuild db");
+        r.ct = get_int(buf, len, &o, 4);
+        r.toks = buf + o;
+        for (i=0; i<r.ct; i++) (void) get_varint(buf, len, &o);
+        r.raw = buf + start;
+        r.rawlen = o - start;
+        r.live = !forward_is_dead(t, r.doc);
+        cb(&r, udata);
+    }
+    dealloc(buf, 'b');
+    dealloc(path, 'p');
+}
+
+void forward_tokens(fwd_record *r, h_array *a) {
+    size_t o = 0;
+    hash_t h = 0;
+    uint i;
+    for (i=0; i<r->ct; i++) {
+        h += get_varint((unsigned char *) r->toks, SIZE_MAX, &o);
+        h_array_append(a, h);
+    }
+}
+
+static void note_live(fwd_record *r, void *udata) {
+    context *c = (context *) udata;
+    char *name;
+    if (!r->live) return;
+    name = alloc(r->namelen + 1, 'n');
+    memcpy(name, r->name, r->namelen);
+    name[r->namelen] = '\0';
+    h_array_append(c->live, word_hash(name));
+    h_array_append(c->live_docs, r->doc);
+    dealloc(name, 'n');
+}
+
+void forward_load(context *c) {
+    char *tpath = gln_path(c, ".gln/tombstones");
+    tombstones *t = forward_read_tombstones(tpath);
+
+    c->set_id = db_set_count(c);
+    c->doc_base = db_next_doc(c);
+    c->live = h_array_new(16);
+    c->live_docs = h_array_new(16);
+    c->seen = h_array_new(16);
+    forward_each(c, t, note_live, c);
+    if (c->verbose) fprintf(stderr, "-- %u sets, %u indexed files\n",
+        c->set_id, h_array_length(c->live));
+
+    forward_free_tombstones(t);
+    dealloc(tpath, 'p');
+}
+
+
+/***********
+ * Writing *
+ ***********/
+
+static void add_postings(void *v, void *udata) {
+    word *w = (word *) v;
+    postings *p = (postings *) udata;
+    uint i;
+    if (w->stop) return;        /* not in the token DB either */
+    for (i=0; i<h_array_length(w->a); i++) {
+        if (p->len == p->sz) {
+            p->sz *= 2;
+            p->ps = ralloc(p->ps, p->sz * sizeof(posting), 'P');
+        }
+        p->ps[p->len].doc = h_array_get(w->a, i);
+        p->ps[p->len].whash = w->hash;
+        p->len++;
+    }
+}
+
+static int cmp_posting(const void *va, const void *vb) {
+    const posting *a = (const posting *) va, *b = (const posting *) vb;
+    if (a->doc != b->doc) return a->doc < b->doc ? -1 : 1;
+    return a->whash < b->whash ? -1 : a->whash > b->whash ? 1 : 0;
+}
+
+/* Append a forward record for file FN, with the (sorted) token
+ * hashes in TOKS. */
+static void put_record(record_udata *ud, fname *fn, h_array *toks) {
+    size_t namelen = strlen(fn->name);
+    hash_t last = 0;
+    uint i, ct = 0;
+
+    for (i=0; i<toks->len; i++)
+        if (i == 0 || toks->hs[i] != toks->hs[i - 1]) ct++;
+    put_int(ud->f, ud->c->set_id, 4);
+    put_int(ud->f, fn->id, 4);
+    put_int(ud->f, namelen, 2);
+    if (fwrite(fn->name, namelen, 1, ud->f) != 1) err(1, "fwrite");
+    put_int(ud->f, ct, 4);
+    for (i=0; i<toks->len; i++) {
+        if (i > 0 && toks->hs[i] == last) continue;
+        put_varint(ud->f, toks->hs[i] - last);
+        last = toks->hs[i];
+    }
+}
+
+/* Append the forward record for one file in the new set. */
+static void write_record(void *v, void *udata) {
+    fname *fn = (fname *) v;
+    record_udata *ud = (record_udata *) udata;
+    postings *p = ud->p;
+    ulong lo = 0, hi = p->len, mid, i;
+
+    while (lo < hi) {           /* find the file's first posting */
+        mid = lo + (hi - lo) / 2;
+        if (p->ps[mid].doc < fn->id) lo = mid + 1; else hi = mid;
+    }
+    ud->toks->len = 0;
+    for (i=lo; i<p->len && p->ps[i].doc == fn->id; i++)
+        h_array_append(ud->toks, p->ps[i].whash);
+    put_record(ud, fn, ud->toks);
+}
+
+static void add_fname(void *v, void *udata) {
+    v_array_append((v_array *) udata, v);
+}
+
+static void add_stop_word(void *v, void *udata) {
+    word *w = (word *) v;
+    if (w->stop) h_array_append((h_array *) udata, w->hash);
+}
+
+static int cmp_fname_id(const void *a, const void *b) {
+    uint ia = (*(fname **) a)->id, ib = (*(fname **) b)->id;
+    return ia < ib ? -1 : ia > ib ? 1 : 0;
+}
+
+/* Is HASH in the sorted array A? */
+static int has_hash(h_array *a, hash_t hash) {
+    uint lo = 0, hi = a->len, mid;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (a->hs[mid] < hash) lo = mid + 1; else hi = mid;
+    }
+    return lo < a->len && a->hs[lo] == hash;
+}
+
+/* Write records for the files (sorted by doc ID) up to and including
+ * doc ID DOC, those before it having no spilled postings. */
+static void put_records_through(record_udata *ud, uint doc) {
+    fname *fn;
+    while (ud->fi < ud->fnames->len) {
+        fn = (fname *) ud->fnames->vs[ud->fi];
+        if (fn->id > doc) break;
+        put_record(ud, fn, fn->id == doc ? ud->toks : ud->empty);
+        ud->fi++;
+    }
+    ud->toks->len = 0;
+}
+
+/* Collect spilled postings, by file, and write each file's record
+ * once they're all in. */
+static void spilled_posting(hash_t doc, hash_t whash, void *udata) {
+    record_udata *ud = (record_udata *) udata;
+    if (ud->toks->len > 0 && doc != ud->cur) put_records_through(ud, ud->cur);
+    ud->cur = doc;
+    if (!has_hash(ud->stops, whash)) h_array_append(ud->toks, whash);
+}
+
+/* Write the forward records from spilled postings, merged by file. */
+static void write_spilled_records(context *c, record_udata *ud) {
+    ud->fnames = v_array_new(16);
+    ud->stops = h_array_new(16);
+    ud->fi = 0;
+    set_apply(c->fn_set, add_fname, ud->fnames);
+    v_array_sort(ud->fnames, cmp_fname_id);
+    set_apply(c->word_set, add_stop_word, ud->stops);
+    h_array_sort(ud->stops);
+
+    spill_each_by_file(c->spill, spilled_posting, ud);
+    if (ud->toks->len > 0) put_records_through(ud, ud->cur);
+    put_records_through(ud, UINT32_MAX);
+
+    v_array_free(ud->fnames, NULL);
+    h_array_free(ud->stops);
+}
+
+/* Open PATH for appending, writing HEADER if it's new or empty. */
+static FILE *open_append(const char *path, const char *header, int update) {
+    FILE *f = fopen(path, update ? "a" : "w");
+    if (f == NULL || fseek(f, 0, SEEK_END) == -1) err(1, "%s", path);
+    if (ftell(f) == 0 && fputs(header, f) == EOF) err(1, "%s", path);
+    return f;
+}
+
+static void write_tombstones(context *c, const char *path) {
+    FILE *f = NULL;
+    uint i, ct = 0;
+
+    /* Any file indexed before that wasn't found unchanged has been
+     * removed or rewritten; either way, its old postings are stale. */
+    h_array_sort(c->seen);
+    for (i=0; i<h_array_length(c->live); i++) {
+        if (has_hash(c->seen, h_array_get(c->live, i))) continue;
+        if (f == NULL) f = open_append(path, tomb_header, 1);
+        put_int(f, h_array_get(c->live_docs, i), 4);
+        ct++;
+    }
+    if (f && fclose(f) != 0) err(1, "%s", path);
+    if (c->verbose) fprintf(stderr, "-- %u removed or changed files\n", ct);
+}
+
+void forward_write(context *c) {
+    char *fpath = gln_path(c, ".gln/forward.db");
+    char *tpath = gln_path(c, ".gln/tombstones");
+    record_udata ud;
+    postings p;
+
+    if (c->update) {
+        write_tombstones(c, tpath);
+    } else if (unlink(tpath) == -1 && errno != ENOENT) {
+        err(1, "%s", tpath);
+    }
+
+    ud.c = c;
+    ud.toks = h_array_new(16);
+    ud.empty = h_array_new(2);
+    ud.f = open_append(fpath, fwd_header, c->update);
+    if (c->spill) {
+        write_spilled_records(c, &ud);
+    } else {
+        p.len = 0;
+        p.sz = 64;
+        p.ps = alloc(p.sz * sizeof(posting), 'P');
+        set_apply(c->word_set, add_postings, &p);
+        qsort(p.ps, p.len, sizeof(posting), cmp_posting);
+        ud.p = &p;
+        set_apply(c->fn_set, write_record, &ud);
+        dealloc(p.ps, 'P');
+    }
+    if (fclose(ud.f) != 0) err(1, "%s", fpath);
+
+    h_array_free(ud.toks);
+    h_array_free(ud.empty);
+    dealloc(fpath, 'p');
+    dealloc(tpath, 'p');
+}
+
+
+/**************
+ * Compaction *
+ **************/
+
+/* Keep records for sets before the merged ones as-is, renumber the live
+ * records in merged sets (and give them their new doc IDs), and drop
+ * the rest. */
+static void compact_record(fwd_record *r, void *udata) {
+    compact_udata *ud = (compact_udata *) udata;
+    if (r->set < ud->first) {
+        if (fwrite(r->raw, r->rawlen, 1, ud->f) != 1) err(1, "fwrite");
+    } else if (r->live) {
+        put_int(ud->f, ud->first, 4);
+        put_int(ud->f, ud->docs[ud->di++], 4);
+        if (fwrite(r->raw + 8, r->rawlen - 8, 1, ud->f) != 1) err(1, "fwrite");
+    }
+}
+
+void forward_compact(context *c, tombstones *t, uint first, uint base,
+                     uint *docs) {
+    char *fpath = gln_path(c, ".gln/forward.db");
+    char *tpath = gln_path(c, ".gln/tombstones");
+    char *nfpath = gln_path(c, ".gln/forward.db.new");
+    char *ntpath = gln_path(c, ".gln/tombstones.new");
+    compact_udata ud;
+    FILE *f;
+    uint i;
+
+    ud.first = first;
+    ud.docs = docs;
+    ud.di = 0;
+    ud.f = open_append(nfpath, fwd_header, 0);
+    forward_each(c, t, compact_record, &ud);
+    if (fclose(ud.f) != 0) err(1, "%s", nfpath);
+
+    /* The merged set only has live postings, but older sets still need
+     * their tombstones. */
+    if (first > 0 && t->len > 0 && t->docs[0] < base) {
+        f = open_append(ntpath, tomb_header, 0);
+        for (i=0; i<t->len && t->docs[i] < base; i++) put_int(f, t->docs[i], 4);
+        if (fclose(f) != 0) err(1, "%s", ntpath);
+        if (rename(ntpath, tpath) == -1) err(1, "%s", tpath);
+    } else if (unlink(tpath) == -1 && errno != ENOENT) {
+        err(1, "%s", tpath);
+    }
+    if (rename(nfpath, fpath) == -1) err(1, "%s", fpath);
+
+    dealloc(fpath, 'p');
+    dealloc(tpath, 'p');
+    dealloc(nfpath, 'p');
+    dealloc(ntpath, 'p');
+}
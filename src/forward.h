@@ -0,0 +1,63 @@
+#ifndef FORWARD_H
+#define FORWARD_H
+
+/* Forward index (file -> tokens) and tombstones, in $GLN_DIR/.gln/.
+ *
+ * forward.db gets a record for each file in each set written to the
+ * token & filename DBs, listing the hashes of the tokens it contained.
+ * When an update (-u) finds that a previously indexed file was removed
+ * or rewritten, a tombstone is appended to the tombstones file: it marks
+ * the doc ID that file had in an older set as stale. */
+
+/* Tombstoned doc IDs, sorted. */
+typedef struct tombstones {
+    uint *docs;
+    uint len;
+} tombstones;
+
+/* Read the tombstones file at PATH. A missing file has none. */
+tombstones *forward_read_tombstones(const char *path);
+
+/* Are doc ID DOC's postings stale? */
+int forward_is_dead(tombstones *t, uint doc);
+
+void forward_free_tombstones(tombstones *t);
+
+/* A file's record in the forward index. */
+typedef struct fwd_record {
+    uint set;               /* set number */
+    uint doc;               /* doc ID */
+    const char *name;       /* not \0-terminated */
+    uint namelen;
+    uint ct;                /* token count */
+    const unsigned char *toks;  /* encoded token hashes */
+    const unsigned char *raw;   /* the whole encoded record */
+    size_t rawlen;
+    int live;               /* not tombstoned by a later set? */
+} fwd_record;
+
+typedef void (forward_each_cb)(fwd_record *r, void *udata);
+
+/* Call CB on every record in forward.db, in order, checking them
+ * against tombstones T. R is only valid during the callback. */
+void forward_each(context *c, tombstones *t, forward_each_cb *cb, void *udata);
+
+/* Decode R's token hashes, appending them to A. */
+void forward_tokens(fwd_record *r, struct h_array *a);
+
+/* When updating, note the files indexed by earlier sets and not
+ * since tombstoned, and the number of sets already written. */
+void forward_load(context *c);
+
+/* Append the new set's forward records, and tombstones for files
+ * that were removed or rewritten since the last update. */
+void forward_write(context *c);
+
+/* Rewrite forward.db and the tombstones after sets FIRST and later
+ * have been merged into set FIRST, without the postings tombstoned
+ * by T. The live files from those sets, in forward_each's order, now
+ * have doc IDs DOCS, and the merged set starts at doc ID BASE. */
+void forward_compact(context *c, tombstones *t, uint first, uint base,
+                     uint *docs);
+
+#endif
@@ -1,7 +1,9 @@
 #ifndef GLEAN_H
 #define GLEAN_H
 
-#define GLN_VERSION_STRING "000102"
+/* DB format version. Bump it with any change to a DB's layout, so older
+ * indexes are rejected ("rebuild db") rather than misread. */
+#define GLN_VERSION_STRING "000107"
 
 #ifdef NDEBUG
 #define DEBUG 0
@@ -19,6 +21,18 @@
 #define DEF_ZLIB_COMPRESS 6
 #define PROFILE_COMPRESSION 0
 
+/* Buckets this small are stored uncompressed: zlib's header and
+ * checksum would cost more than it saves, and reading them is free. */
+#define DB_RAW_MAX_SZ 48
+
+/* Each DB has a preset dictionary of up to DB_DICT_SZ bytes, trained
+ * on up to DB_DICT_SAMPLE_CT of its buckets (DB_DICT_SAMPLE_SZ bytes),
+ * and at most 1/DB_DICT_SAMPLE_RATIO the size of the sample. */
+#define DB_DICT_SZ (16 * 1024)
+#define DB_DICT_SAMPLE_CT 4096
+#define DB_DICT_SAMPLE_SZ (1024 * 1024)
+#define DB_DICT_SAMPLE_RATIO 8
+
 /* Compression helps quite a bit more with the filename DB than the token DB,
  * but it's cheap, so use it. */
 #define SKIP_COMPRESS 0
@@ -36,6 +50,33 @@ typedef unsigned long ulong;
 #define DEF_WORKER_CT 8
 #define MAX_WORKER_CT 64
 
+/* How many files can be sent to a tokenizer before it finishes the first? */
+#define DEF_QUEUE_DEPTH 4
+#define MAX_QUEUE_DEPTH 64
+
+/* When compacting, merge older sets up to this many times the size
+ * of the newer sets already being merged. */
+#define COMPACT_TIER_RATIO 4
+
+/* Postings longer than this are split into blocks of this many doc
+ * IDs, behind a skip table, so AND and NOT queries can pass over
+ * blocks without decoding them. */
+#define POSTING_BLOCK_CT 128
+
+/* The filename DB stores names in doc ID order, this many per bucket,
+ * so a doc ID's bucket is found directly from the set's offset table. */
+#define FNAME_BUCKET_CT 64
+
+/* When writing the DBs, threads compress this many buckets at a time,
+ * and get at most PACK_BATCH_AHEAD batches each ahead of the writer. */
+#define PACK_BATCH_CT 64
+#define PACK_BATCH_AHEAD 4
+
+/* DB files are written through a buffer this large, and (where
+ * supported) space is reserved this far ahead of the writes. */
+#define DB_WRITE_BUF_SZ (1024 * 1024)
+#define DB_PREALLOC_SZ (16 * 1024 * 1024)
+
 /* Number of 'X's to use for database data alignment */
 #define DB_X_CT 1
 
@@ -48,9 +89,15 @@ typedef unsigned long ulong;
 /* When showing progress, print a message every time this many files are enqueued */
 #define ENQUEUE_PROGRESS_CT 1000
 
+/* Size of the blocks that words and set links are allocated from. */
+#define ARENA_CHUNK_SZ (64 * 1024)
+
 /* Just die if we ever use more than this. */
 #define MAX_MEMORY (/* 1 GB */ 1024 * 1024 * 1024)
 
+/* Warn once this much is allocated, before reaching MAX_MEMORY. */
+#define ALLOC_SOFT_BUDGET (MAX_MEMORY / 4 * 3)
+
 #include "alloc.h"
 
 /* compiler flag for code not-yet-implemented */
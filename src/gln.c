@@ -12,6 +12,7 @@
 #include <sys/param.h>
 #include <sys/wait.h>
 #include <regex.h>
+#include <getopt.h>
 #include <zlib.h>
 
 #include "glean.h"
@@ -24,6 +25,11 @@
 #include "dumphex.h"
 #include "array.h"
 #include "nextline.h"
+#include "forward.h"
+#include "lz.h"
+#include "vbyte.h"
+#include "docset.h"
+#include "terms.h"
 
 #define HB HASH_BYTES
 
@@ -43,7 +49,7 @@ typedef void read_bucket_fun(dbinfo *db, ulong o);
 
 static void usage() {
     puts("glean, by Scott Vokes\n"
-        "usage: gln [-h] [-vgnNsDH] [-d db_path] QUERY\n"
+        "usage: gln [-h] [-vgnNpsDH] [-d db_path] [--mem-report] QUERY\n"
         "where QUERY can include AND, OR, or NOT\n");
     exit(1);
 }
@@ -55,7 +61,6 @@ static dbinfo *init_dbinfo() {
     memset(db, 0, sizeof(dbinfo));
     db->gln_dir = db_default_gln_dir();
     db->grepnames = 1;
-    db->compressed = 0;
     db->verbose = db->subtoken = db->tokens_only = 0;;
     return db;
 }
@@ -98,8 +103,9 @@ static void open_dbs(dbinfo *db) {
     if ((tfd = open(fn, O_RDONLY, 0)) == -1) err(1, "%s", fn);
     if ((db->tdb = mmap(NULL, tlen, PROT_READ, MAP_PRIVATE, tfd, 0)) == MAP_FAILED)
         err(1, "%s", fn);
+    db->tdblen = tlen;
     
-    free(fn);
+    dealloc(fn, 'n');
 }
 
 /* read $GLN_DIR/settings file */
@@ -121,8 +127,6 @@ static void read_settings(dbinfo *db) {
     while ((buf = nextline(settings, &len)) != NULL) {
         if (OPT("case_sensitive")) {
             db->case_sensitive = buf[len-2] == '1';
-        } else if (OPT("compressed")) {
-            db->compressed = buf[len-2] == '1';
         }
         /* other options go here later... */
     }
@@ -168,10 +172,15 @@ static u_int32_t rd_hash(char *buf, ulong offset) {
 static ll_offset *build_chain(char *p, uint offset) {
     ll_offset *cur, *prev = NULL;
     u_int32_t off;
+    uint set = 0;
     off = rd_int32(p, offset);
     while (off != 0) {
         cur = alloc(sizeof(ll_offset), 'o');
         cur->o = off;
+        cur->set = set++;
+        cur->first = rd_int32(p, off + 8);
+        cur->ct = rd_int32(p, off + 12);
+        cur->terms = rd_int32(p, off + 16);
         if (DEBUG) fprintf(stderr, "Adding offset %u (0x%04x)\n", off, off);
         cur->n = prev;  /* cons to front; newest results first */
         prev = cur;
@@ -181,6 +190,17 @@ static ll_offset *build_chain(char *p, uint offset) {
     return prev;
 }
 
+/* Find the preset dictionary after the header fields at OFFSET, if
+ * any: the first set follows it. */
+static char *read_dict(char *p, uint offset, uint *len) {
+    if (rd_int32(p, offset + 4) <= offset + 8) {
+        *len = 0;               /* older DB, without one */
+        return NULL;
+    }
+    *len = rd_int32(p, offset + 8);
+    return p + offset + 12;
+}
+
 static void check_db_headers(dbinfo *db) {
     uint offset;
     uint tbsz, fbsz;             /* token, filename buffer sizes */
@@ -196,41 +216,113 @@ static void check_db_headers(dbinfo *db) {
     fbsz = rd_int32(db->fdb, offset);
     if (DEBUG) fprintf(stderr, "\nfdb, buf sz %d\n", fbsz);
     db->fdb_head = build_chain(db->fdb, offset + 4);
+    db->fdict = read_dict(db->fdb, offset, &db->fdictlen);
     
     tbsz = rd_int32(db->tdb, offset);
     if (DEBUG) fprintf(stderr, "\ntdb, buf sz %d\n", tbsz);
     db->tdb_head = build_chain(db->tdb, offset + 4);
+    db->tdict = read_dict(db->tdb, offset, &db->tdictlen);
     
     db->buflen = (fbsz > tbsz ? fbsz : tbsz) + 1;
     db->tdfl_buf = alloc(db->buflen, 'b');
     db->fdfl_buf = alloc(db->buflen, 'b');
 }
 
+/* Read the tombstones left by updates (gln_index -u) that removed
+ * or rewrote files, so their stale postings can be skipped. */
+static void read_tombstones(dbinfo *db) {
+    int path_len = strlen(db->gln_dir) + 2 + strlen("/.gln/tombstones");
+    char *path = alloc(path_len, 'p');
+    if (path_len <= snprintf(path, path_len,
+            "%s/.gln/tombstones", db->gln_dir)) {
+        fprintf(stderr, "snprintf error\n");
+        exit(EXIT_FAILURE);
+    }
+    db->dead = forward_read_tombstones(path);
+    if (DEBUG) fprintf(stderr, "%u tombstones\n", db->dead->len);
+    dealloc(path, 'p');
+}
+
 static void free_grep(grep *g) {
     grep *ng;
     ng = g->g;
     if (g->thashes) h_array_free(g->thashes);
-    /* g->results is aliased and freed by free_dbinfo below. */
+    if (g->results) docset_free(g->results);
     if (g->tokens) v_array_free(g->tokens, &free);
-    free(g);
+    dealloc(g, 'g');
     if (ng) free_grep(ng);
 }
 
 static void free_dbinfo(dbinfo *db) {
-    if (db->tdfl_buf) free(db->tdfl_buf);
-    if (db->fdfl_buf) free(db->fdfl_buf);
+    if (db->tdfl_buf) dealloc(db->tdfl_buf, 'b');
+    if (db->fdfl_buf) dealloc(db->fdfl_buf, 'b');
     if (db->fnames) v_array_free(db->fnames, &free);
     if (db->results) h_array_free(db->results);
     if (db->g) free_grep(db->g);
-    free(db);
+    if (db->dead) forward_free_tombstones(db->dead);
+    if (db->postings) dealloc(db->postings, 'h');
+    if (db->zs) {
+        (void) inflateEnd(db->zs);
+        dealloc(db->zs, 'z');
+    }
+    dealloc(db, 'd');
 }
 
-static ulong uncompress_buffer(char *dfl_buf, ulong buflen, char *srcbuf, ulong srclen) {
-    ulong destlen = buflen;
-    int res = uncompress((unsigned char *) dfl_buf, &destlen,
-        (unsigned char *) srcbuf, srclen);
+/* Inflate SRCLEN bytes at SRC into BUF, with preset dictionary DICT
+ * (of DICTLEN bytes) if the bucket was compressed with one. */
+static ulong inflate_buffer(dbinfo *db, char *dict, uint dictlen,
+    char *buf, char *src, ulong srclen) {
+    z_stream *zs = db->zs;
+    int res;
+    if (zs == NULL) {
+        zs = db->zs = alloc(sizeof(z_stream), 'z');
+        memset(zs, 0, sizeof(z_stream));
+        res = inflateInit(zs);
+    } else {
+        res = inflateReset(zs);
+    }
     assert(res == Z_OK);
-    return destlen;
+    zs->next_in = (Bytef *) src;
+    zs->avail_in = srclen;
+    zs->next_out = (Bytef *) buf;
+    zs->avail_out = db->buflen;
+    res = inflate(zs, Z_FINISH);
+    if (res == Z_NEED_DICT) {
+        if (dict == NULL) errx(1, "bucket needs a missing dictionary, rebuild db");
+        res = inflateSetDictionary(zs, (Bytef *) dict, dictlen);
+        if (res == Z_OK) res = inflate(zs, Z_FINISH);
+    }
+    if (res != Z_STREAM_END) errx(1, "corrupt bucket, rebuild db");
+    return zs->total_out;
+}
+
+/* Decode the bucket at offset O in BASE. Sets *LEN to its length and
+ * returns its contents, which are either in BUF or (for uncompressed
+ * buckets) point into BASE. */
+static char *read_bucket(dbinfo *db, char *base, ulong o, char *buf, ulong *len) {
+    ulong clen = rd_int32(base, o + DB_X_CT); /* stored byte count */
+    char *src = base + o + 4 + DB_X_CT;
+    char *dict = base == db->tdb ? db->tdict : db->fdict;
+    uint dictlen = base == db->tdb ? db->tdictlen : db->fdictlen;
+    size_t res;
+    
+    switch (base[o]) {
+    case CODEC_RAW:
+        *len = clen;
+        return src;
+    case CODEC_ZLIB:
+        *len = inflate_buffer(db, dict, dictlen, buf, src, clen);
+        return buf;
+    case CODEC_LZ:
+        res = lz_decompress((unsigned char *) dict, dictlen,
+            (unsigned char *) src, clen,
+            (unsigned char *) buf, db->buflen);
+        if (res == LZ_ERROR) errx(1, "corrupt bucket, rebuild db");
+        *len = res;
+        return buf;
+    default:
+        errx(1, "unknown bucket codec '%c', rebuild db", base[o]);
+    }
 }
 
 
@@ -239,30 +331,24 @@ static ulong uncompress_buffer(char *dfl_buf, ulong buflen, char *srcbuf, ulong
  *************/
 
 static void dump_fname_bucket(dbinfo *db, ulong o) {
-    int i, xo = DB_X_CT;
-    ulong len = rd_int32(db->fdb, o + xo); /* compressed byte count */
-    ulong zo = o + 4 + xo;
-    ulong off, hash, noff;
-    char *dfl_buf = db->fdfl_buf;
+    ulong len, i, ct;
+    char *dfl_buf, *name;
     
     int fnames = 0, fname_bytes = 0;
     
-    if (xo > 0) for (i=0; i<xo; i++) assert(db->fdb[o + i] == 'X');
-    if (DEBUG) fprintf(stderr, "Compressed:\t%lu bytes\n", len);
-    len = uncompress_buffer(dfl_buf, db->buflen, db->fdb + zo, len);
+    if (DEBUG) fprintf(stderr, "Stored:\t%lu bytes ('%c')\n",
+        (ulong) rd_int32(db->fdb, o + DB_X_CT), db->fdb[o]);
+    dfl_buf = read_bucket(db, db->fdb, o, db->fdfl_buf, &len);
     if (DEBUG) fprintf(stderr, "Deflated:\t%lu bytes\n", len);
     
     if (DEBUG) dumphex(stderr, dfl_buf, len);
-    off = 0;
-    do {
-        noff = rd_int32(dfl_buf, off);
-        hash = rd_hash(dfl_buf, off + 4);
-        len = strlen(dfl_buf + off + 4 + HB);
-        if (db->verbose > 0) printf("hash: 0x%04lx, len: %ld\t %s\n",
-            hash, len, dfl_buf + off + 4 + HB);
+    ct = len > 0 ? rd_int32(dfl_buf, 0) / 4 : 0;  /* names follow offsets */
+    for (i=0; i<ct; i++) {
+        name = dfl_buf + rd_int32(dfl_buf, i * 4);
+        len = strlen(name);
+        if (db->verbose > 0) printf("doc: +%lu, len: %ld\t %s\n", i, len, name);
         fnames++; fname_bytes += len;
-        off = noff;
-    } while (off != 0);
+    }
     printf("f: %d filenames, %d bytes\n", fnames, fname_bytes);
 }
 
@@ -271,38 +357,86 @@ static void dump_fname_bucket(dbinfo *db, ulong o) {
  * Tokens *
  **********/
 
+/* Decode the CT doc IDs coded at BUF[O..END) into db->postings. */
+static hash_t *decode_block(dbinfo *db, char *buf, ulong o, ulong end, uint ct) {
+    if (ct > db->postings_sz) {
+        if (db->postings) dealloc(db->postings, 'h');
+        db->postings_sz = ct;
+        db->postings = alloc(ct * sizeof(hash_t), 'h');
+    }
+    if (vbyte_decode((unsigned char *) buf + o, end - o, ct, db->postings) == 0
+        && ct > 0)
+        bail("token.db: corrupt postings, rebuild db\n");
+    db->blocks_read++;
+    return db->postings;
+}
+
+/* Add the CT doc IDs listed at offset O in a token bucket's data
+ * BUF, which ends at END, to FS. If FILTER isn't NULL, only IDs in it
+ * are wanted, so blocks whose range doesn't hold any of them are
+ * skipped by the skip table, without decoding. */
+static void append_postings(dbinfo *db, char *buf, ulong o, ulong end,
+    uint ct, docset *filter, docset *fs) {
+    uint b, n, blocks = (ct + POSTING_BLOCK_CT - 1) / POSTING_BLOCK_CT;
+    ulong bo, bend, data = o + blocks * 8;
+    hash_t last, prev = 0;
+    
+    if (blocks <= 1) {
+        docset_add_sorted(fs, decode_block(db, buf, o, end, ct), ct);
+        return;
+    }
+    for (b=0, bo=data; b<blocks; b++, bo=bend, prev=last) {
+        last = rd_int32(buf, o + b*8);
+        bend = data + rd_int32(buf, o + b*8 + 4);
+        n = b + 1 < blocks ? POSTING_BLOCK_CT : ct - b * POSTING_BLOCK_CT;
+        if (filter && !docset_has_range(filter, b > 0 ? prev + 1 : 0, last)) {
+            db->blocks_skipped++;
+            continue;
+        }
+        docset_add_sorted(fs, decode_block(db, buf, bo, bend, n), n);
+    }
+}
+
 static void dump_token_bucket(dbinfo *db, ulong o) {
-    int i, xo = DB_X_CT;
-    ulong len = rd_int32(db->tdb, o + xo); /* compressed byte count */
-    ulong zo = o + 4 + xo;
-    ulong off, hash, fhash, noff;
-    char *dfl_buf = db->tdfl_buf;
+    int i;
+    ulong len, blen, end;
+    ulong off, hash, noff;
+    char *dfl_buf;
+    docset *ds;
+    h_array *docs = h_array_new(2);
     int vb = db->verbose > 0;
     int tokens=0, token_bytes=0, token_hash_bytes=0;
     
-    if (xo > 0) for (i=0; i<xo; i++) assert(db->tdb[o + i] == 'X');
-    if (DEBUG) fprintf(stderr, "Compressed:\t%lu bytes\n", len);
-    len = uncompress_buffer(dfl_buf, db->buflen, db->tdb + zo, len);
+    if (DEBUG) fprintf(stderr, "Stored:\t%lu bytes ('%c')\n",
+        (ulong) rd_int32(db->tdb, o + DB_X_CT), db->tdb[o]);
+    dfl_buf = read_bucket(db, db->tdb, o, db->tdfl_buf, &len);
     if (DEBUG) fprintf(stderr, "Deflated:\t%lu bytes\n", len);
     
     if (DEBUG) dumphex(stderr, dfl_buf, len);
+    blen = len;
     off = 0;
-    do {
+    if (len > 0) do {
         noff = rd_int32(dfl_buf, off);
         hash = rd_hash(dfl_buf, off + 4);
-        len = rd_int16(dfl_buf, off + 4 + HB);
+        len = rd_int32(dfl_buf, off + 4 + HB);
+        end = noff ? noff : blen;
+        ds = docset_new();
+        append_postings(db, dfl_buf, off + 8 + HB, end, len, NULL, ds);
+        docs->len = 0;
+        docset_append_to(ds, docs);
+        docset_free(ds);
         tokens++; token_bytes += len;
-        if (vb) printf("token: 0x%04lx, files:", hash);
+        token_hash_bytes += end - (off + 8 + HB);
+        if (vb) printf("token: 0x%04lx, docs:", hash);
         for (i=0; i<len; i++) {
-            fhash = rd_hash(dfl_buf, off + 6 + HB + i*HB);
-            if (vb) printf(" %04lx", fhash);
-            token_hash_bytes += HB;
+            if (vb) printf(" %u", h_array_get(docs, i));
         }
         if (vb) puts("");
         off = noff;
     } while (off != 0);
     printf("b: %d tokens, %d token bytes, %d token hash bytes\n",
         tokens, token_bytes, token_hash_bytes);
+    h_array_free(docs);
 }
 
 
@@ -321,10 +455,11 @@ static void dump_db(dbinfo *dbi, char *db, ll_offset *db_head,
         o = cur->o;
         head = o + 4;
         buckets = rd_int32(db, head)/4;
-        printf("Bucket count: %lu\n", buckets + 1);
+        printf("Bucket count: %lu, %u doc IDs from %u\n", buckets + 1,
+            cur->ct, cur->first);
         
         for (i=0; i<buckets; i++) {
-            o = rd_int32(db, head + 4 + (i*4));
+            o = rd_int32(db, cur->o + DB_SET_HEADER_SZ + (i*4));
             printf("\nBucket %ld, offset: %lu (0x%04lx), head %lu (0x%04lx)\n",
                 i, o, o, head, head);
             read_bucket(dbi, o);
@@ -346,46 +481,50 @@ static int hash_loop(char *buf) {
     return 0;
 }
 
-static void append_matches_in_bucket(dbinfo *db, hash_t tokhash,
-    uint b_offset, h_array *fs) {
-    int i, xo = DB_X_CT;
-    ulong len = rd_int32(db->tdb, b_offset + xo); /* compressed byte count */
-    ulong zo = b_offset + 4 + xo;
-    ulong off, hash, fhash, noff;
-    char *dfl_buf = db->tdfl_buf;
-    if (xo > 0) for (i=0; i<xo; i++) assert(db->tdb[b_offset + i] == 'X');
-    len = uncompress_buffer(dfl_buf, db->buflen, db->tdb + zo, len);
+/* Add the doc IDs listed for TOKHASH in the bucket at B_OFFSET to FS
+ * (with a FILTER, only those that may be in it). */
+static ulong append_matches_in_bucket(dbinfo *db, hash_t tokhash,
+    uint b_offset, docset *filter, docset *fs) {
+    ulong len, blen, ct = 0;
+    ulong off, hash, noff;
+    char *dfl_buf = read_bucket(db, db->tdb, b_offset, db->tdfl_buf, &blen);
+    if (blen == 0) return 0;    /* empty bucket */
     
     off = 0;
     do {
         noff = rd_int32(dfl_buf, off);
         hash = rd_hash(dfl_buf, off + 4);
-        len = rd_int16(dfl_buf, off + 4 + HB);
+        len = rd_int32(dfl_buf, off + 4 + HB);
         if (DEBUG) fprintf(stderr, "noff: %04lx\thash: %04lx\tlen: %lu\ttokhash: %04x\n",
             noff, hash, len, tokhash);
-        if (hash == tokhash) {
-            for (i=0; i<len; i++) {
-                fhash = rd_hash(dfl_buf, off + 6 + HB + i*HB);
-                h_array_append(fs, fhash);
-            }
-        }
+        if (hash == tokhash && fs != NULL)
+            append_postings(db, dfl_buf, off + 8 + HB, noff ? noff : blen,
+                len, filter, fs);
+        if (hash == tokhash) ct += len;
         off = noff;
     } while (off != 0);
+    return ct;
 }
 
-static void append_token_files(dbinfo *db, hash_t hash, h_array *fs) {
+/* Add the docs with the token with HASH to FS, skipping posting blocks
+ * with none in FILTER (if non-NULL). Returns its posting count, from
+ * every set; if FS is NULL, only counts them, without decoding any. */
+static ulong append_token_files(dbinfo *db, hash_t hash, docset *filter,
+    docset *fs) {
     ll_offset *cur;
     uint buckets, b, bo; /* bucket number, bucket offset */
+    ulong ct = 0;
     
     for (cur=db->tdb_head; cur != NULL; cur=cur->n) {
         buckets = rd_int32(db->tdb, cur->o + 4)/4;
         b = hash % buckets;
-        bo = rd_int32(db->tdb, cur->o + 8 + b*4);
+        bo = rd_int32(db->tdb, cur->o + DB_SET_HEADER_SZ + b*4);
         if (DEBUG) fprintf(stderr, "buckets: %d; hash: 0x%04x; b:%d\n",
             buckets, hash, b);
-        append_matches_in_bucket(db, hash, bo, fs);
+        ct += append_matches_in_bucket(db, hash, bo, filter, fs);
         /* get_fns(db, hash, bo); */
     }
+    return ct;
 }
 
 
@@ -399,7 +538,7 @@ static grep *init_grep(char *pattern, enum grep_op op, grep *parent) {
     g->pattern = pattern;
     g->tokens = v_array_new(4);
     g->thashes = h_array_new(4);
-    g->results = h_array_new(4);
+    g->results = docset_new();
     if (parent) parent->g = g;
     g->g = NULL;
     return g;
@@ -428,47 +567,210 @@ static void build_query(dbinfo *db, int *argc, char **argv[]) {
     }
 }
 
-static void format_cmd(dbinfo *db, char *cmd, char *pat, char *tokpath) {
-    char *gz = (db->compressed ? "z" : "");
-    char *cs_flag = db->case_sensitive ? "" : "-i";
-    char *fmt = db->subtoken
-            ? "%sgrep \"%s\" %s %s |sort|uniq"
-            : "%sgrep %s \"^%s$\" %s |sort|uniq";
-    if (PATH_MAX + 1 <= snprintf(cmd, PATH_MAX + 1,
-            fmt, gz, cs_flag, pat, tokpath)) {
+/* Userdata for add_token. */
+typedef struct token_match {
+    regex_t *re;              /* pattern, or NULL for exact lookups */
+    const char *glob;         /* glob to check candidates against, or NULL */
+    int case_sensitive;
+    v_array *tokens;
+} token_match;
+
+static void add_token(const char *term, uint len, void *udata) {
+    token_match *tm = (token_match *) udata;
+    char *tok;
+    if (tm->re && regexec(tm->re, term, 0, NULL, 0) != 0) return;
+    if (tm->glob && !terms_glob_match(tm->glob, term, tm->case_sensitive))
+        return;
+    tok = alloc(len + 1, 't');
+    memcpy(tok, term, len + 1);
+    v_array_append(tm->tokens, tok);
+}
+
+/* Is PAT a plain token, without any regex operators? */
+static int is_literal(const char *pat) {
+    return strpbrk(pat, ".[]*^$\\") == NULL;
+}
+
+/* Copy the literal text that every match of the anchored basic regex
+ * PAT starts with into BUF (of SZ bytes), e.g. "sock" for "sock_.*". */
+static void regex_prefix(const char *pat, char *buf, uint sz) {
+    uint i = strcspn(pat, ".[]*^$\\");
+    if (strstr(pat, "\\|") != NULL) {
+        i = 0;                  /* GNU alternation: no common prefix */
+    } else if (i > 0 && (pat[i] == '*'
+            || (pat[i] == '\\' && strchr("{?+", pat[i + 1]) != NULL))) {
+        i--;                    /* the last char is repeated */
+    }
+    if (i >= sz) i = sz - 1;
+    memcpy(buf, pat, i);
+    buf[i] = '\0';
+}
+
+/* End the literal run from *START to *O in BUF, keeping it in LITS (at
+ * *CT) if it's long enough to have a trigram. */
+static void end_literal(char *buf, uint *start, uint *o, char **lits, uint *ct) {
+    if (*o - *start >= 3) {
+        buf[(*o)++] = '\0';
+        lits[(*ct)++] = buf + *start;
+    } else {
+        *o = *start;
+    }
+    *start = *o;
+}
+
+/* Find the ']' closing the bracket expression at P, or NULL if it's
+ * unterminated. A ']' first in it is literal. */
+static const char *class_end(const char *p, int glob) {
+    p++;
+    if (*p == '!' || *p == '^') p++;
+    if (*p == ']' || (glob && *p != '\0')) p++;
+    for (; *p != '\0' && *p != ']'; p++) {
+        if (!glob && *p == '[' && p[1] != '\0' && strchr(":.=", p[1]) != NULL
+            && (p = strchr(p + 2, ']')) == NULL)
+            return NULL;
+    }
+    return *p == ']' ? p : NULL;
+}
+
+/* Split out the literal runs every match of PAT must contain, such as
+ * "ioctl" and "sock" in "ioctl.*sock", into BUF (which needs 2 *
+ * strlen(PAT) + 1 bytes), saving those of three or more bytes in LITS
+ * (room for strlen(PAT) + 1). PAT is a basic regex, or a glob if GLOB.
+ * A run ends at anything its matches may not contain literally: a
+ * class, a char made optional by '*' (or \{, \?), a group, or a GNU
+ * escape like \w. Returns their count. */
+static uint pattern_literals(const char *pat, int glob, char *buf, char **lits) {
+    const char *p, *q;
+    uint o = 0, start = 0, ct = 0, depth = 0;
+    if (!glob && strstr(pat, "\\|") != NULL) return 0;
+    for (p = pat; *p != '\0'; p++) {
+        if (*p == '[' && (q = class_end(p, glob)) != NULL) {
+            p = q;
+        } else if (*p == '*' || (glob && *p == '?')) {
+            if (!glob && o > start) o--;    /* the char before is optional */
+        } else if (!glob && strchr(".^$", *p) != NULL) {
+            ;
+        } else if (*p == '\\' && p[1] != '\0') {
+            p++;
+            if (glob || !(isalnum((unsigned char) *p)
+                    || strchr("(){}?+<>`'", *p) != NULL)) {
+                if (depth == 0) {
+                    buf[o++] = *p;
+                    continue;
+                }
+            } else if (*p == '(') {
+                depth++;
+            } else if (*p == ')') {
+                if (depth > 0) depth--;
+            } else if (*p == '{' || *p == '?') {
+                if (o > start) o--;
+                if (*p == '{' && (q = strstr(p, "\\}")) != NULL) p = q + 1;
+            }
+        } else if (depth == 0) {
+            buf[o++] = *p;
+            continue;
+        }
+        end_literal(buf, &start, &o, lits, &ct);
+    }
+    end_literal(buf, &start, &o, lits, &ct);
+    return ct;
+}
+
+/* Compile PAT as a basic regex, anchored at both ends unless looking
+ * for subtokens (-s). */
+static void compile_pattern(dbinfo *db, char *pat, regex_t *re) {
+    int len = strlen(pat) + 3, res;
+    char *anchored = alloc(len, 'g');
+    char msg[256];
+    if (len <= snprintf(anchored, len, db->subtoken ? "%s" : "^%s$", pat)) {
         fprintf(stderr, "snprintf error\n");
         exit(EXIT_FAILURE);
     }
+    res = regcomp(re, anchored, REG_NOSUB | (db->case_sensitive ? 0 : REG_ICASE));
+    if (res != 0) {
+        (void) regerror(res, re, msg, sizeof(msg));
+        errx(1, "bad pattern '%s': %s", pat, msg);
+    }
+    dealloc(anchored, 'g');
+}
+
+static int token_cmp(const void *a, const void *b) {
+    return strcmp(*(char **) a, *(char **) b);
+}
+
+/* Remove duplicates from the sorted token array; a token can be in
+ * several sets. */
+static void uniq_tokens(v_array *a) {
+    uint i, o = 0;
+    for (i=0; i<a->len; i++) {
+        if (o > 0 && strcmp(a->vs[i], a->vs[o - 1]) == 0) {
+            dealloc(a->vs[i], 't');
+        } else {
+            a->vs[o++] = a->vs[i];
+        }
+    }
+    a->len = o;
 }
 
+/* Find the tokens each grep's pattern matches in the sets' term
+ * dictionaries. A plain token is found by binary search; so are the
+ * terms starting with a glob's (-p) or anchored regex's literal prefix,
+ * the only ones it's then matched against. Otherwise (e.g. with -s),
+ * it's only matched against the terms with the trigrams of the literals
+ * it requires, or failing that, every term. */
 static void gen_matching_tokens(dbinfo *db) {
     grep *g;
-    char *pat, *buf, *tok;
-    size_t len;
-    char tokpath[PATH_MAX + 1], cmd[PATH_MAX + 1];
-    FILE *pipe;
-    hash_t hash;
-    uint ct;
-    
-    if (PATH_MAX + 1 <= snprintf(tokpath, PATH_MAX + 1,
-            "%s/.gln/tokens%s",
-            db->gln_dir, db->compressed ? ".gz" : "")) {
-        fprintf(stderr, "snprintf error\n");
-        exit(EXIT_FAILURE);
-    }
+    ll_offset *cur;
+    token_match tm;
+    regex_t re;
+    terms t;
+    h_array *cands;
+    char *pat, *tok, prefix[MAX_WORD_SZ + 1], *litbuf, **lits;
+    int literal, prefixed, cs = db->case_sensitive;
+    uint i, ct, lit_ct;
     
     for (g = db->g; g != NULL; g = g->g) {
         pat = g->pattern;
-        format_cmd(db, cmd, pat, tokpath);
-        if ((pipe = popen(cmd, "r")) == NULL) err(1, "popen fail");
-        while ((buf = nextline(pipe, &len))) {
-            if (buf[len - 1] == '\n') buf[len - 1] = '\0';
-            tok = alloc(len + 1, 't');
-            strncpy(tok, buf, len);
-            tok[len] = '\0';
-            v_array_append(g->tokens, tok);
-            hash = word_hash(buf);
-            h_array_append(g->thashes, hash);
+        literal = !db->glob && !db->subtoken && is_literal(pat);
+        if (!literal && !db->glob) compile_pattern(db, pat, &re);
+        prefixed = db->glob && strchr("*?[\\", pat[0]) == NULL;
+        tm.re = literal || db->glob ? NULL : &re;
+        tm.glob = db->glob && !prefixed ? pat : NULL;
+        tm.case_sensitive = cs;
+        tm.tokens = g->tokens;
+        prefix[0] = '\0';
+        if (!literal && !db->glob && !db->subtoken)
+            regex_prefix(pat, prefix, sizeof(prefix));
+        litbuf = alloc(2 * strlen(pat) + 1, 'g');
+        lits = alloc((strlen(pat) + 1) * sizeof(char *), 'g');
+        lit_ct = pattern_literals(pat, db->glob, litbuf, lits);
+        for (cur = db->tdb_head; cur != NULL; cur = cur->n) {
+            if (cur->terms == 0) continue;
+            if (terms_open(&t, db->tdb + cur->terms, db->tdblen - cur->terms) < 0)
+                bail("token.db: corrupt term dictionary, rebuild db\n");
+            if (literal) {
+                terms_lookup(&t, pat, cs, add_token, &tm);
+            } else if (prefixed) {
+                terms_glob(&t, pat, cs, add_token, &tm);
+            } else if (prefix[0] != '\0') {
+                terms_prefix(&t, prefix, cs, add_token, &tm);
+            } else if ((cands = terms_candidates(&t, lits, lit_ct)) != NULL) {
+                if (DEBUG) fprintf(stderr, "%u of %u terms are candidates\n",
+                    cands->len, t.ct);
+                terms_each_id(&t, cands, add_token, &tm);
+                h_array_free(cands);
+            } else {
+                terms_each(&t, add_token, &tm);
+            }
+        }
+        dealloc(litbuf, 'g');
+        dealloc(lits, 'g');
+        if (tm.re) regfree(&re);
+        v_array_sort(g->tokens, token_cmp);
+        uniq_tokens(g->tokens);
+        for (i=0; i<v_array_length(g->tokens); i++) {
+            tok = (char *) v_array_get(g->tokens, i);
+            h_array_append(g->thashes, word_hash(tok));
             if (db->tokens_only) printf("%s\n", tok);
         }
         ct = h_array_length(g->thashes);
@@ -478,94 +780,112 @@ static void gen_matching_tokens(dbinfo *db) {
     }
 }
 
-static void gen_matching_file_hashes(dbinfo *db) {
-    grep *g;
-    hash_t hash;
-    uint i;
-    for (g = db->g; g != NULL; g = g->g) {
-        for (i = 0; i < h_array_length(g->thashes); i++) {
-            hash = h_array_get(g->thashes, i);
-            append_token_files(db, hash, g->results);
-        }
-        h_array_sort(g->results);
-        h_array_uniq(g->results);
+static void dump_grep(grep *g) {
+    int i;
+    h_array *docs = h_array_new(4);
+    docset_append_to(g->results, docs);
+    printf("%-4s %s:", op_strs[g->op], g->pattern);
+    for (i=0; i < h_array_length(docs); i++) {
+        printf(" %u", h_array_get(docs, i));
     }
+    puts("");
+    h_array_free(docs);
 }
 
-static void dump_grep(grep *head) {
-    int i=0;
-    grep *g;
-    for (g = head; g != NULL; g=g->g) {
-        printf("%-4s %s:", op_strs[g->op], g->pattern);
-        for (i=0; i < h_array_length(g->results); i++) {
-            printf(" %04x", h_array_get(g->results, i));
-        }
-        puts("");
+/* Combine grep G's results with RES, the results of the greps before
+ * it, in place. The first grep's results are taken over as RES. */
+static docset *combine_results(grep *g, docset *res) {
+    if (res == NULL) {
+        res = g->results;
+        g->results = NULL;
+    } else if (g->op == AND || g->op == NEAR) {
+        docset_and(res, g->results);
+    } else if (g->op == OR) {
+        docset_or(res, g->results);
+    } else if (g->op == NOT) {
+        docset_andnot(res, g->results);
+    } else {
+        err(1, "match fail");
     }
+    return res;
 }
 
-static void filter_results(dbinfo *db) {
-    h_array *res = NULL, *nres = NULL;
-    grep *g = NULL;
-    assert(db->g);
-    for (g = db->g; g != NULL; g=g->g) {
-        if (res) {
-            if (g->op == AND || g->op == NEAR) {
-                nres = h_array_intersection(g->results, res);
-            } else if (g->op == OR) {
-                nres = h_array_union(g->results, res);
-            } else if (g->op == NOT) {
-                nres = h_array_complement(res, g->results);
-            } else {
-                err(1, "match fail");
-            }
-            assert(nres);
-            if (nres != res) { free(res); if (res) res = nres; }
-        } else if (g->results) {
-            assert(g->results);
-            res = g->results;
-        }
-    }
-    assert(res);
-    db->results = res;
+/* How many postings do G's tokens have? An upper bound on its docs. */
+static ulong grep_postings(dbinfo *db, grep *g) {
+    ulong ct = 0;
+    uint i;
+    for (i = 0; i < h_array_length(g->thashes); i++)
+        ct += append_token_files(db, h_array_get(g->thashes, i), NULL, NULL);
+    return ct;
 }
 
-static void append_matching_fnames(dbinfo *db, hash_t fhash, uint o) {
-    int i, xo = DB_X_CT;
-    ulong len = rd_int32(db->fdb, o + xo); /* compressed byte count */
-    ulong zo = o + 4 + xo;
-    ulong off, hash, noff;
-    char *buf = db->fdfl_buf, *fn = NULL;
-    
-    if (xo > 0) for (i=0; i<xo; i++) assert(db->fdb[o + i] == 'X');
-    len = uncompress_buffer(buf, db->buflen, db->fdb + zo, len);
-    off = 0;
-    do {
-        noff = rd_int32(buf, off);
-        hash = rd_hash(buf, off + 4);
-        len = strlen(buf + off + 4 + HB);
-        if (hash == fhash) {
-            fn = alloc(len + 1, 'f');
-            strncpy(fn, buf + off + 4 + HB, len);
-            fn[len] = '\0';
-            v_array_append(db->fnames, fn);
+/* Get the greps in the order to match them in. AND (and NEAR) commute,
+ * so each run of them is ordered by posting count, fewest first, rather
+ * than as given: the fewer docs matched so far, the more posting blocks
+ * the rest can skip. (The first grep starts a run, since it's combined
+ * with nothing.) The grep pipeline still runs them in the given order. */
+static v_array *match_order(dbinfo *db) {
+    v_array *order = v_array_new(4);
+    grep *g, *t;
+    ulong *cts = NULL, c;
+    uint i, j, lo;
+    for (g = db->g; g != NULL; ) {
+        if (g->op != AND && g->op != NEAR) {
+            v_array_append(order, g);
+            g = g->g;
+            continue;
         }
-        off = noff;
-    } while (off != 0);
+        lo = order->len;
+        for (; g != NULL && (g->op == AND || g->op == NEAR); g = g->g)
+            v_array_append(order, g);
+        if (order->len - lo < 2) continue;
+        cts = alloc((order->len - lo) * sizeof(ulong), 'g');
+        for (i = lo; i < order->len; i++) {     /* insertion sort */
+            t = (grep *) order->vs[i];
+            c = grep_postings(db, t);
+            for (j = i; j > lo && cts[j - 1 - lo] > c; j--) {
+                cts[j - lo] = cts[j - 1 - lo];
+                order->vs[j] = order->vs[j - 1];
+            }
+            cts[j - lo] = c;
+            order->vs[j] = t;
+        }
+        dealloc(cts, 'g');
+    }
+    return order;
 }
 
-static void append_hash_files(dbinfo *db, hash_t fhash) {
-    ll_offset *cur;
-    uint buckets, o, b, bo, head; /* bucket number, bucket offset */
-    
-    for (cur=db->fdb_head; cur != NULL; cur=cur->n) {
-        o = cur->o;
-        head = o + 4;
-        buckets = rd_int32(db->fdb, head)/4;
-        b = fhash % buckets;
-        bo = rd_int32(db->fdb, cur->o + 8 + b*4);
-        append_matching_fnames(db, fhash, bo);
+/* Find each grep's doc IDs, and combine them, left to right (after
+ * ordering runs of ANDs by size). Only files already matched can
+ * survive an AND, NEAR, or NOT, so those greps only look for them,
+ * skipping posting blocks that can't hold any. Files tombstoned by a
+ * later set are dropped from each grep. */
+static void gen_matching_file_hashes(dbinfo *db) {
+    grep *g;
+    docset *res = NULL, *filter, *dead = docset_new();
+    v_array *order;
+    uint i, k;
+    assert(db->g);
+    order = match_order(db);
+    for (i = 0; i < db->dead->len; i++) docset_add(dead, db->dead->docs[i]);
+    for (k = 0; k < order->len; k++) {
+        g = (grep *) order->vs[k];
+        filter = (res && g->op != OR) ? res : NULL;
+        for (i = 0; i < h_array_length(g->thashes); i++)
+            append_token_files(db, h_array_get(g->thashes, i), filter,
+                g->results);
+        docset_andnot(g->results, dead);
+        if (db->verbose > 1) dump_grep(g);
+        res = combine_results(g, res);
     }
+    v_array_free(order, NULL);
+    db->results = h_array_new(docset_count(res) + 1);
+    docset_append_to(res, db->results);
+    docset_free(res);
+    docset_free(dead);
+    if (db->verbose > 1)
+        printf("posting blocks: %lu decoded, %lu skipped\n",
+            db->blocks_read, db->blocks_skipped);
 }
 
 static char *get_timestamp_fname(dbinfo *db) {
@@ -581,11 +901,40 @@ static char *get_timestamp_fname(dbinfo *db) {
     return tsfile;
 }
 
+/* Find the set in the filename DB with doc ID DOC, or NULL. */
+static ll_offset *doc_set(dbinfo *db, uint doc) {
+    ll_offset *cur;
+    for (cur=db->fdb_head; cur != NULL; cur=cur->n)
+        if (doc >= cur->first && doc - cur->first < cur->ct) return cur;
+    return NULL;
+}
+
+/* Look up each result's name. Its bucket is found directly from the
+ * doc ID, and since results are sorted, each bucket is only decoded
+ * once. */
 static void gen_matching_filenames(dbinfo *db) {
-    uint i;
+    uint i, doc, b;
+    ulong bo, cur_bo = 0, len;
+    ll_offset *set;
+    char *buf = NULL, *name, *fn;
+    
     db->fnames = v_array_new(2);
-    for (i=0; i<h_array_length(db->results); i++)
-        append_hash_files(db, h_array_get(db->results, i));
+    for (i=0; i<h_array_length(db->results); i++) {
+        doc = h_array_get(db->results, i);
+        if ((set = doc_set(db, doc)) == NULL) bail("fname.db: unknown doc ID, rebuild db\n");
+        b = (doc - set->first) / FNAME_BUCKET_CT;
+        bo = rd_int32(db->fdb, set->o + DB_SET_HEADER_SZ + b*4);
+        if (bo != cur_bo) {
+            buf = read_bucket(db, db->fdb, bo, db->fdfl_buf, &len);
+            cur_bo = bo;
+        }
+        name = buf + rd_int32(buf, ((doc - set->first) % FNAME_BUCKET_CT) * 4);
+        if (*name == '\0') continue;
+        len = strlen(name);
+        fn = alloc(len + 1, 'f');
+        memcpy(fn, name, len + 1);
+        v_array_append(db->fnames, fn);
+    }
 }
 
 /* This should already be defined... */
@@ -612,7 +961,7 @@ static void run_pipeline(dbinfo *db, int file_offset, int file_ct) {
     len = strlen(tsfile);
     strncpy(fnbuf, tsfile, len);
     fo += len;
-    free(tsfile);
+    dealloc(tsfile, 'p');
     
     /* concat all filenames in fnbuf */
     for (i=file_offset; i<file_offset + file_ct; i++) {
@@ -710,6 +1059,20 @@ static int fn_cmp(const void *a, const void *b) {
     return strcmp(fna, fnb);
 }
 
+/* Remove duplicate names from the sorted filename array. A file changed
+ * since the index was built is in both the old and the updated set. */
+static void uniq_fnames(v_array *a) {
+    uint i, o = 0;
+    for (i=0; i<a->len; i++) {
+        if (o > 0 && strcmp(a->vs[i], a->vs[o - 1]) == 0) {
+            dealloc(a->vs[i], 'f');
+        } else {
+            a->vs[o++] = a->vs[i];
+        }
+    }
+    a->len = o;
+}
+
 static void lookup_query(dbinfo *db) {
     int i, fnct, rem;
     char *fn;
@@ -718,13 +1081,11 @@ static void lookup_query(dbinfo *db) {
     if (db->tokens_only) return;
 
     gen_matching_file_hashes(db);
-    if (db->verbose > 1) dump_grep(db->g);
     
-    filter_results(db);
     if (db->verbose) {
-        printf("\nfile hashes --");
+        printf("\ndoc IDs --");
         for (i=0; i<h_array_length(db->results); i++) {
-            printf(" %04x", h_array_get(db->results, i));
+            printf(" %u", h_array_get(db->results, i));
         }
         puts("");
     }
@@ -732,6 +1093,7 @@ static void lookup_query(dbinfo *db) {
 
     /* TODO: Could sort filenames by size, date, ... here, istead. */
     v_array_sort(db->fnames, fn_cmp);
+    uniq_fnames(db->fnames);
     
     if (db->verbose) {
         for (i=0; i<v_array_length(db->fnames); i++) {
@@ -762,11 +1124,21 @@ typedef enum MODE {
     MODE_HASH,
 } MODE;
 
+static void print_mem_report() { alloc_report(stderr); }
+
+static struct option long_opts[] = {
+    { "mem-report", no_argument, NULL, 'M' },
+    { NULL, 0, NULL, 0 },
+};
+
 static MODE handle_args(dbinfo *db, int *argc, char **argv[]) {
     int fl;
     MODE mode = MODE_GLEAN;
-    while ((fl = getopt(*argc, *argv, "hDHvd:nNgst")) != -1) {
+    while ((fl = getopt_long(*argc, *argv, "hDHvd:nNgpst", long_opts, NULL)) != -1) {
         switch (fl) {
+        case 'M':       /* print memory use by tag on exit */
+            atexit(print_mem_report);
+            break;
         case 'h':       /* help */
             usage();
             break;
@@ -789,6 +1161,9 @@ static MODE handle_args(dbinfo *db, int *argc, char **argv[]) {
         case 'N':       /* no names */
             db->grepnames = 0;
             break;
+        case 'p':       /* token patterns are globs, e.g. "config*" */
+            db->glob = 1;
+            break;
         case 's':       /* "subtoken": don't wrap token pattern in ^$ */
             db->subtoken = 1;
             break;
@@ -826,10 +1201,10 @@ int main(int argc, char *argv[]) {
         return hash_loop(buf);
     }
     
-    init_zlib();
     open_dbs(db);
     read_settings(db);
     check_db_headers(db);
+    read_tombstones(db);
     
     if (mode == MODE_DUMP) {
         dump_db(db, db->fdb, db->fdb_head, dump_fname_bucket);
@@ -839,6 +1214,5 @@ int main(int argc, char *argv[]) {
     }
     free_dbinfo(db);
     free_nextline_buffer();
-    free_zlib();
     return 0;
 }
@@ -3,6 +3,10 @@
 
 typedef struct ll_offset {
     ulong o;
+    uint set;                 /* set number, counting from the oldest */
+    uint first;               /* first doc ID */
+    uint ct;                  /* doc ID count */
+    ulong terms;              /* term dictionary offset, or 0 */
     struct ll_offset *n;
 } ll_offset;
 
@@ -19,7 +23,7 @@ typedef struct grep {
     char *pattern;
     struct v_array *tokens;   /* result filenames */
     struct h_array *thashes;  /* hashes for matching tokens from $GLN_DIR/tokens */
-    struct h_array *results;  /* file hashes */
+    struct docset *results;   /* doc IDs */
     struct grep *g;           /* another grep to pipe this to */
 } grep;
 
@@ -30,21 +34,32 @@ typedef struct dbinfo {
     char *fdb;                /* mmap'd filename db */
     ll_offset *fdb_head;
     char *tdb;                /* mmap'd token db */
+    ulong tdblen;
     ll_offset *tdb_head;
     char *tdfl_buf;           /* deflate buffer */
     char *fdfl_buf;           /* deflate buffer */
     uint buflen;
+    char *fdict;              /* filename db's preset dictionary */
+    uint fdictlen;
+    char *tdict;              /* token db's preset dictionary */
+    uint tdictlen;
+    struct z_stream_s *zs;    /* inflate state, once needed */
+    hash_t *postings;         /* decoded doc IDs */
+    uint postings_sz;
+    ulong blocks_read;        /* posting blocks decoded */
+    ulong blocks_skipped;     /* ... and skipped */
+    struct tombstones *dead;  /* stale postings, from updates */
     
     struct grep *g;           /* query */
-    struct h_array *results;  /* overall file hashes */
+    struct h_array *results;  /* overall doc IDs */
     struct v_array *fnames;   /* result filenames */
     /* settings, should be read from $GLN_DIR/settings */
     int verbose;
     int greponly;             /* 1=just print grep command line */
     int grepnames;            /* 0=no names, 1=show names, 2=names only */
     int subtoken;             /* 0=search tokens for ^%s$, 1=allow subtoken query */
+    int glob;                 /* token patterns are shell-style globs */
     int tokens_only;          /* print matching tokens and exit */
-    int compressed;           /* is the tokens file compressed? */
     int case_sensitive;
 } dbinfo;
 
@@ -5,6 +5,7 @@
 #include <unistd.h>
 #include <stdint.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <sys/wait.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
@@ -21,14 +22,23 @@
 #include "gln_index.h"
 #include "db.h"
 #include "stopword.h"
+#include "rules.h"
 #include "filter.h"
 #include "nextline.h"
 #include "worker.h"
+#include "tpool.h"
+#include "forward.h"
+#include "compact.h"
+#include "spill.h"
+#include "arena.h"
 
 static void usage() {
     fprintf(stderr,
-        "usage: gln_index [-hVvpcs] [-d DB_DIR] [-r INDEX_ROOT] \n"
-        "                 [-f FILTER_CONFIG_FILE] [-w WORKER_CT]\n"
+        "usage: gln_index [-hVvpcCstu] [-d DB_DIR] [-r INDEX_ROOT] \n"
+        "                 [-f FILTER_CONFIG_FILE] [-w WORKER_CT] [-q QUEUE_DEPTH]\n"
+        "                 [-l SMALL_FILE_WORKER_CT] [-m SPILL_MB] [-z lz|zlib]\n"
+        "                 [--fsync] [--mem-report]\n"
+        "       gln_index --compact[=all] [-v] [-d DB_DIR]\n"
         "    See gln_filter(1) for more information.\n");
     exit(1);
 }
@@ -57,13 +67,13 @@ static char *get_gln_path(context *c, const char *fname) {
     return path;
 }
 
-static FILE *open_gln_log(context *c, const char *fname) {
+static FILE *open_gln_log(context *c, const char *fname, const char *mode) {
     FILE *log;
     char *path = get_gln_path(c, fname);
     if (DEBUG) fprintf(stderr, "opening file %s\n", path);
-    log = fopen(path, "w");
+    log = fopen(path, mode);
     if (log == NULL) err(1, "failed to open log file");
-    free(path);
+    dealloc(path, 'p');
     return log;
 }
 
@@ -81,7 +91,7 @@ static int open_db(char *path, char *file, int update) {
     fd = open(fn, O_RDWR | (update ? 0 : O_TRUNC) | O_CREAT /* sic */, 0744);
     if (DEBUG) fprintf(stderr, "opening %s, got fd %d\n", fn, fd);
     if (fd == -1) err(1, "%s", fn);
-    free(fn);
+    dealloc(fn, 'f');
     return fd;
 }
 
@@ -91,35 +101,90 @@ static context *init_context() {
     c->root = NULL;
     
     c->word_set = word_set_init(0);
+    c->arenas = v_array_new(4);
+    v_array_append(c->arenas, arena_new(0));
+    set_use_arena(c->word_set, v_array_get(c->arenas, 0));
     c->fn_set = fname_new_set(0);
     c->verbose = c->show_progress = c->use_stop_words = 0;
     c->case_sensitive = 0;
     c->index_dotfiles = 0;
     c->update = 0;
-    c->compressed = 0;
+    c->compact = c->compact_all = 0;
+    c->since = c->since_nsec = 0;
+    c->set_id = c->doc_base = c->doc_ct = 0;
+    c->docs = NULL;
+    c->live = c->live_docs = c->seen = NULL;
+    c->codec = 0;
+    c->threaded = 0;
+    c->fsync = 0;
+    c->ws = NULL;
+    c->epfd = -1;
     c->t_ct = c->t_occ_ct = 0;
-    c->f_ni = c->tick = c->tick_max = 0;
+    c->f_ni = c->f_tail = c->tick = c->tick_max = 0;
+    c->small_ct = 0;
+    c->spill_limit = c->posting_ct = 0;
+    c->spill = NULL;
     c->fnames = v_array_new(16);
     c->w_ct = DEF_WORKER_CT;
+    c->q_depth = DEF_QUEUE_DEPTH;
     c->w_offset = 0;
     return c;
 }
 
-static const char *find_cmd_fmt = "find %s -type f";
-
 static int fsize(int fd) {
     struct stat sb;
     if (fstat(fd, &sb) == -1) err(1, "fstat");
     return sb.st_size;
 }
 
+/* When updating, only files changed since the last index's timestamp
+ * are indexed, with the same settings. If there's no complete index
+ * to update, fall back on building one from scratch. */
+static void init_update(context *c) {
+    char *path, *buf;
+    char *files[] = { ".gln/fname.db", ".gln/token.db", ".gln/timestamp" };
+    struct stat sb;
+    FILE *settings;
+    size_t len;
+    int i;
+    
+    for (i=0; i<3; i++) {
+        path = get_gln_path(c, files[i]);
+        if (stat(path, &sb) == -1 || (i < 2 && sb.st_size == 0)) {
+            if (c->verbose) fprintf(stderr, "-- No index to update, rebuilding\n");
+            c->update = 0;
+            dealloc(path, 'p');
+            return;
+        }
+        dealloc(path, 'p');
+    }
+    c->since = sb.st_mtime;             /* timestamp's */
+    c->since_nsec = MTIME_NSEC(&sb);
+    
+    path = get_gln_path(c, ".gln/settings");
+    if ((settings = fopen(path, "r")) == NULL) err(1, "%s", path);
+#define OPT(x) (strncmp(buf, x, strlen(x)) == 0)
+    while ((buf = nextline(settings, &len)) != NULL) {
+        if (OPT("case_sensitive")) {
+            c->case_sensitive = buf[len-2] == '1';
+        } else if (OPT("codec ") && c->codec == 0) {
+            c->codec = OPT("codec lz") ? CODEC_LZ : CODEC_ZLIB;
+        } else if (OPT("root ") && c->root == NULL) {
+            buf[len-1] = '\0';
+            c->root = strdup(buf + strlen("root "));
+        }
+    }
+#undef OPT
+    if (fclose(settings) != 0) err(1, "%s", path);
+    dealloc(path, 'p');
+}
+
 static void init_files(context *c) {
-    FILE *finder;
-    int tstamp, gln_path_len = strlen(c->wkdir) + strlen("/.gln/") + 1;
+    struct timeval tv;
+    char *log_mode;
+    int gln_path_len = strlen(c->wkdir) + strlen("/.gln/") + 1;
     char *gln_path = alloc(gln_path_len, 'p');
-    char *find_cmd = NULL;
     char *cwd = NULL;
-    int find_cmd_len;
     
     if (gln_path_len <= snprintf(gln_path, gln_path_len,
             "%s/.gln/", c->wkdir)) {
@@ -131,6 +196,9 @@ static void init_files(context *c) {
         errno = 0;
     }
     
+    if (c->update) init_update(c);
+    if (c->codec == 0) c->codec = DEF_CODEC;
+    
     if (c->root == NULL) {
         c->root = getcwd(NULL, MAXPATHLEN);
     } else {
@@ -139,36 +207,43 @@ static void init_files(context *c) {
         c->root = getcwd(NULL, MAXPATHLEN);
     }
     
-    find_cmd_len = strlen(find_cmd_fmt) - 1 + strlen(c->root);
-    find_cmd = alloc(find_cmd_len, 'C');
-    if (find_cmd_len <= snprintf(find_cmd, find_cmd_len,
-            find_cmd_fmt, c->root)) {
-        fprintf(stderr, "snprintf error\n");
-        exit(EXIT_FAILURE);
-    }
-    if ((finder = popen(find_cmd, "r")) == NULL) err(1, "finder fail");
-    c->find = finder;
     if (cwd) {
         if (chdir(cwd) == -1) err(1, "chdir-ing back");
         free(cwd);
     }
     
-    c->filter_fd = filter_open_coprocess(&c->filter_pid);
-    c->tlog = open_gln_log(c, ".gln/tokens");
-    c->settings = open_gln_log(c, ".gln/settings");
-    c->swlog = open_gln_log(c, ".gln/stopwords");
+    filter_init(c);
+    log_mode = c->update ? "a" : "w";
+    c->settings = open_gln_log(c, ".gln/settings", "w");
+    c->swlog = open_gln_log(c, ".gln/stopwords", log_mode);
     
     c->fdb_fd = open_db(c->wkdir, ".gln/fname.db", c->update);
     c->tdb_fd = open_db(c->wkdir, ".gln/token.db", c->update);
     if (fsize(c->fdb_fd) == 0) db_init_files(c);
     
-    tstamp = open_db(c->wkdir, ".gln/timestamp", 0);
-    if (close(tstamp) == -1) err(1, "Couldn't write timestamp file");
+    if (gettimeofday(&tv, NULL) != 0) err(1, "gettimeofday");
+    c->stampsec = tv.tv_sec;
+    c->stampusec = tv.tv_usec;
+}
+
+/* Set the timestamp file's mtime to when enumeration started, so
+ * the next update (-u) picks up any file changed since. Only done once
+ * the DBs are written, so a failed update is retried in full. */
+static void write_timestamp(context *c) {
+    char *path = get_gln_path(c, ".gln/timestamp");
+    struct timeval tvs[2];
+    int fd = open(path, O_WRONLY | O_CREAT, 0644);
+    if (fd == -1 || close(fd) == -1) err(1, "Couldn't write timestamp file");
+    tvs[0].tv_sec = tvs[1].tv_sec = c->stampsec;
+    tvs[0].tv_usec = tvs[1].tv_usec = c->stampusec;
+    if (utimes(path, tvs) == -1) err(1, "%s", path);
+    dealloc(path, 'p');
 }
 
 static void save_settings(context *c) {
     fprintf(c->settings, "case_sensitive %d\n", c->case_sensitive);
-    fprintf(c->settings, "compressed %d\n", c->compressed);
+    fprintf(c->settings, "codec %s\n", c->codec == CODEC_LZ ? "lz" : "zlib");
+    fprintf(c->settings, "root %s\n", c->root);
     /* other options go here later */
 }
 
@@ -176,44 +251,35 @@ static void free_context(context *c) {
     int i;
     worker *w;
     set_free(c->word_set, word_free);
+    v_array_free(c->arenas, (v_array_free_cb *) arena_free);
     set_free(c->fn_set, fname_free_cb);
-    for (i=0; i<c->w_ct; i++) {
-        w = &(c->ws[i]);
-        free(w->buf);
+    if (c->spill) spill_free(c->spill);
+    if (c->live) h_array_free(c->live);
+    if (c->live_docs) h_array_free(c->live_docs);
+    if (c->seen) h_array_free(c->seen);
+    if (c->ws) {
+        for (i=0; i<c->w_ct; i++) {
+            w = &(c->ws[i]);
+            dealloc(w->buf, 'b');
+            dealloc(w->out, 'b');
+            dealloc(w->q, 'q');
+        }
+        dealloc(c->ws, 'q');
     }
+    if (c->epfd != -1 && close(c->epfd) == -1) err(1, "close");
     
-    free(c->ws);
-    
-    if (fclose(c->tlog) != 0 || fclose(c->swlog) != 0 || fclose(c->settings) != 0)
+    if (fclose(c->swlog) != 0 || fclose(c->settings) != 0)
         err(1, "fclose failed");
     if ((close(c->fdb_fd) == -1) || (close(c->tdb_fd) == -1))
         err(1, "close");
 }
 
-/* Execute `sort FILE | gzip > FILE.gz && rm FILE`. */
-static int gzip_tokens_file(context *c) {
-    char *tf = get_gln_path(c, ".gln/tokens");
-    int res, len = strlen(tf);
-    char *fmt = "sort \"%s\" | gzip > \"%s.gz\" && rm \"%s\"";
-    int buf_sz = 3*len + strlen(fmt) + 1;
-    char *buf = alloc(buf_sz, 'b');
-    if (buf_sz <= snprintf(buf, buf_sz,
-            fmt, tf, tf, tf)) {
-        fprintf(stderr, "snprintf error\n");
-        exit(EXIT_FAILURE);
-    }
-    res = system(buf);
-    free(tf);
-    free(buf);
-    return res;
-}
-
 static int finish(context *c) {
     int i, res;
     /* These should be written to .gln_new/totals */
     
     /* cull child processes */
-    for (i=0; i<c->w_ct; i++) {
+    for (i=0; c->ws && i<c->w_ct; i++) {
         write(c->ws[i].s, " DONE\n", 6);
         if (DEBUG) puts(" -- Sending child DONE");
     }
@@ -225,24 +291,77 @@ static int finish(context *c) {
             exit(EXIT_FAILURE);
         }
     }
-    if (c->show_progress) fprintf(stderr, "-- Writing databases\n");
-    res = db_write(c);
+    if (c->spill) {
+        if (c->show_progress) fprintf(stderr, "-- Merging spilled postings\n");
+        spill_merge(c->spill, c->word_set);
+        if (c->verbose) fprintf(stderr, "-- Merged %u spilled runs\n",
+            spill_run_count(c->spill));
+    }
+    if (c->update && v_array_length(c->fnames) == 0) {
+        if (c->verbose) fprintf(stderr, "-- No changed files\n");
+        res = 0;
+    } else {
+        if (c->show_progress) fprintf(stderr, "-- Writing databases\n");
+        res = db_write(c);
+    }
     
     if (c->verbose)
-        fprintf(stderr, "%lu tokens, %u files\n", c->t_ct, c->f_ni);
+        fprintf(stderr, "%lu tokens, %u files\n", c->t_ct,
+            v_array_length(c->fnames));
     
-    if (res == 0 && c->compressed) res = gzip_tokens_file(c);
+    if (res == 0) forward_write(c);
+    if (res == 0) write_timestamp(c);
     
     free_context(c);
-    free(c);
+    dealloc(c, 'c');
     free_nextline_buffer();
     return res;               /* for now */
 }
 
+static void print_mem_report() { alloc_report(stderr); }
+
+static struct option long_opts[] = {
+    { "compact", optional_argument, NULL, 'K' },
+    { "mem-report", no_argument, NULL, 'M' },
+    { "fsync", no_argument, NULL, 'F' },
+    { NULL, 0, NULL, 0 },
+};
+
+/* Spill postings to temporary files next to the DBs. */
+static spill *spill_new_in(context *c) {
+    char *dir = get_gln_path(c, ".gln");
+    spill *sp = spill_new(dir);
+    dealloc(dir, 'p');
+    return sp;
+}
+
+/* Merge the index's sets, rather than indexing. */
+static int compact(context *c) {
+    int res;
+    if (!c->update) errx(1, "no index to compact");
+    res = compact_index(c);
+    free_context(c);
+    dealloc(c, 'c');
+    free_nextline_buffer();
+    return res;
+}
+
 static void handle_args(context *c, int *argc, char **argv[]) {
     int f, iarg;
-    while ((f = getopt(*argc, *argv, "hVvpcCud:r:w:f:s")) != -1) {
+    while ((f = getopt_long(*argc, *argv, "hVvpcCud:r:w:q:l:m:f:stz:",
+                long_opts, NULL)) != -1) {
         switch (f) {
+        case 'K':       /* merge sets: --compact[=all] */
+            if (optarg && strcmp(optarg, "all") != 0) usage();
+            c->compact = c->update = 1;
+            c->compact_all = optarg != NULL;
+            break;
+        case 'F':       /* fsync the DBs once written */
+            c->fsync = 1;
+            break;
+        case 'M':       /* print memory use by tag on exit */
+            atexit(print_mem_report);
+            break;
         case 'h':       /* help */
             usage();
             break;
@@ -252,19 +371,26 @@ static void handle_args(context *c, int *argc, char **argv[]) {
                 setenv("GLN_FILTER_DEBUG", "1", 1) == -1)
                 err(1, "setenv");
             break;
-#if NYI
         case 'u':       /* update existing db */
             c->update = 1;
             break;
-#endif
         case 'p':       /* show progress */
             c->show_progress = 1;
             break;
         case 'c':       /* case-sensitive */
             c->case_sensitive = 1;
             break;
-        case 'C':       /* compress tokens file */
-            c->compressed = 1;
+        case 'C':       /* compress tokens file: always, now */
+            break;
+        case 'z':       /* DB bucket codec */
+            if (strcmp(optarg, "lz") == 0) {
+                c->codec = CODEC_LZ;
+            } else if (strcmp(optarg, "zlib") == 0) {
+                c->codec = CODEC_ZLIB;
+            } else {
+                fprintf(stderr, "Unknown codec: %s (use lz or zlib)\n", optarg);
+                exit(1);
+            }
             break;
         case 'd':       /* DB dir */
             c->wkdir = (strcmp(optarg, ".") == 0 ? 
@@ -282,6 +408,31 @@ static void handle_args(context *c, int *argc, char **argv[]) {
             }
             c->w_ct = iarg;
             break;
+        case 'q':       /* files in flight per worker */
+            iarg = atoi(optarg);
+            if (iarg < 1 || iarg > MAX_QUEUE_DEPTH) {
+                fprintf(stderr, "Invalid queue depth: %d\n", iarg);
+                exit(1);
+            }
+            c->q_depth = iarg;
+            break;
+        case 'l':       /* small-file lane */
+            iarg = atoi(optarg);
+            if (iarg < 0 || iarg > MAX_WORKER_CT) {
+                fprintf(stderr, "Invalid small file worker count: %d\n", iarg);
+                exit(1);
+            }
+            c->small_ct = iarg;
+            break;
+        case 'm':       /* spill postings to disk past SPILL_MB */
+            iarg = atoi(optarg);
+            if (iarg < 1) {
+                fprintf(stderr, "Invalid spill budget: %d\n", iarg);
+                exit(1);
+            }
+            /* Postings are HB bytes each, in arrays up to half empty. */
+            c->spill_limit = (ulong) iarg * 1024 * 1024 / (2 * HASH_BYTES);
+            break;
         case 'f':       /* set filtering config. file */
             if ((setenv("GLN_FILTER_FILE", optarg, 1)) == -1)
                 err(1, "setenv");
@@ -289,6 +440,9 @@ static void handle_args(context *c, int *argc, char **argv[]) {
         case 's':       /* ID and filter stop words */
             c->use_stop_words = 1;
             break;
+        case 't':       /* tokenize in-process, with threads */
+            c->threaded = 1;
+            break;
         case 'V':
             version();
             /* NOTREACHED */
@@ -297,60 +451,56 @@ static void handle_args(context *c, int *argc, char **argv[]) {
             /* NOTREACHED */
         }
     }
+    if (c->small_ct >= c->w_ct) {
+        fprintf(stderr, "Small file worker count must be less than %d\n",
+            c->w_ct);
+        exit(1);
+    }
     *argc -= optind;
     *argv += optind;
 }
 
 int main(int argc, char *argv[]) {
     context *c = init_context();
-    fd_set *fdsr = NULL;
     struct timeval tv;
-    int i, action=0;
-    uint fnlen;
+    int i;
     
     handle_args(c, &argc, &argv);
     init_files(c);
     save_settings(c);
+    if (c->compact) return compact(c);
+    if (c->update) forward_load(c);
+    if (c->spill_limit) c->spill = spill_new_in(c);
     
     if (filter_enqueue_files(c) < 0) exit(EXIT_FAILURE);
-    if (worker_init_all(c) < 0) exit(EXIT_FAILURE);
-    
-    fnlen = v_array_length(c->fnames);
-    
-    fdsr = (fd_set *) alloc(sizeof(fd_set), 's');
     
     if (gettimeofday(&tv, NULL) != 0) err(1, "gettimeofday");
     c->startsec = tv.tv_sec;
-    tv.tv_sec = 0;
-    tv.tv_usec = 10 * 1000;
     
+    if (c->threaded) {
+        if (tpool_tokenize_all(c) < 0) exit(EXIT_FAILURE);
+        return finish(c);
+    }
+    
+    if (worker_init_all(c) < 0) exit(EXIT_FAILURE);
+    
+    /* Fill every worker's queue, then block until one has output.
+     * A worker that finishes a file has its queue topped up as soon as
+     * its results are read (in worker_check), so there's no polling delay. */
     for (;;) {
-        assert(tv.tv_sec == 0);
         assert(c->w_busy + c->w_avail == c->w_ct);
-        if (c->w_avail > 0) action = worker_schedule(c);
-        if (action < 0) {
-            fprintf(stderr, "Error while scheduling worker process\n");
-            exit(EXIT_FAILURE);
-        }
-        if (c->w_busy > 0) action = worker_check(c, fdsr) || action;
+        if (c->f_ni < c->f_tail) worker_schedule(c);
         
-        if (action) {
-            action = 0;
-        } else if (c->f_ni == fnlen && c->w_busy == 0) {
-            free(fdsr);
+        if (c->w_busy == 0) {
+            assert(c->f_ni == c->f_tail);
             return finish(c);
-        } else {
-            select(0, NULL, NULL, NULL, &tv); /* don't busyloop */
-            if (DEBUG) {
-                fprintf(stderr, "pipe done... w_avail: %d, w_ct: %d\n",
-                    c->w_avail, c->w_ct);
-            }
         }
+        worker_check(c);
         
         if (DEBUG) {
             printf("-- Working:");
             for (i=0; i<c->w_ct; i++)
-                if (c->ws[i].fname != NULL) printf(" %d", i);
+                if (c->ws[i].q_ct > 0) printf(" %d", i);
             printf(" - idle: %d\n", c->w_avail);
         }
     }
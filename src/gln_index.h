@@ -1,14 +1,39 @@
 #ifndef GLN_INDEX_H
 #define GLN_INDEX_H
 
+/* The nanoseconds of a stat's modification time, past its st_mtime
+ * seconds. The field is st_mtimespec on macOS; where it's unknown, this
+ * is 0, so times are compared in whole seconds. */
+#if defined(__APPLE__)
+#define MTIME_NSEC(sb) ((sb)->st_mtimespec.tv_nsec)
+#elif defined(__linux__) || defined(__FreeBSD__) || defined(__NetBSD__) \
+    || defined(__OpenBSD__)
+#define MTIME_NSEC(sb) ((sb)->st_mtim.tv_nsec)
+#else
+#define MTIME_NSEC(sb) 0L
+#endif
+
+/* Worker read buffer size; must be larger than PROTO_MAX_FRAME_SZ. */
 #define BUF_SZ 4096
 
+/* A file sent to a worker, but not yet finished. */
+typedef struct inflight {
+    struct fname *fname;
+    int stolen;             /* given to another worker; ignore results */
+} inflight;
+
 /* Information specific to a tokenizer worker process. */
 typedef struct worker {
     int s;                  /* socket fd */
-    struct fname *fname;    /* current file name, if any */
+    inflight *q;            /* ring of q_depth files in flight */
+    uint q_head;            /* current file's index in q */
+    uint q_ct;              /* number of files in flight */
+    uint doc;               /* current file's doc ID */
     int off;                /* read offset */
     char *buf;              /* read buffer */
+    char *out;              /* output the socket hasn't taken yet */
+    uint out_len;           /* bytes in out */
+    uint out_sz;            /* out allocated */
 } worker;
 
 /* Overall indexing context. */
@@ -18,25 +43,30 @@ typedef struct context {
     int w_avail;            /* available workers */
     int w_busy;             /* busy workers */
     int w_offset;           /* round-robin scheduling offset */
+    uint q_depth;           /* max files in flight per worker */
     worker *ws;             /* workers */
     
     /* paths and files */
     char *wkdir;            /* + "/.gln/": where DB files are stored */
     char *root;             /* root path of indexed files */
-    FILE *tlog;             /* token log */
     FILE *swlog;            /* stop word log */
     FILE *settings;         /* index settings */
     int fdb_fd;             /* filename DB descriptor */
     int tdb_fd;             /* token DB descriptor */
-    FILE *find;             /* pipe to find */
-    int filter_fd;          /* fd for gln_filter coprocess */
-    int filter_pid;         /* pid for same */
+    struct rules *rules;    /* compiled filter rules */
     int max_tid;            /* max known token ID */
     int max_w_socket;       /* max worker socket file ID */
+    int epfd;               /* epoll fd for worker sockets (Linux only) */
     set *fn_set;            /* filename set */
     set *word_set;          /* known words set */
+    struct v_array *arenas; /* word_set's words & links, kept to the end */
     struct v_array *fnames; /* filename array */
-    uint f_ni;               /* current filename index */
+    uint f_ni;              /* next filename index (from the front) */
+    uint f_tail;            /* end of unscheduled filenames */
+    int small_ct;           /* workers taking the smallest files first */
+    ulong spill_limit;      /* spill postings past this many, or 0 */
+    ulong posting_ct;       /* postings held in memory */
+    struct spill *spill;    /* spilled postings */
     
     /* other settings */
     int verbose;            /* verbosity */
@@ -45,8 +75,24 @@ typedef struct context {
     int show_progress;      /* show progress? */
     int index_dotfiles;     /* should .dotfiles be indexed? */
     int update;             /* update existing DBs? */
-    int compressed;         /* compress token list file? */
+    int compact;            /* just merge the DBs' sets? */
+    int compact_all;        /* ... all of them, rather than tiered? */
+    char codec;             /* DB bucket codec (db.h's CODEC_*) */
+    int threaded;           /* tokenize in-process, with threads? */
+    int fsync;              /* fsync the DBs before linking in new sets? */
     long startsec;          /* starting time */
+    long stampsec;          /* time enumeration started, for timestamp */
+    long stampusec;
+    long since;             /* when updating: last index's timestamp */
+    long since_nsec;
+    uint set_id;            /* number of the set being written */
+    uint doc_base;          /* its first doc ID */
+    uint doc_ct;            /* doc IDs assigned to its files */
+    struct fname **docs;    /* fn_set by doc ID, while writing the DBs */
+    struct h_array *live;   /* when updating: name hashes of files indexed
+                             * by earlier sets, */
+    struct h_array *live_docs;  /* ... their doc IDs, */
+    struct h_array *seen;   /* ... and name hashes of files found unchanged */
     uint tick;              /* progress tick */
     uint tick_max;          /* this many ticks -> progress */
     ulong t_ct;             /* token count */
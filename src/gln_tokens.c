@@ -5,53 +5,143 @@
 #include <unistd.h>
 #include <stdint.h>
 #include <err.h>
+#include <errno.h>
 #include <poll.h>
+#include <sys/param.h>
 
 #include "glean.h"
 #include "set.h"
 #include "word.h"
 #include "tokenize.h"
+#include "proto.h"
 
-#define BUF_SZ 4096
+#define BUF_SZ (2 * PATH_MAX)
 #define TIMEOUT 60              /* just die after 1 minute idle */
 #define FLUSH_COUNT 100         /* clear set & shrink every N files */
 
+/* gln_index may send several filenames before the first is finished.
+ * They are read into a queue as they arrive, so that a later
+ * " CANCEL $filename" line (sent when another worker has taken over the
+ * file) can drop one before it's started. Cancelled files are still
+ * reported, as skipped, so results stay in the order sent. */
+typedef struct queue {
+    char *names[MAX_QUEUE_DEPTH];
+    int cancelled[MAX_QUEUE_DEPTH];
+    uint head;
+    uint ct;
+} queue;
+
+static void enqueue(queue *q, char *line) {
+    uint i = (q->head + q->ct) % MAX_QUEUE_DEPTH;
+    size_t len = strlen(line);
+    if (q->ct == MAX_QUEUE_DEPTH) errx(1, "too many queued files");
+    q->names[i] = alloc(len + 1, 'n');
+    memcpy(q->names[i], line, len + 1);
+    q->cancelled[i] = 0;
+    q->ct++;
+}
+
+static void cancel(queue *q, char *name) {
+    uint i, j;
+    for (j=0; j<q->ct; j++) {
+        i = (q->head + j) % MAX_QUEUE_DEPTH;
+        if (!q->cancelled[i] && strcmp(q->names[i], name) == 0) {
+            q->cancelled[i] = 1;
+            return;
+        }
+    }
+    /* Not found: already finished, so gln_index discards the results. */
+}
+
+/* Handle one line of input. Returns 1 on " DONE". */
+static int handle_line(queue *q, char *line) {
+    if (DEBUG) fprintf(stderr, "-- %d: Got line %s...\n", getpid(), line);
+    if (strcmp(line, " DONE") == 0) return 1;
+    if (strncmp(line, " CANCEL ", 8) == 0) {
+        cancel(q, line + 8);
+    } else {
+        enqueue(q, line);
+    }
+    return 0;
+}
+
+/* Read whatever input is available, and handle each complete line.
+ * Returns 1 on " DONE" or EOF. */
+static int read_input(queue *q, char *buf, size_t *off) {
+    ssize_t sz = read(STDIN_FILENO, buf + *off, BUF_SZ - *off - 1);
+    size_t i, last = 0, len;
+    int done = 0;
+    if (sz == -1) {
+        if (errno == EINTR || errno == EAGAIN) return 0;
+        err(1, "read");
+    } else if (sz == 0) {
+        return 1;
+    }
+    len = *off + sz;
+    for (i=*off; i<len; i++) {
+        if (buf[i] == '\n') {
+            buf[i] = '\0';
+            done |= handle_line(q, buf + last);
+            last = i + 1;
+        }
+    }
+    *off = len - last;
+    if (*off == BUF_SZ - 1) errx(1, "line too long");
+    memmove(buf, buf + last, *off);
+    return done;
+}
+
 /* Read in filenames from stdin and tokenize them. If given " DONE", quit. */
 int main(int argc, char *argv[]) {
     set *wt = word_set_init(0);
     char buf[BUF_SZ];
-    int pid = getpid();
-    int case_sensitive = (argc == 2 && strcmp(argv[1], "-c") == 0);
+    size_t off = 0;
+    int i, case_sensitive = 0, text = 0;
     struct pollfd fds[1];
-    int res = 0, files = 0;
-    
+    int res = 0, files = 0, done = 0;
+    queue q;
+    char *name;
+
+    for (i=1; i<argc; i++) {
+        if (strcmp(argv[i], "-c") == 0) case_sensitive = 1;
+        else if (strcmp(argv[i], "-t") == 0) text = 1;
+    }
+
+    memset(&q, 0, sizeof(q));
     fds[0].fd = STDIN_FILENO;
     fds[0].events = POLLIN;
-    
+
     for (;;) {
-        res = poll(fds, 1, TIMEOUT * 1000);
-        if (res == -1) err(1, "poll");
-        else if (res == 0) exit(1); /* timeout, gln_index probably died */
-        else assert(fds[0].revents & POLLIN);
-        
-        if (fgets(buf, BUF_SZ, stdin) != NULL) {
-            buf[strcspn(buf, "\n")] = '\0';
-            if (strcmp(buf, " DONE") == 0) break;
-            if (DEBUG) fprintf(stderr, "-- %d: Got filename %s...\n",
-                pid, buf);
-            tokenize_file(buf, wt, case_sensitive);
-            fflush(stdout);
-            
-            if (++files >= FLUSH_COUNT) {
-                set_free(wt, word_free);
-                wt = word_set_init(0);
-                if (0) fprintf(stderr, "flush: %d, %d\n", getpid(), files);
-                files = 0;
-            }
-            
-            if (DEBUG) fprintf(stderr, "done\n");
-            if (DEBUG) fprintf(stderr, "-- Finished filename %s\n", buf);
-        } else break;
+        if (!done) {
+            /* Block only if there's nothing queued. */
+            res = poll(fds, 1, q.ct == 0 ? TIMEOUT * 1000 : 0);
+            if (res == -1 && errno != EINTR) err(1, "poll");
+            else if (res == 0 && q.ct == 0) exit(1); /* timeout, gln_index probably died */
+            else if (res > 0) done = read_input(&q, buf, &off);
+        }
+        if (q.ct == 0) {
+            if (done) break;
+            continue;
+        }
+
+        name = q.names[q.head];
+        if (q.cancelled[q.head]) {
+            if (DEBUG) fprintf(stderr, "-- Cancelled filename %s\n", name);
+            if (text) printf(" SKIP\n"); else proto_put_end(stdout, 1);
+        } else {
+            tokenize_file(name, wt, case_sensitive, text);
+        }
+        fflush(stdout);
+        dealloc(name, 'n');
+        q.head = (q.head + 1) % MAX_QUEUE_DEPTH;
+        q.ct--;
+
+        if (++files >= FLUSH_COUNT) {
+            set_free(wt, word_free);
+            wt = word_set_init(0);
+            if (0) fprintf(stderr, "flush: %d, %d\n", getpid(), files);
+            files = 0;
+        }
     }
     if (DEBUG_HASH) set_stats(wt, 0);
     set_free(wt, word_free);
@@ -0,0 +1,183 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+
+#include "glean.h"
+#include "lz.h"
+
+/* The compressed data is a series of sequences, each of:
+ *   [token/1]: literal count (high 4 bits), match length - 4 (low 4)
+ *   [more literal count/1*N]: if 15, add bytes until one isn't 255
+ *   [literals]
+ *   [match offset/2], little-endian, back from the current position
+ *   [more match length/1*N], as for the literal count
+ * The last sequence is only literals, and ends the input.
+ *
+ * Matches are found greedily, through a hash table of the last
+ * position each 4-byte sequence was seen at. With a dictionary, a
+ * second (prebuilt) table is checked when the input's own has no
+ * match, and offsets past the start of the output reach back into
+ * the end of the dictionary. */
+
+#define MIN_MATCH 4
+#define MAX_OFFSET 65535
+#define HASH_LOG 12
+#define NO_POS UINT32_MAX
+
+struct lz_dict {
+    const unsigned char *buf;
+    size_t len;
+    uint32_t table[1 << HASH_LOG];
+};
+
+static uint32_t read32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static uint hash4(uint32_t v) {
+    return (v * 2654435761U) >> (32 - HASH_LOG);
+}
+
+/* Write a length's continuation bytes (the part past 15). */
+static unsigned char *put_len(unsigned char *op, size_t n) {
+    while (n >= 255) { *op++ = 255; n -= 255; }
+    *op++ = (unsigned char) n;
+    return op;
+}
+
+/* Emit LITLEN literals at LIT, then a match of MLEN bytes OFFSET back
+ * (or no match, if MLEN is 0). Returns NULL if it won't fit. */
+static unsigned char *put_seq(unsigned char *op, unsigned char *oend,
+        const unsigned char *lit, size_t litlen, uint offset, size_t mlen) {
+    size_t ml = mlen ? mlen - MIN_MATCH : 0;
+    if (op + 1 + litlen / 255 + 1 + litlen + 2 + ml / 255 + 1 > oend)
+        return NULL;
+    *op++ = (litlen < 15 ? litlen : 15) << 4 | (ml < 15 ? ml : 15);
+    if (litlen >= 15) op = put_len(op, litlen - 15);
+    memcpy(op, lit, litlen);
+    op += litlen;
+    if (mlen == 0) return op;
+    *op++ = offset & 0xff;
+    *op++ = offset >> 8;
+    if (ml >= 15) op = put_len(op, ml - 15);
+    return op;
+}
+
+lz_dict *lz_dict_new(const unsigned char *buf, size_t len) {
+    lz_dict *d = alloc(sizeof(*d), 'z');
+    size_t i;
+    if (len > LZ_DICT_MAX) {
+        buf += len - LZ_DICT_MAX;
+        len = LZ_DICT_MAX;
+    }
+    d->buf = buf;
+    d->len = len;
+    for (i=0; i < (1 << HASH_LOG); i++) d->table[i] = NO_POS;
+    for (i=0; i + MIN_MATCH <= len; i++) d->table[hash4(read32(buf + i))] = i;
+    return d;
+}
+
+void lz_dict_free(lz_dict *d) {
+    dealloc(d, 'z');
+}
+
+/* Length of the match between IP and REF, up to END and REND. */
+static size_t match_len(const unsigned char *ip, const unsigned char *end,
+        const unsigned char *ref, const unsigned char *rend) {
+    size_t n = MIN_MATCH;
+    while (ip + n < end && ref + n < rend && ref[n] == ip[n]) n++;
+    return n;
+}
+
+size_t lz_compress(const lz_dict *d, const unsigned char *src, size_t srclen,
+        unsigned char *dst, size_t dstcap) {
+    uint32_t table[1 << HASH_LOG];
+    const unsigned char *ip = src, *anchor = src, *end = src + srclen;
+    unsigned char *op = dst, *oend = dst + dstcap;
+    uint32_t seq, pos;
+    size_t mlen, offset;
+    uint h;
+
+    for (h=0; h < (1 << HASH_LOG); h++) table[h] = NO_POS;
+    while (ip + MIN_MATCH <= end) {
+        seq = read32(ip);
+        h = hash4(seq);
+        pos = table[h];
+        table[h] = ip - src;
+        mlen = 0;
+        if (pos != NO_POS && (ip - src) - pos <= MAX_OFFSET
+            && read32(src + pos) == seq) {
+            mlen = match_len(ip, end, src + pos, end);
+            offset = (ip - src) - pos;
+        } else if (d && (pos = d->table[h]) != NO_POS
+            && (offset = (ip - src) + (d->len - pos)) <= MAX_OFFSET
+            && read32(d->buf + pos) == seq) {
+            mlen = match_len(ip, end, d->buf + pos, d->buf + d->len);
+        }
+        if (mlen == 0) {
+            ip++;
+            continue;
+        }
+        op = put_seq(op, oend, anchor, ip - anchor, offset, mlen);
+        if (op == NULL) return 0;
+        ip += mlen;
+        anchor = ip;
+    }
+    op = put_seq(op, oend, anchor, end - anchor, 0, 0);
+    return op == NULL ? 0 : op - dst;
+}
+
+/* Read a length's continuation bytes. Returns 0 on truncated input. */
+static int get_len(const unsigned char **ip, const unsigned char *end, size_t *n) {
+    unsigned char b;
+    do {
+        if (*ip >= end) return 0;
+        b = *(*ip)++;
+        *n += b;
+    } while (b == 255);
+    return 1;
+}
+
+size_t lz_decompress(const unsigned char *dict, size_t dictlen,
+        const unsigned char *src, size_t srclen,
+        unsigned char *dst, size_t dstcap) {
+    const unsigned char *ip = src, *end = src + srclen, *ref;
+    unsigned char *op = dst, *oend = dst + dstcap;
+    size_t litlen, mlen, offset;
+    unsigned char token;
+
+    while (ip < end) {
+        token = *ip++;
+        litlen = token >> 4;
+        if (litlen == 15 && !get_len(&ip, end, &litlen)) return LZ_ERROR;
+        if (litlen > (size_t) (end - ip) || litlen > (size_t) (oend - op))
+            return LZ_ERROR;
+        memcpy(op, ip, litlen);
+        op += litlen;
+        ip += litlen;
+        if (ip == end) break;       /* last sequence */
+
+        if (end - ip < 2) return LZ_ERROR;
+        offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        mlen = (token & 15);
+        if (mlen == 15 && !get_len(&ip, end, &mlen)) return LZ_ERROR;
+        mlen += MIN_MATCH;
+        if (offset == 0 || offset > (size_t) (op - dst) + dictlen
+            || mlen > (size_t) (oend - op))
+            return LZ_ERROR;
+        if (offset > (size_t) (op - dst)) {     /* starts in the dictionary */
+            ref = dict + dictlen - (offset - (op - dst));
+            for (; mlen > 0 && ref < dict + dictlen; mlen--) *op++ = *ref++;
+            ref = dst;
+        } else {
+            ref = op - offset;
+        }
+        for (; mlen > 0; mlen--) *op++ = *ref++;
+    }
+    return op - dst;
+}
@@ -0,0 +1,37 @@
+#ifndef LZ_H
+#define LZ_H
+
+/* A small LZ77 codec (in the style of LZ4's block format), for DB
+ * buckets: it compresses less than zlib, but decodes several times
+ * faster, and queries decode a bucket for every set they check. */
+
+/* Worst-case compressed size of LEN bytes. */
+#define LZ_BOUND(len) ((len) + (len) / 255 + 16)
+
+/* A preset dictionary: matches may refer back into its last
+ * LZ_DICT_MAX bytes, as though it came just before each input. */
+typedef struct lz_dict lz_dict;
+
+#define LZ_DICT_MAX 65535
+
+/* Index the LEN bytes at BUF (which must stay put) for lz_compress. */
+lz_dict *lz_dict_new(const unsigned char *buf, size_t len);
+void lz_dict_free(lz_dict *d);
+
+/* Compress SRCLEN bytes at SRC into DST, which has room for DSTCAP
+ * bytes, with dictionary D (or NULL). Returns the compressed length,
+ * or 0 if it doesn't fit. */
+size_t lz_compress(const lz_dict *d, const unsigned char *src, size_t srclen,
+    unsigned char *dst, size_t dstcap);
+
+/* Decompress SRCLEN bytes at SRC into DST, which has room for DSTCAP
+ * bytes, given the DICTLEN bytes of dictionary it was compressed with
+ * at DICT. Returns the decompressed length, or LZ_ERROR if the input
+ * is corrupt or doesn't fit. */
+size_t lz_decompress(const unsigned char *dict, size_t dictlen,
+    const unsigned char *src, size_t srclen,
+    unsigned char *dst, size_t dstcap);
+
+#define LZ_ERROR ((size_t) -1)
+
+#endif
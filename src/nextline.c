@@ -41,7 +41,7 @@ char *nextline(FILE *f, size_t *len) {
         if (line) free(line);
         return NULL;
     } else if (res > buf_sz) {
-        free(buf);
+        dealloc(buf, 'b');
         buf_sz = res + 1;
         if (DEBUG) fprintf(stderr, "nextline: buf_sz %ld\n", buf_sz);
         buf = alloc(buf_sz, 'b');
@@ -60,6 +60,6 @@ char *nextline(FILE *f, size_t *len) {
 
 void free_nextline_buffer() {
 #if defined(HAS_GETLINE)
-    free(buf);
+    dealloc(buf, 'b');
 #endif
 }
@@ -0,0 +1,64 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <assert.h>
+#include <err.h>
+
+#include "glean.h"
+#include "proto.h"
+
+static void put_uint(char *buf, uint32_t n, int bytes) {
+    int i;
+    for (i=0; i<bytes; i++) {
+        buf[i] = n & 0xff;
+        n >>= 8;
+    }
+}
+
+static uint32_t get_uint(char *buf, int bytes) {
+    uint32_t n = 0;
+    int i;
+    for (i=bytes-1; i>=0; i--) n = (n << 8) + (buf[i] & 0xff);
+    return n;
+}
+
+/* Write a word frame for the LEN-byte token NAME to F. */
+void proto_put_word(FILE *f, char *name, uint len, hash_t hash, uint count) {
+    char hdr[PROTO_WORD_HDR_SZ];
+    assert(len > 0 && len < MAX_WORD_SZ);
+    hdr[0] = PROTO_WORD;
+    put_uint(hdr + 1, len, 2);
+    put_uint(hdr + 3, hash, 4);
+    put_uint(hdr + 7, count, 4);
+    if (fwrite(hdr, PROTO_WORD_HDR_SZ, 1, f) != 1 ||
+        fwrite(name, len, 1, f) != 1) err(1, "fwrite");
+}
+
+/* Write an end-of-file frame to F. */
+void proto_put_end(FILE *f, int skipped) {
+    if (fputc(skipped ? PROTO_SKIP : PROTO_DONE, f) == EOF) err(1, "fputc");
+}
+
+/* Decode the frame at the head of the LEN-byte buffer BUF into FR.
+ * Returns the number of bytes used, 0 if the frame is incomplete,
+ * or <0 if the input is corrupt. */
+int proto_get_frame(char *buf, uint len, proto_frame *fr) {
+    if (len == 0) return 0;
+    fr->type = buf[0];
+    switch (fr->type) {
+    case PROTO_DONE:
+    case PROTO_SKIP:
+        return 1;
+    case PROTO_WORD:
+        if (len < PROTO_WORD_HDR_SZ) return 0;
+        fr->len = get_uint(buf + 1, 2);
+        if (fr->len == 0 || fr->len >= MAX_WORD_SZ) return -1;
+        if (len < PROTO_WORD_HDR_SZ + fr->len) return 0;
+        fr->hash = get_uint(buf + 3, 4);
+        fr->count = get_uint(buf + 7, 4);
+        fr->name = buf + PROTO_WORD_HDR_SZ;
+        return PROTO_WORD_HDR_SZ + fr->len;
+    default:
+        return -1;
+    }
+}
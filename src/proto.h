@@ -0,0 +1,44 @@
+#ifndef PROTO_H
+#define PROTO_H
+
+/* Framed binary protocol for gln_tokens -> gln_index results.
+ *
+ * Every frame starts with a one-byte type:
+ *   Word:  ['w'] [token length/2] [word_hash/4] [count/4] [token bytes]
+ *   Done:  ['D']    (end of file; tokenized)
+ *   Skip:  ['S']    (end of file; skipped)
+ * Integers are little-endian. The token is not \0-terminated.
+ *
+ * (Filenames are still sent to gln_tokens one per line.) */
+
+#define PROTO_WORD 'w'
+#define PROTO_DONE 'D'
+#define PROTO_SKIP 'S'
+
+/* Byte length of a word frame's header, before the token bytes. */
+#define PROTO_WORD_HDR_SZ (1 + 2 + 4 + 4)
+
+/* Largest possible frame. */
+#define PROTO_MAX_FRAME_SZ (PROTO_WORD_HDR_SZ + MAX_WORD_SZ)
+
+/* A decoded frame. For word frames, NAME points into the read buffer. */
+typedef struct proto_frame {
+    char type;
+    uint len;               /* token length */
+    hash_t hash;            /* token's word_hash */
+    uint count;             /* occurrence count */
+    char *name;             /* token bytes (not \0-terminated) */
+} proto_frame;
+
+/* Write a word frame for the LEN-byte token NAME to F. */
+void proto_put_word(FILE *f, char *name, uint len, hash_t hash, uint count);
+
+/* Write an end-of-file frame to F. */
+void proto_put_end(FILE *f, int skipped);
+
+/* Decode the frame at the head of the LEN-byte buffer BUF into FR.
+ * Returns the number of bytes used, 0 if the frame is incomplete,
+ * or <0 if the input is corrupt. */
+int proto_get_frame(char *buf, uint len, proto_frame *fr);
+
+#endif
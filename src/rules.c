@@ -0,0 +1,409 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <assert.h>
+#include <string.h>
+#include <ctype.h>
+#include <err.h>
+#include <regex.h>
+
+#include "glean.h"
+#include "set.h"
+#include "word.h"
+#include "array.h"
+#include "nextline.h"
+#include "rules.h"
+
+/* The rules are compiled into:
+ *
+ * - a hash table of literal suffix rules (e.g. "\.mp3$"), checked with
+ *   one lookup per distinct suffix length rather than a regexec each;
+ * - groups of consecutive rules with the same action, with all of their
+ *   other regexes combined into one alternation, "(re1)|(re2)|...".
+ *
+ * Since every rule in a group has the same action, it doesn't matter
+ * which one matched first, so first-match priority is preserved as long
+ * as the groups are tried in order, stopping at the first literal (or
+ * per-directory) match that precedes them. */
+
+#define RE_FLAGS (REG_EXTENDED | REG_ICASE | REG_NOSUB)
+#define MAX_SUFFIX_SZ 32
+
+typedef struct rule {
+    int idx;                /* position, for first-match priority */
+    char *pat;
+    char *action;
+    regex_t re;             /* compiled alone, for directory checks */
+    char *suffix;           /* lowercased literal suffix, or NULL */
+    int dir_ok;             /* not end-anchored: matching a dir's path
+                             * means it matches every file in it */
+} rule;
+
+typedef struct re_group {
+    int lo, hi;             /* rules in the group, inclusive */
+    int has_re;             /* does it have any non-literal rules? */
+    regex_t re;             /* combined regex */
+} re_group;
+
+struct rules {
+    int debug;
+    int compiled;
+    v_array *rs;            /* rule * */
+    v_array *groups;        /* re_group * */
+    set *suffixes;          /* rule *, keyed by suffix */
+    uint sfx_lens[MAX_SUFFIX_SZ + 1];   /* distinct suffix lengths */
+    uint sfx_len_ct;
+};
+
+/* Default REs for filenames to always ignore. */
+static char *default_ignore_REs[] = {
+    /* version control systems */
+    "\\.git/", "\\.hg/", "CVS/",
+    /* emacs backup files */
+    "~$",
+    /* dotfiles */
+    "/\\.",
+    /* Various extensions for file types that may begin w/ text headers. */
+    "\\.mp3$", "\\.pdf$", "\\.jpg$", "\\.ogg$", "\\.ppt$",
+    "\\.zip$", "\\.chm$",
+    /* others? */
+    NULL,
+};
+
+static hash_t suffix_hash(void *v) {
+    return word_hash(((rule *) v)->suffix);
+}
+
+static int suffix_cmp(void *a, void *b) {
+    return strcmp(((rule *) a)->suffix, ((rule *) b)->suffix);
+}
+
+/* Make an empty rule set. If DEBUG is set, trace matching to stderr. */
+rules *rules_new(int debug) {
+    rules *r = alloc(sizeof(rules), 'r');
+    r->debug = debug;
+    r->compiled = 0;
+    r->rs = v_array_new(4);
+    r->groups = v_array_new(4);
+    r->suffixes = set_new(4, suffix_hash, suffix_cmp);
+    r->sfx_len_ct = 0;
+    return r;
+}
+
+static char *copy_str(const char *s) {
+    size_t len = strlen(s);
+    char *c = alloc(len + 1, 's');
+    memcpy(c, s, len + 1);
+    return c;
+}
+
+/* If PAT only matches a literal suffix (such as "\.mp3$"), return it,
+ * lowercased; otherwise return NULL. */
+static char *literal_suffix(const char *pat) {
+    char buf[MAX_SUFFIX_SZ + 1];
+    size_t i, len = strlen(pat), o = 0;
+    if (len < 2 || pat[len - 1] != '$') return NULL;
+    for (i=0; i<len - 1; i++) {
+        if (o == MAX_SUFFIX_SZ) return NULL;
+        if (pat[i] == '\\') {
+            /* escaped punctuation is literal; \w, \1, etc. aren't */
+            if (i + 1 == len - 1 || isalnum((unsigned char) pat[i + 1]))
+                return NULL;
+            buf[o++] = pat[++i];
+        } else if (strchr(".[]()*+?{}|^$", pat[i]) != NULL) {
+            return NULL;
+        } else {
+            buf[o++] = tolower((unsigned char) pat[i]);
+        }
+    }
+    buf[o] = '\0';
+    return copy_str(buf);
+}
+
+/* Can PAT only match at the end of a path? If not, a match against a
+ * directory's path also matches the path of any file in it. */
+static int end_anchored(const char *pat) {
+    const char *p;
+    if (strchr(pat, '$') != NULL) return 1;
+    for (p = pat; *p != '\0'; p++)
+        if (p[0] == '\\' && p[1] != '\0' && strchr("bB>'`", p[1]) != NULL)
+            return 1;
+    return 0;
+}
+
+/* Does PAT contain a backreference? If so, it can't be combined with
+ * others, since the group numbers would change. */
+static int has_backref(const char *pat) {
+    const char *p;
+    for (p = pat; *p != '\0'; p++) {
+        if (p[0] == '\\' && p[1] >= '1' && p[1] <= '9') return 1;
+        if (p[0] == '\\' && p[1] != '\0') p++;
+    }
+    return 0;
+}
+
+/* Add a rule: paths matching regex PAT get ACTION ("index"/"ignore"). */
+void rules_add(rules *r, const char *pat, const char *action) {
+    rule *ru = alloc(sizeof(rule), 'r');
+    assert(pat != NULL); assert(action != NULL); assert(!r->compiled);
+    if (regcomp(&ru->re, pat, RE_FLAGS) != 0) {
+        fprintf(stderr, "Bad regex: %s\n", pat);
+        err(1, "regcomp");
+    }
+    ru->idx = v_array_length(r->rs);
+    ru->pat = copy_str(pat);
+    ru->action = copy_str(action);
+    ru->suffix = literal_suffix(pat);
+    ru->dir_ok = !end_anchored(pat);
+    v_array_append(r->rs, ru);
+    if (r->debug) fprintf(stderr, "Added re #%d: %s%s\n",
+        v_array_length(r->rs), pat, ru->suffix ? " (suffix)" : "");
+}
+
+static void extract_pattern(rules *r, char *buf, size_t len) {
+    char *re, *action;
+    int i;
+    if (len == 0 || buf[0] == '#') return; /* skip blank line / comment */
+    if (buf[0] == '"') {
+        for (i=1; i < len && buf[i] != '"' && buf[i] != '\0'; i++) ;
+        if (buf[i] == '\0') {
+            fprintf(stderr, "Bad pattern line: %s\n", buf);
+            exit(1);
+        }
+        re = buf + 1;
+    } else {
+        for (i=0; i < len && buf[i] != '\0' && buf[i] != ' '; i++) ;
+        re = buf;
+    }
+
+    buf[i] = '\0';
+    action = (i == len ? "ignore" : buf + i +1);
+    assert(re); assert(action);
+    rules_add(r, re, action);
+}
+
+/* Read rules from the config file FNAME, or add the defaults if NULL. */
+void rules_read(rules *r, const char *fname) {
+    char **pat;
+    if (fname == NULL) {
+        for (pat = default_ignore_REs; *pat != NULL; pat++)
+            rules_add(r, *pat, "ignore");
+    } else {
+        FILE *f = fopen(fname, "r");
+        char *buf;
+        size_t len;
+        if (f == NULL) err(1, "%s", fname);
+        while ((buf = nextline(f, &len))) {
+            if (buf[len-1] == '\n') { buf[len-1] = '\0'; len--; }
+            extract_pattern(r, buf, len);
+        }
+        if (fclose(f) != 0) err(1, "%s", fname);
+    }
+}
+
+/* Get the config file named by $GLN_FILTER_FILE (expanding a leading
+ * "~/"), or NULL if it isn't set. */
+char *rules_config_file(void) {
+    char *e = getenv("GLN_FILTER_FILE");
+    if (e != NULL) {
+        int len = strlen(e);
+        char *path, *home;
+        if (len > 1 && e[0] == '~' && e[1] == '/') {
+            home = getenv("HOME");
+            assert(home);
+            len = strlen(e) + strlen(home) + 1;
+            path = alloc(len, 'p'); /* leaked. not a big deal. */
+            if (len <= snprintf(path, len, "%s/%s", home, e + 2)) {
+                fprintf(stderr, "snprintf error\n");
+                exit(EXIT_FAILURE);
+            }
+            return path;
+        }
+        return e;
+    }
+    return NULL;
+}
+
+static rule *get_rule(rules *r, int i) {
+    return (rule *) v_array_get(r->rs, i);
+}
+
+/* Compile the regexes for rules LO..HI into group G, as one alternation
+ * if possible. Returns 0 on success, <0 if they need splitting up. */
+static int compile_group(rules *r, re_group *g) {
+    size_t len = 1;
+    char *buf;
+    int i, res, ct = 0;
+    rule *ru;
+    for (i=g->lo; i<=g->hi; i++) {
+        ru = get_rule(r, i);
+        if (ru->suffix == NULL) len += strlen(ru->pat) + 3;
+    }
+    buf = alloc(len, 'g');
+    buf[0] = '\0';
+    for (i=g->lo; i<=g->hi; i++) {
+        ru = get_rule(r, i);
+        if (ru->suffix != NULL) continue;
+        if (ct++ > 0) strcat(buf, "|");
+        strcat(buf, "(");
+        strcat(buf, ru->pat);
+        strcat(buf, ")");
+    }
+    g->has_re = (ct > 0);
+    res = (ct == 0 || regcomp(&g->re, buf, RE_FLAGS) == 0) ? 0 : -1;
+    if (r->debug && res == 0 && ct > 0)
+        fprintf(stderr, "Group %d-%d: %s\n", g->lo, g->hi, buf);
+    dealloc(buf, 'g');
+    return res;
+}
+
+static void add_group(rules *r, int lo, int hi) {
+    re_group *g = alloc(sizeof(re_group), 'g');
+    int i;
+    g->lo = lo;
+    g->hi = hi;
+    if (compile_group(r, g) == 0) {
+        v_array_append(r->groups, g);
+    } else {                    /* fall back on one group per rule */
+        dealloc(g, 'g');
+        for (i=lo; i<=hi; i++) {
+            g = alloc(sizeof(re_group), 'g');
+            g->lo = g->hi = i;
+            if (compile_group(r, g) < 0) errx(1, "regcomp");
+            v_array_append(r->groups, g);
+        }
+    }
+}
+
+static void add_suffix(rules *r, rule *ru) {
+    uint i, len = strlen(ru->suffix);
+    if (set_known(r->suffixes, ru)) return;     /* first rule wins */
+    if (set_store(r->suffixes, ru) == TABLE_SET_FAIL)
+        err(1, "set_store failure");
+    for (i=0; i<r->sfx_len_ct; i++)
+        if (r->sfx_lens[i] == len) return;
+    r->sfx_lens[r->sfx_len_ct++] = len;
+}
+
+/* Compile the rules into a matcher. Must be called after the last
+ * rules_add and before matching; afterward, matching is thread-safe,
+ * since it only reads the rules. */
+void rules_compile(rules *r) {
+    int i, lo = 0, len = v_array_length(r->rs);
+    rule *ru;
+    assert(!r->compiled);
+    for (i=0; i<len; i++) {
+        ru = get_rule(r, i);
+        if (ru->suffix) add_suffix(r, ru);
+
+        /* Start a new group on each change of action or backref. */
+        if (i > lo && (strcmp(ru->action, get_rule(r, lo)->action) != 0
+                || has_backref(ru->pat) || has_backref(get_rule(r, i-1)->pat))) {
+            add_group(r, lo, i - 1);
+            lo = i;
+        }
+    }
+    if (len > 0) add_group(r, lo, len - 1);
+    r->compiled = 1;
+}
+
+/* Get the index of the first literal suffix rule matching PATH, or -1. */
+static int match_suffix(rules *r, const char *path) {
+    char buf[MAX_SUFFIX_SZ + 1];
+    size_t plen = strlen(path);
+    uint i, j, len;
+    int best = -1;
+    rule key, *ru;
+    key.suffix = buf;
+    for (i=0; i<r->sfx_len_ct; i++) {
+        len = r->sfx_lens[i];
+        if (len > plen) continue;
+        for (j=0; j<len; j++)
+            buf[j] = tolower((unsigned char) path[plen - len + j]);
+        buf[len] = '\0';
+        ru = (rule *) set_lookup(r->suffixes, &key);    /* read-only */
+        if (ru != NULL && (best == -1 || ru->idx < best)) best = ru->idx;
+    }
+    return best;
+}
+
+/* Prepare RD for matching files in directory DPATH (ending in '/'). */
+void rules_dir_init(rules *r, rules_dir *rd, const char *dpath) {
+    int i, len = v_array_length(r->rs);
+    rule *ru;
+    assert(r->compiled);
+    rd->idx = -1;
+    for (i=0; i<len; i++) {
+        ru = get_rule(r, i);
+        if (ru->dir_ok && regexec(&ru->re, dpath, 0, NULL, 0) == 0) {
+            rd->idx = i;
+            break;
+        }
+    }
+}
+
+/* Would every path under the directory DPATH (ending in '/') be
+ * ignored? */
+int rules_prune_dir(rules *r, const char *dpath) {
+    int i, len = v_array_length(r->rs);
+    rule *ru;
+    assert(r->compiled);
+    for (i=0; i<len; i++) {
+        ru = get_rule(r, i);
+        if (strcmp(ru->action, "ignore") != 0) return 0;
+        if (ru->dir_ok && regexec(&ru->re, dpath, 0, NULL, 0) == 0) return 1;
+    }
+    return 0;
+}
+
+/* Get the action for PATH. If RD is non-NULL, PATH must be in the
+ * directory RD was initialized for. */
+const char *rules_match(rules *r, const rules_dir *rd, const char *path) {
+    int i, limit = v_array_length(r->rs), glen = v_array_length(r->groups);
+    int sidx = match_suffix(r, path);
+    re_group *g;
+    assert(r->compiled);
+
+    /* The first rule known to match; only earlier groups need checking. */
+    if (sidx >= 0) limit = sidx;
+    if (rd && rd->idx >= 0 && rd->idx < limit) limit = rd->idx;
+
+    for (i=0; i<glen; i++) {
+        g = (re_group *) v_array_get(r->groups, i);
+        if (g->lo >= limit) break;
+        if (g->hi >= limit                      /* same action either way */
+            || (g->has_re && regexec(&g->re, path, 0, NULL, 0) == 0)) {
+            if (r->debug) fprintf(stderr, "Rules %d-%d match: %s\n",
+                g->lo, g->hi, path);
+            return get_rule(r, g->lo)->action;
+        }
+    }
+    if (limit < v_array_length(r->rs)) {
+        if (r->debug) fprintf(stderr, "Rule %d matches: %s\n", limit, path);
+        return get_rule(r, limit)->action;
+    }
+    if (r->debug) fprintf(stderr, "Failed to match: %s\n", path);
+    return "index";         /* default */
+}
+
+static void free_rule(void *v) {
+    rule *ru = (rule *) v;
+    regfree(&ru->re);
+    dealloc(ru->pat, 's');
+    dealloc(ru->action, 's');
+    if (ru->suffix) dealloc(ru->suffix, 's');
+    dealloc(ru, 'r');
+}
+
+static void free_group(void *v) {
+    re_group *g = (re_group *) v;
+    if (g->has_re) regfree(&g->re);
+    dealloc(g, 'g');
+}
+
+void rules_free(rules *r) {
+    set_free(r->suffixes, NULL);
+    v_array_free(r->groups, free_group);
+    v_array_free(r->rs, free_rule);
+    dealloc(r, 'r');
+}
@@ -0,0 +1,48 @@
+#ifndef RULES_H
+#define RULES_H
+
+/* Compiled index/ignore rules for filenames, read from a gln_filter(1)
+ * config file. The first matching rule wins; paths that match no rule
+ * are indexed. Used by gln_filter and (in-process) by gln_index. */
+typedef struct rules rules;
+
+/* Cached per-directory state, so rules that match a directory itself
+ * are only checked once for all of the files in it. */
+typedef struct rules_dir {
+    int idx;                /* first rule matching the dir, or -1 */
+} rules_dir;
+
+/* Make an empty rule set. If DEBUG is set, trace matching to stderr. */
+rules *rules_new(int debug);
+
+/* Add a rule: paths matching regex PAT get ACTION ("index"/"ignore"). */
+void rules_add(rules *r, const char *pat, const char *action);
+
+/* Read rules from the config file FNAME, or add the defaults if NULL. */
+void rules_read(rules *r, const char *fname);
+
+/* Get the config file named by $GLN_FILTER_FILE (expanding a leading
+ * "~/"), or NULL if it isn't set. */
+char *rules_config_file(void);
+
+/* Compile the rules into a matcher. Must be called after the last
+ * rules_add and before matching; afterward, matching is thread-safe,
+ * since it only reads the rules. */
+void rules_compile(rules *r);
+
+/* Prepare RD for matching files in directory DPATH (ending in '/'). */
+void rules_dir_init(rules *r, rules_dir *rd, const char *dpath);
+
+/* Would every path under the directory DPATH (ending in '/') be
+ * ignored? True when the first rule matching DPATH also matches anything
+ * in it and ignores it, and every rule before it ignores too, so no
+ * earlier rule could index a file in it. */
+int rules_prune_dir(rules *r, const char *dpath);
+
+/* Get the action for PATH. If RD is non-NULL, PATH must be in the
+ * directory RD was initialized for. */
+const char *rules_match(rules *r, const rules_dir *rd, const char *path);
+
+void rules_free(rules *r);
+
+#endif
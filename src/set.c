@@ -7,6 +7,7 @@
 
 #include "glean.h"
 #include "set.h"
+#include "arena.h"
 
 /* Externally-chaining, resizable hash table for a set of unique keys.
  * I'm not using a more general-purpose hash table because only storing
@@ -43,10 +44,14 @@ set *set_new(int sz_factor, set_hash *hash, set_cmp *cmp) {
     s->sz=sz; s->hash = hash; s->cmp = cmp; s->b = b;
     s->ms = primes[PRIME_COUNT-2];
     s->mcl = DEF_GROW_LEN;
+    s->arena = NULL;
     for (i=0; i<sz; i++) s->b[i] = NULL;
     return s;
 }
 
+/* Allocate the set's links from arena A, rather than one at a time. */
+void set_use_arena(set *s, arena *a) { s->arena = a; }
+
 /* Get a value associated w/ a key, moving its s_link to the
  * front of its chain. Return NULL if not found. */
 void *set_get(set *s, void *key) {
@@ -73,6 +78,18 @@ void *set_get(set *s, void *key) {
     return NULL;
 }
 
+/* Get a value associated w/ a key, leaving the chain as is.
+ * Return NULL if not found. */
+void *set_lookup(set *s, void *key) {
+    s_link *cur;
+    assert(key); assert(s);
+    for (cur = s->b[s->hash(key) % s->sz]; cur != NULL; cur = cur->next) {
+        assert(cur->key);
+        if (s->cmp(key, cur->key) == 0) return cur->key;
+    }
+    return NULL;
+}
+
 /* Is a given key known? */
 int set_known(set *s, void *key) { return set_get(s, key) != NULL; }
 
@@ -120,7 +137,7 @@ static int set_resize(set *s, ulong sz) {
             cur = next;
         }
     }
-    free(oldb);
+    dealloc(oldb, 'S');
     return TABLE_RESIZED;
 }
 
@@ -141,7 +158,11 @@ int set_store(set *s, void *key) {
     assert(key); assert(s);
     h = s->hash(key);
     b = h % s->sz;
-    n = alloc(sizeof(s_link), 'S');
+    if (s->arena) {
+        n = arena_alloc(s->arena, sizeof(s_link));
+    } else {
+        n = alloc(sizeof(s_link), 'S');
+    }
     n->next = NULL;
     n->key = key;
     
@@ -194,12 +215,12 @@ void set_free(set *s, set_free_cb *cb) {
         while (cur) {
             if (cb) cb(cur->key);
             n = cur->next;
-            free(cur);
+            if (s->arena == NULL) dealloc(cur, 'S');
             cur = n;
         }
     }
-    free(s->b);
-    free(s);
+    dealloc(s->b, 'S');
+    dealloc(s, 'S');
 }
 
 /* Print tuning statistics about the set's internals. */
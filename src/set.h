@@ -44,15 +44,26 @@ typedef struct set {
     set_hash *hash;             /* hash function */
     set_cmp *cmp;               /* comparison function */
     s_link **b;                 /* buckets */
+    struct arena *arena;        /* links (and keys) come from here, or NULL */
 } set;
 
 /* Initialize a hash table set, expecting to store at
  * least 2^sz_factor values. Returns NULL on error. */
 set *set_new(int sz_factor, set_hash *hash, set_cmp *cmp);
 
+/* Allocate the set's links from arena A, rather than one at a time.
+ * Keys may be allocated from it as well. The caller frees A, after
+ * the set. */
+void set_use_arena(set *t, struct arena *a);
+
 /* Get the canonical version of the key, or NULL if unknown. */
 void *set_get(set *t, void *key);
 
+/* Like set_get, but without moving the key's link to the front of its
+ * chain, so lookups don't write to the set: several threads can call it
+ * at once, as long as none is storing. */
+void *set_lookup(set *t, void *key);
+
 /* Store the key, return an int with bits set according to TABLE_* flags.
  * Returns TABLE_SET_FAIL (0) on error. */
 int set_store(set *t, void *key);
@@ -0,0 +1,337 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <err.h>
+#include <errno.h>
+
+#include "glean.h"
+#include "set.h"
+#include "word.h"
+#include "array.h"
+#include "spill.h"
+
+/* External-memory postings, for gln_index -m.
+ *
+ * Once the postings held in memory reach a budget, they're moved out of
+ * the words' arrays into a run: sorted by (word, file) in one temporary
+ * file, and by (file, word) in another. The words themselves stay in
+ * memory, with their counts, so stop words can still be found.
+ *
+ * Before writing the DBs, the by-word runs are k-way merged into a
+ * single file with each word's postings in one place, and a directory
+ * from word hash to their offset, so the token DB can load one word's
+ * postings at a time. The by-file runs are merged again as the forward
+ * index is written. Temporary files are unlinked as soon as they are
+ * created, so they never outlive the build. */
+
+#define READ_BUF_CT 4096        /* pairs buffered per run while merging */
+#define WRITE_BUF_CT 4096
+
+/* A pair of hashes, as stored in a run. */
+typedef struct hash_pair {
+    hash_t k;
+    hash_t v;
+} hash_pair;
+
+/* A run's position in each of the run files, in pairs. */
+typedef struct run {
+    ulong off;
+    ulong ct;
+} run;
+
+/* A word's postings in the merged file. */
+typedef struct dir_entry {
+    hash_t hash;
+    uint ct;
+    ulong off;              /* in hashes */
+} dir_entry;
+
+/* One run's read cursor, while merging. */
+typedef struct reader {
+    int fd;
+    ulong next, end;        /* pairs not yet buffered */
+    hash_pair *buf;
+    uint i, len;
+} reader;
+
+struct spill {
+    pthread_mutex_t lock;   /* guards runs and pairs */
+    int fds[2];             /* runs by word, and by file */
+    run *runs;
+    uint run_ct, run_sz;
+    ulong pairs;            /* pairs in each run file */
+
+    int mfd;                /* merged postings, by word */
+    dir_entry *dir;
+    uint dir_ct, dir_sz;
+    hash_t *wbuf;           /* write buffer for mfd */
+    uint wbuf_ct;
+    ulong m_ct;             /* hashes written to mfd */
+};
+
+static void lock(pthread_mutex_t *m) {
+    if (pthread_mutex_lock(m) != 0) errx(1, "mutex lock");
+}
+
+static void unlock(pthread_mutex_t *m) {
+    if (pthread_mutex_unlock(m) != 0) errx(1, "mutex unlock");
+}
+
+/* Make a temporary file in DIR, and unlink it right away. */
+static int temp_file(const char *dir) {
+    int len = strlen(dir) + strlen("/spill.XXXXXX") + 1;
+    char *path = alloc(len, 'p');
+    int fd;
+    if (len <= snprintf(path, len, "%s/spill.XXXXXX", dir)) {
+        fprintf(stderr, "snprintf error\n");
+        exit(EXIT_FAILURE);
+    }
+    if ((fd = mkstemp(path)) == -1) err(1, "%s", path);
+    if (unlink(path) == -1) err(1, "%s", path);
+    dealloc(path, 'p');
+    return fd;
+}
+
+static void pwrite_all(int fd, void *buf, size_t sz, off_t off) {
+    ssize_t res;
+    char *p = (char *) buf;
+    while (sz > 0) {
+        res = pwrite(fd, p, sz, off);
+        if (res == -1 && errno == EINTR) continue;
+        if (res <= 0) err(1, "spill write");
+        p += res; off += res; sz -= res;
+    }
+}
+
+static void pread_all(int fd, void *buf, size_t sz, off_t off) {
+    ssize_t res;
+    char *p = (char *) buf;
+    while (sz > 0) {
+        res = pread(fd, p, sz, off);
+        if (res == -1 && errno == EINTR) continue;
+        if (res <= 0) err(1, "spill read");
+        p += res; off += res; sz -= res;
+    }
+}
+
+spill *spill_new(const char *dir) {
+    spill *sp = alloc(sizeof(*sp), 'R');
+    memset(sp, 0, sizeof(*sp));
+    if (pthread_mutex_init(&sp->lock, NULL) != 0) errx(1, "mutex init");
+    sp->fds[0] = temp_file(dir);
+    sp->fds[1] = temp_file(dir);
+    sp->mfd = temp_file(dir);
+    sp->run_sz = 8;
+    sp->runs = alloc(sp->run_sz * sizeof(run), 'R');
+    return sp;
+}
+
+
+/************
+ * Spilling *
+ ************/
+
+/* Userdata for collect_pairs' set_apply. */
+typedef struct collect_udata {
+    hash_pair *ps;
+    ulong ct, sz;
+} collect_udata;
+
+/* Move a word's postings into the pair array. */
+static void collect_pairs(void *v, void *udata) {
+    word *w = (word *) v;
+    collect_udata *ud = (collect_udata *) udata;
+    uint i, len = h_array_length(w->a);
+    if (len == 0) return;
+    while (ud->ct + len > ud->sz) {
+        ud->sz *= 2;
+        ud->ps = ralloc(ud->ps, ud->sz * sizeof(hash_pair), 'R');
+    }
+    for (i=0; i<len; i++) {
+        ud->ps[ud->ct].k = w->hash;
+        ud->ps[ud->ct].v = h_array_get(w->a, i);
+        ud->ct++;
+    }
+    h_array_clear(w->a);
+}
+
+static int cmp_pair(const void *va, const void *vb) {
+    const hash_pair *a = (const hash_pair *) va, *b = (const hash_pair *) vb;
+    if (a->k != b->k) return a->k < b->k ? -1 : 1;
+    return a->v < b->v ? -1 : a->v > b->v ? 1 : 0;
+}
+
+void spill_words(spill *sp, set *s) {
+    collect_udata ud;
+    ulong i, off;
+    hash_t t;
+
+    ud.ct = 0;
+    ud.sz = 1024;
+    ud.ps = alloc(ud.sz * sizeof(hash_pair), 'R');
+    set_apply(s, collect_pairs, &ud);
+    if (ud.ct == 0) { dealloc(ud.ps, 'R'); return; }
+
+    lock(&sp->lock);
+    if (sp->run_ct == sp->run_sz) {
+        sp->run_sz *= 2;
+        sp->runs = ralloc(sp->runs, sp->run_sz * sizeof(run), 'R');
+    }
+    off = sp->pairs;
+    sp->runs[sp->run_ct].off = off;
+    sp->runs[sp->run_ct].ct = ud.ct;
+    sp->run_ct++;
+    sp->pairs += ud.ct;
+    unlock(&sp->lock);
+
+    qsort(ud.ps, ud.ct, sizeof(hash_pair), cmp_pair);
+    pwrite_all(sp->fds[0], ud.ps, ud.ct * sizeof(hash_pair), off * sizeof(hash_pair));
+    for (i=0; i<ud.ct; i++) {
+        t = ud.ps[i].k;
+        ud.ps[i].k = ud.ps[i].v;
+        ud.ps[i].v = t;
+    }
+    qsort(ud.ps, ud.ct, sizeof(hash_pair), cmp_pair);
+    pwrite_all(sp->fds[1], ud.ps, ud.ct * sizeof(hash_pair), off * sizeof(hash_pair));
+    dealloc(ud.ps, 'R');
+}
+
+uint spill_run_count(spill *sp) { return sp->run_ct; }
+
+
+/***********
+ * Merging *
+ ***********/
+
+/* Buffer the reader's next pairs. Returns 0 at the end of the run. */
+static int reader_fill(reader *r) {
+    ulong n = r->end - r->next;
+    if (n == 0) return 0;
+    if (n > READ_BUF_CT) n = READ_BUF_CT;
+    pread_all(r->fd, r->buf, n * sizeof(hash_pair), r->next * sizeof(hash_pair));
+    r->next += n;
+    r->i = 0;
+    r->len = n;
+    return 1;
+}
+
+static int reader_lt(reader *a, reader *b) {
+    return cmp_pair(&a->buf[a->i], &b->buf[b->i]) < 0;
+}
+
+/* Restore the min-heap property at H[I], for a heap of CT readers. */
+static void sift_down(reader **h, uint ct, uint i) {
+    uint l, r, min;
+    reader *t;
+    for (;;) {
+        l = 2*i + 1; r = l + 1; min = i;
+        if (l < ct && reader_lt(h[l], h[min])) min = l;
+        if (r < ct && reader_lt(h[r], h[min])) min = r;
+        if (min == i) return;
+        t = h[i]; h[i] = h[min]; h[min] = t;
+        i = min;
+    }
+}
+
+/* K-way merge the runs in file FD, calling CB on each pair in order. */
+static void merge_runs(spill *sp, int fd, spill_pair_cb *cb, void *udata) {
+    reader *rs = alloc(sp->run_ct * sizeof(reader) + 1, 'R');
+    reader **h = alloc(sp->run_ct * sizeof(reader *) + 1, 'R');
+    uint i, ct = 0;
+    reader *r;
+
+    for (i=0; i<sp->run_ct; i++) {
+        r = &rs[i];
+        r->fd = fd;
+        r->next = sp->runs[i].off;
+        r->end = r->next + sp->runs[i].ct;
+        r->buf = alloc(READ_BUF_CT * sizeof(hash_pair), 'R');
+        if (reader_fill(r)) h[ct++] = r;
+    }
+    for (i=ct; i-- > 0; ) sift_down(h, ct, i);
+
+    while (ct > 0) {
+        r = h[0];
+        cb(r->buf[r->i].k, r->buf[r->i].v, udata);
+        if (++r->i == r->len && !reader_fill(r)) h[0] = h[--ct];
+        sift_down(h, ct, 0);
+    }
+
+    for (i=0; i<sp->run_ct; i++) dealloc(rs[i].buf, 'R');
+    dealloc(rs, 'R');
+    dealloc(h, 'R');
+}
+
+static void flush_merged(spill *sp) {
+    pwrite_all(sp->mfd, sp->wbuf, sp->wbuf_ct * sizeof(hash_t),
+        (sp->m_ct - sp->wbuf_ct) * sizeof(hash_t));
+    sp->wbuf_ct = 0;
+}
+
+/* Append a posting to the merged file, starting a new directory
+ * entry for each new word hash. */
+static void merge_posting(hash_t k, hash_t v, void *udata) {
+    spill *sp = (spill *) udata;
+    dir_entry *d = sp->dir_ct > 0 ? &sp->dir[sp->dir_ct - 1] : NULL;
+    if (d == NULL || d->hash != k) {
+        if (sp->dir_ct == sp->dir_sz) {
+            sp->dir_sz = sp->dir_sz ? 2 * sp->dir_sz : 1024;
+            sp->dir = ralloc(sp->dir, sp->dir_sz * sizeof(dir_entry), 'R');
+        }
+        d = &sp->dir[sp->dir_ct++];
+        d->hash = k;
+        d->ct = 0;
+        d->off = sp->m_ct;
+    }
+    d->ct++;
+    sp->wbuf[sp->wbuf_ct++] = v;
+    sp->m_ct++;
+    if (sp->wbuf_ct == WRITE_BUF_CT) flush_merged(sp);
+}
+
+void spill_merge(spill *sp, set *s) {
+    spill_words(sp, s);
+    sp->wbuf = alloc(WRITE_BUF_CT * sizeof(hash_t), 'R');
+    merge_runs(sp, sp->fds[0], merge_posting, sp);
+    flush_merged(sp);
+    dealloc(sp->wbuf, 'R');
+    sp->wbuf = NULL;
+    /* The by-word runs are no longer needed. */
+    if (ftruncate(sp->fds[0], 0) == -1) err(1, "ftruncate");
+}
+
+void spill_load(spill *sp, word *w) {
+    uint lo = 0, hi = sp->dir_ct, mid, i, n;
+    hash_t buf[WRITE_BUF_CT];
+    dir_entry *d;
+    ulong o;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (sp->dir[mid].hash < w->hash) lo = mid + 1; else hi = mid;
+    }
+    if (lo == sp->dir_ct || sp->dir[lo].hash != w->hash) return;
+    d = &sp->dir[lo];
+    for (o = 0; o < d->ct; o += n) {
+        n = d->ct - o < WRITE_BUF_CT ? d->ct - o : WRITE_BUF_CT;
+        pread_all(sp->mfd, buf, n * sizeof(hash_t), (d->off + o) * sizeof(hash_t));
+        for (i=0; i<n; i++) h_array_append(w->a, buf[i]);
+    }
+}
+
+void spill_each_by_file(spill *sp, spill_pair_cb *cb, void *udata) {
+    merge_runs(sp, sp->fds[1], cb, udata);
+}
+
+void spill_free(spill *sp) {
+    if (close(sp->fds[0]) == -1 || close(sp->fds[1]) == -1
+        || close(sp->mfd) == -1)
+        err(1, "close");
+    pthread_mutex_destroy(&sp->lock);
+    dealloc(sp->runs, 'R');
+    if (sp->dir) dealloc(sp->dir, 'R');
+    dealloc(sp, 'R');
+}
@@ -0,0 +1,34 @@
+#ifndef SPILL_H
+#define SPILL_H
+
+/* Postings (word hash, doc ID) spilled to sorted runs in temporary
+ * files, so the index build doesn't need to keep them all in memory. */
+typedef struct spill spill;
+
+/* Callback for each pair of hashes, in sorted order. */
+typedef void (spill_pair_cb)(hash_t k, hash_t v, void *udata);
+
+/* Start spilling to temporary files in directory DIR. */
+spill *spill_new(const char *dir);
+
+/* Move every posting in the set<word> S out to a new sorted run,
+ * emptying the words' arrays. Safe to call from several threads. */
+void spill_words(spill *sp, set *s);
+
+/* Spill the postings left in set<word> S, then merge all of the runs
+ * by word, so spill_load can get each word's postings. */
+void spill_merge(spill *sp, set *s);
+
+/* Load word W's merged postings into W->a. */
+void spill_load(spill *sp, word *w);
+
+/* Call CB on every posting, as (doc ID, word hash), in order. */
+void spill_each_by_file(spill *sp, spill_pair_cb *cb, void *udata);
+
+/* How many runs have been spilled? */
+uint spill_run_count(spill *sp);
+
+/* Close and remove the temporary files. */
+void spill_free(spill *sp);
+
+#endif
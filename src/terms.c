@@ -0,0 +1,446 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <err.h>
+
+#include "glean.h"
+#include "array.h"
+#include "vbyte.h"
+#include "terms.h"
+
+/* A varint is at most this long, for any term length. */
+#define VARINT_MAX 3
+
+static int fold(unsigned char c) {
+    return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+}
+
+/* Compare A and B, ignoring ASCII case. */
+static int fold_cmp(const char *a, const char *b) {
+    const unsigned char *x = (const unsigned char *) a;
+    const unsigned char *y = (const unsigned char *) b;
+    while (*x != '\0' && fold(*x) == fold(*y)) { x++; y++; }
+    return fold(*x) - fold(*y);
+}
+
+/* Compare A's first N bytes to B's, ignoring ASCII case. */
+static int fold_ncmp(const char *a, const char *b, uint n) {
+    const unsigned char *x = (const unsigned char *) a;
+    const unsigned char *y = (const unsigned char *) b;
+    for (; n > 0 && *x != '\0' && fold(*x) == fold(*y); n--) { x++; y++; }
+    return n == 0 ? 0 : fold(*x) - fold(*y);
+}
+
+int terms_cmp(const char *a, const char *b) {
+    int r = fold_cmp(a, b);
+    return r != 0 ? r : strcmp(a, b);
+}
+
+
+/************
+ * Encoding *
+ ************/
+
+static void put_int32(unsigned char *buf, ulong o, u_int32_t n) {
+    buf[o] = n & 0xff;
+    buf[o + 1] = (n >> 8) & 0xff;
+    buf[o + 2] = (n >> 16) & 0xff;
+    buf[o + 3] = (n >> 24) & 0xff;
+}
+
+static ulong put_varint(unsigned char *buf, ulong o, uint n) {
+    while (n >= 0x80) {
+        buf[o++] = (n & 0x7f) | 0x80;
+        n >>= 7;
+    }
+    buf[o++] = n;
+    return o;
+}
+
+/* The trigram C, ignoring ASCII case. */
+static u_int32_t gram(const char *c) {
+    return ((u_int32_t) fold(c[0]) << 16) | (fold(c[1]) << 8) | fold(c[2]);
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    u_int64_t x = *(u_int64_t *) a, y = *(u_int64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+/* Get each (trigram, term ID) pair in the N terms, as (gram << 32) | ID,
+ * sorted and unique. Saves their count in *CT. */
+static u_int64_t *gram_pairs(char **names, uint n, ulong *ct) {
+    uint i, j, len;
+    ulong sz = 0, o = 0, k;
+    u_int64_t *ps;
+    for (i=0; i<n; i++) {
+        len = strlen(names[i]);
+        if (len >= 3) sz += len - 2;
+    }
+    ps = alloc((sz > 0 ? sz : 1) * sizeof(u_int64_t), 'K');
+    for (i=0; i<n; i++) {
+        len = strlen(names[i]);
+        for (j=0; j + 3 <= len; j++)
+            ps[o++] = ((u_int64_t) gram(names[i] + j) << 32) | i;
+    }
+    qsort(ps, o, sizeof(u_int64_t), cmp_u64);
+    for (k=0, sz=0; k<o; k++)
+        if (sz == 0 || ps[k] != ps[sz - 1]) ps[sz++] = ps[k];
+    *ct = sz;
+    return ps;
+}
+
+/* Write the trigram index for the CT pairs at PS to BUF at O, returning
+ * the offset past it. */
+static ulong put_grams(unsigned char *buf, ulong o, u_int64_t *ps, ulong ct) {
+    ulong k, run, grams = 0, entry;
+    hash_t *ids;
+    for (k=0; k<ct; k++)
+        if (k == 0 || ps[k] >> 32 != ps[k - 1] >> 32) grams++;
+    ids = alloc((ct > 0 ? ct : 1) * sizeof(hash_t), 'K');
+    put_int32(buf, o, grams);
+    entry = o + 4;
+    o = entry + grams * TERMS_GRAM_ENTRY_SZ;
+    for (k=0; k<ct; k += run) {
+        for (run=0; k + run < ct && ps[k + run] >> 32 == ps[k] >> 32; run++)
+            ids[run] = ps[k + run] & 0xffffffff;
+        put_int32(buf, entry, ps[k] >> 32);
+        put_int32(buf, entry + 4, run);
+        put_int32(buf, entry + 8, o);
+        entry += TERMS_GRAM_ENTRY_SZ;
+        o += vbyte_encode(ids, run, buf + o);
+    }
+    dealloc(ids, 'K');
+    return o;
+}
+
+ulong terms_encode(char **names, uint n, char **out) {
+    uint i, len, shared, blocks = (n + TERMS_BLOCK_CT - 1) / TERMS_BLOCK_CT;
+    ulong o, sz = TERMS_HEADER_SZ + blocks * 4, pair_ct;
+    unsigned char *buf;
+    const char *prev = "";
+    u_int64_t *pairs = gram_pairs(names, n, &pair_ct);
+
+    for (i=0; i<n; i++) sz += strlen(names[i]) + 2 * VARINT_MAX;
+    sz += 4 + pair_ct * (TERMS_GRAM_ENTRY_SZ + 4) + VBYTE_BOUND(pair_ct);
+    buf = alloc(sz, 'K');
+    o = TERMS_HEADER_SZ + blocks * 4;
+    for (i=0; i<n; i++) {
+        assert(i == 0 || terms_cmp(names[i - 1], names[i]) < 0);
+        len = strlen(names[i]);
+        if (i % TERMS_BLOCK_CT == 0) {
+            put_int32(buf, TERMS_HEADER_SZ + (i / TERMS_BLOCK_CT) * 4, o);
+            shared = 0;
+        } else {
+            for (shared = 0; shared < len && prev[shared] == names[i][shared];
+                 shared++) ;
+            o = put_varint(buf, o, shared);
+        }
+        o = put_varint(buf, o, len - shared);
+        memcpy(buf + o, names[i] + shared, len - shared);
+        o += len - shared;
+        prev = names[i];
+    }
+    put_int32(buf, 12, o);
+    o = put_grams(buf, o, pairs, pair_ct);
+    dealloc(pairs, 'K');
+    assert(o <= sz);
+    put_int32(buf, 0, o);
+    put_int32(buf, 4, n);
+    put_int32(buf, 8, blocks);
+    *out = (char *) buf;
+    return o;
+}
+
+
+/************
+ * Decoding *
+ ************/
+
+/* Walks the terms, in order, from the start of a block. */
+typedef struct cursor {
+    terms *t;
+    ulong o;                /* next byte */
+    uint i;                 /* next term's index */
+    uint len;               /* current term's length */
+    char term[MAX_WORD_SZ + 1];
+} cursor;
+
+static u_int32_t get_int32(const unsigned char *buf, ulong o) {
+    return buf[o] | (buf[o + 1] << 8) | (buf[o + 2] << 16)
+        | ((u_int32_t) buf[o + 3] << 24);
+}
+
+static void corrupt(void) {
+    errx(1, "token.db: corrupt term dictionary, rebuild db");
+}
+
+static uint get_varint(terms *t, ulong *o) {
+    uint n = 0, shift = 0;
+    unsigned char b;
+    do {
+        if (*o >= t->len || shift > 7 * (VARINT_MAX - 1)) corrupt();
+        b = t->buf[(*o)++];
+        n |= (uint) (b & 0x7f) << shift;
+        shift += 7;
+    } while (b & 0x80);
+    return n;
+}
+
+static ulong block_offset(terms *t, uint b) {
+    ulong o = get_int32(t->buf, TERMS_HEADER_SZ + b * 4);
+    if (o >= t->len) corrupt();
+    return o;
+}
+
+static void cursor_seek(cursor *c, terms *t, uint block) {
+    c->t = t;
+    c->i = block * TERMS_BLOCK_CT;
+    c->o = 0;
+    c->len = 0;
+    c->term[0] = '\0';
+}
+
+/* Decode the next term into C->term. Returns 0 past the last one. */
+static int cursor_next(cursor *c) {
+    terms *t = c->t;
+    uint shared = 0, slen;
+    if (c->i >= t->ct) return 0;
+    if (c->i % TERMS_BLOCK_CT == 0) {
+        c->o = block_offset(t, c->i / TERMS_BLOCK_CT);
+    } else {
+        shared = get_varint(t, &c->o);
+    }
+    slen = get_varint(t, &c->o);
+    if (shared > c->len || shared + slen > MAX_WORD_SZ
+        || c->o + slen > t->len)
+        corrupt();
+    memcpy(c->term + shared, t->buf + c->o, slen);
+    c->o += slen;
+    c->len = shared + slen;
+    c->term[c->len] = '\0';
+    c->i++;
+    return 1;
+}
+
+int terms_open(terms *t, const char *buf, ulong avail) {
+    t->buf = (const unsigned char *) buf;
+    if (avail < TERMS_HEADER_SZ) return -1;
+    t->len = get_int32(t->buf, 0);
+    t->ct = get_int32(t->buf, 4);
+    t->blocks = get_int32(t->buf, 8);
+    t->grams_o = get_int32(t->buf, 12);
+    if (t->len > avail || t->len < TERMS_HEADER_SZ
+        || t->blocks != (t->ct + TERMS_BLOCK_CT - 1) / TERMS_BLOCK_CT
+        || TERMS_HEADER_SZ + (ulong) t->blocks * 4 > t->grams_o
+        || t->grams_o + 4 > t->len)
+        return -1;
+    t->grams = get_int32(t->buf, t->grams_o);
+    if (t->grams_o + 4 + (ulong) t->grams * TERMS_GRAM_ENTRY_SZ > t->len)
+        return -1;
+    return 0;
+}
+
+void terms_each(terms *t, terms_cb *cb, void *udata) {
+    cursor c;
+    cursor_seek(&c, t, 0);
+    while (cursor_next(&c)) cb(c.term, c.len, udata);
+}
+
+void terms_each_id(terms *t, h_array *ids, terms_cb *cb, void *udata) {
+    cursor c;
+    uint i, id, block = (uint) -1;
+    for (i=0; i<ids->len; i++) {
+        id = ids->hs[i];
+        if (id >= t->ct) corrupt();
+        if (id / TERMS_BLOCK_CT != block) {
+            block = id / TERMS_BLOCK_CT;
+            cursor_seek(&c, t, block);
+        }
+        while (c.i <= id) (void) cursor_next(&c);
+        cb(c.term, c.len, udata);
+    }
+}
+
+/* Start C at the last block whose first term is before KEY (or the
+ * first block), so it reaches any terms equal to KEY, or starting with
+ * it, ignoring case: they may begin at the end of that block. */
+static void seek_before(cursor *c, terms *t, const char *key) {
+    uint lo = 0, hi = t->blocks, mid;
+    while (hi - lo > 1) {
+        mid = lo + (hi - lo) / 2;
+        cursor_seek(c, t, mid);
+        (void) cursor_next(c);
+        if (fold_cmp(c->term, key) < 0) lo = mid; else hi = mid;
+    }
+    cursor_seek(c, t, lo);
+}
+
+void terms_lookup(terms *t, const char *key, int case_sensitive,
+    terms_cb *cb, void *udata) {
+    cursor c;
+    int r;
+    seek_before(&c, t, key);
+    while (cursor_next(&c)) {
+        r = fold_cmp(c.term, key);
+        if (r > 0) break;
+        if (r == 0 && (!case_sensitive || strcmp(c.term, key) == 0))
+            cb(c.term, c.len, udata);
+    }
+}
+
+void terms_prefix(terms *t, const char *prefix, int case_sensitive,
+    terms_cb *cb, void *udata) {
+    cursor c;
+    uint len = strlen(prefix);
+    int r;
+    seek_before(&c, t, prefix);
+    while (cursor_next(&c)) {
+        r = fold_ncmp(c.term, prefix, len);
+        if (r > 0) break;
+        if (r == 0 && (!case_sensitive || strncmp(c.term, prefix, len) == 0))
+            cb(c.term, c.len, udata);
+    }
+}
+
+
+/*********
+ * Globs *
+ *********/
+
+static int char_eq(unsigned char a, unsigned char b, int case_sensitive) {
+    return case_sensitive ? a == b : fold(a) == fold(b);
+}
+
+/* Match the bracket expression at *PAT (just past its '[') against C,
+ * advancing *PAT past its ']'. Returns -1 if it's unterminated. */
+static int match_class(const char **pat, unsigned char c, int case_sensitive) {
+    const unsigned char *p = (const unsigned char *) *pat;
+    int negate = 0, hit = 0;
+    unsigned char lo, hi;
+    if (*p == '!' || *p == '^') { negate = 1; p++; }
+    do {
+        if (*p == '\0') return -1;
+        lo = hi = *p++;
+        if (*p == '-' && p[1] != ']' && p[1] != '\0') {
+            hi = p[1];
+            p += 2;
+        }
+        if ((c >= lo && c <= hi) || (!case_sensitive
+                && fold(c) >= fold(lo) && fold(c) <= fold(hi)))
+            hit = 1;
+    } while (*p != ']');
+    *pat = (const char *) p + 1;
+    return hit != negate;
+}
+
+int terms_glob_match(const char *pat, const char *term, int case_sensitive) {
+    const char *p;
+    int r;
+    while (*pat != '\0') {
+        switch (*pat) {
+        case '*':
+            while (*pat == '*') pat++;
+            if (*pat == '\0') return 1;
+            do {
+                if (terms_glob_match(pat, term, case_sensitive)) return 1;
+            } while (*term++ != '\0');
+            return 0;
+        case '?':
+            if (*term == '\0') return 0;
+            pat++; term++;
+            break;
+        case '[':
+            if (*term == '\0') return 0;
+            p = pat + 1;
+            if ((r = match_class(&p, *term, case_sensitive)) == 0) return 0;
+            if (r > 0) {
+                pat = p; term++;
+                break;
+            }
+            /* FALLTHROUGH: an unterminated '[' is literal */
+        default:
+            if (*pat == '\\' && pat[1] != '\0') pat++;
+            if (!char_eq(*pat, *term, case_sensitive)) return 0;
+            pat++; term++;
+        }
+    }
+    return *term == '\0';
+}
+
+/* Userdata for glob_filter. */
+typedef struct glob_match {
+    const char *pat;
+    int case_sensitive;
+    terms_cb *cb;
+    void *udata;
+} glob_match;
+
+static void glob_filter(const char *term, uint len, void *udata) {
+    glob_match *g = (glob_match *) udata;
+    if (terms_glob_match(g->pat, term, g->case_sensitive))
+        g->cb(term, len, g->udata);
+}
+
+void terms_glob(terms *t, const char *pat, int case_sensitive,
+    terms_cb *cb, void *udata) {
+    glob_match g;
+    char prefix[MAX_WORD_SZ + 1];
+    uint i;
+    g.pat = pat;
+    g.case_sensitive = case_sensitive;
+    g.cb = cb;
+    g.udata = udata;
+    for (i=0; i < MAX_WORD_SZ && pat[i] != '\0' && !strchr("*?[\\", pat[i]); i++)
+        prefix[i] = pat[i];
+    prefix[i] = '\0';
+    terms_prefix(t, prefix, case_sensitive, glob_filter, &g);
+}
+
+
+/************
+ * Trigrams *
+ ************/
+
+/* Get the IDs of the terms containing the trigram G, as a new array. */
+static h_array *gram_ids(terms *t, u_int32_t g) {
+    uint lo = 0, hi = t->grams, mid, ct;
+    ulong e, o;
+    u_int32_t key;
+    h_array *a;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        e = t->grams_o + 4 + (ulong) mid * TERMS_GRAM_ENTRY_SZ;
+        key = get_int32(t->buf, e);
+        if (key == g) {
+            ct = get_int32(t->buf, e + 4);
+            o = get_int32(t->buf, e + 8);
+            a = h_array_new(ct > 0 ? ct : 1);
+            if (o > t->len || (ct > 0 && vbyte_decode(t->buf + o,
+                        t->len - o, ct, a->hs) == 0))
+                corrupt();
+            a->len = ct;
+            return a;
+        }
+        if (key < g) lo = mid + 1; else hi = mid;
+    }
+    return h_array_new(1);
+}
+
+h_array *terms_candidates(terms *t, char **lits, uint n) {
+    v_array *lists = v_array_new(8);
+    h_array *res = NULL;
+    uint i, j, len;
+    for (i=0; i<n; i++) {
+        len = strlen(lits[i]);
+        for (j=0; j + 3 <= len; j++)
+            v_array_append(lists, gram_ids(t, gram(lits[i] + j)));
+    }
+    if (lists->len > 0)
+        res = h_array_intersection_n((h_array **) lists->vs, lists->len);
+    for (i=0; i<lists->len; i++) h_array_free(lists->vs[i]);
+    v_array_free(lists, NULL);
+    return res;
+}
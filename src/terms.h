@@ -0,0 +1,92 @@
+#ifndef TERMS_H
+#define TERMS_H
+
+/* Term dictionaries: each token DB set's vocabulary, sorted by
+ * terms_cmp and front-coded in blocks of TERMS_BLOCK_CT terms:
+ *   [byte length/4] [term count/4] [block count/4] [trigram index offset/4]
+ *   [per block: offset from the dictionary's start/4]
+ *   [blocks]
+ *   [trigram index]
+ * A block's first term is stored whole, as [length/varint][bytes], and
+ * each one after it as [bytes shared with the term before/varint]
+ * [suffix length/varint][suffix]. Exact lookups binary search the
+ * blocks' first terms, then decode a block or two. Since terms are
+ * sorted, those with a given prefix are a single run, so prefix and
+ * glob queries are found the same way and only decode its blocks.
+ *
+ * Patterns without a literal prefix (e.g. subtokens, with -s) use the
+ * trigram index instead, which maps each three-byte substring of the
+ * terms (ignoring ASCII case) to the IDs, i.e. dictionary indices, of
+ * the terms containing it:
+ *   [trigram count/4]
+ *   [per trigram, in order: trigram/4, term count/4, offset/4]
+ *   [per trigram: its term IDs, Stream VByte-coded (see vbyte.h)]
+ * A term matching the pattern must contain all the trigrams of the
+ * literals it requires, so only the terms in the intersection of their
+ * lists are candidates. */
+
+#define TERMS_BLOCK_CT 16
+#define TERMS_HEADER_SZ 16
+#define TERMS_GRAM_ENTRY_SZ 12
+
+struct h_array;
+
+/* Dictionary order: ASCII case-folded, then bytewise, so the terms
+ * equal to a word (ignoring case) are next to each other. */
+int terms_cmp(const char *a, const char *b);
+
+/* Encode the N terms in NAMES, which must be sorted by terms_cmp and
+ * unique, into a new buffer (tag 'K'), saved in *BUF. Returns its
+ * length. */
+ulong terms_encode(char **names, uint n, char **buf);
+
+/* An encoded dictionary, read in place. */
+typedef struct terms {
+    const unsigned char *buf;
+    ulong len;
+    uint ct;                /* term count */
+    uint blocks;            /* block count */
+    ulong grams_o;          /* trigram index offset */
+    uint grams;             /* trigram count */
+} terms;
+
+/* Open the dictionary at BUF, of which at most AVAIL bytes can be
+ * read. Returns -1 if it's truncated or corrupt. */
+int terms_open(terms *t, const char *buf, ulong avail);
+
+/* Term callback. TERM is \0-terminated, and only valid during the
+ * call. */
+typedef void (terms_cb)(const char *term, uint len, void *udata);
+
+/* Call CB with each term, in order. */
+void terms_each(terms *t, terms_cb *cb, void *udata);
+
+/* Call CB with each term equal to KEY, ignoring ASCII case unless
+ * CASE_SENSITIVE. */
+void terms_lookup(terms *t, const char *key, int case_sensitive,
+    terms_cb *cb, void *udata);
+
+/* Call CB with each term starting with PREFIX, ignoring ASCII case
+ * unless CASE_SENSITIVE. Only the blocks holding them are decoded. */
+void terms_prefix(terms *t, const char *prefix, int case_sensitive,
+    terms_cb *cb, void *udata);
+
+/* Get the sorted IDs of the terms containing each of the N strings in
+ * LITS, ignoring ASCII case, as a new array. Returns NULL if none of
+ * them is long enough (three bytes) to narrow it down. */
+struct h_array *terms_candidates(terms *t, char **lits, uint n);
+
+/* Call CB with the terms with the sorted IDs in IDS, decoding only
+ * their blocks. */
+void terms_each_id(terms *t, struct h_array *ids, terms_cb *cb, void *udata);
+
+/* Does TERM match the shell-style glob PAT? PAT may use *, ?, [...]
+ * (or [!...]), and \ to quote the next character. */
+int terms_glob_match(const char *pat, const char *term, int case_sensitive);
+
+/* Call CB with each term matching the glob PAT. Only the terms starting
+ * with PAT's literal prefix (before any *, ?, or [) are read. */
+void terms_glob(terms *t, const char *pat, int case_sensitive,
+    terms_cb *cb, void *udata);
+
+#endif
@@ -3,16 +3,30 @@
 
 #include "greatest.h"
 
+extern SUITE(arena_suite);
 extern SUITE(array_suite);
+extern SUITE(docset_suite);
 extern SUITE(eta_suite);
+extern SUITE(lz_suite);
+extern SUITE(rules_suite);
 extern SUITE(set_suite);
+extern SUITE(spill_suite);
+extern SUITE(terms_suite);
+extern SUITE(vbyte_suite);
 
 GREATEST_MAIN_DEFS();
 
 int main(int argc, char **argv) {
     GREATEST_MAIN_BEGIN();
+    RUN_SUITE(arena_suite);
     RUN_SUITE(array_suite);
+    RUN_SUITE(docset_suite);
     RUN_SUITE(eta_suite);
+    RUN_SUITE(lz_suite);
+    RUN_SUITE(rules_suite);
     RUN_SUITE(set_suite);
+    RUN_SUITE(spill_suite);
+    RUN_SUITE(terms_suite);
+    RUN_SUITE(vbyte_suite);
     GREATEST_MAIN_END();
 }
@@ -0,0 +1,61 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+
+#include "glean.h"
+#include "arena.h"
+#include "set.h"
+#include "word.h"
+#include "array.h"
+
+#include "greatest.h"
+
+/* Allocations are aligned and don't overlap, and large ones get
+ * their own chunk. */
+TEST arena_allocs() {
+    arena *a = arena_new(256);
+    char *p, *q, *big;
+    p = arena_alloc(a, 3);
+    q = arena_alloc(a, 5);
+    ASSERT_EQ(0, ((uintptr_t) p) % sizeof(void *));
+    ASSERT_EQ(0, ((uintptr_t) q) % sizeof(void *));
+    ASSERT(q >= p + 3);
+    memset(p, 'p', 3);
+    big = arena_alloc(a, 1000);
+    memset(big, 'b', 1000);
+    ASSERT(arena_size(a) >= 1256);
+    /* The first chunk's free space is still used. */
+    q = arena_alloc(a, 8);
+    ASSERT(q > p && q < p + 256);
+    ASSERT_EQ('p', p[2]);
+    arena_free(a);
+    PASS();
+}
+
+/* Words interned into a set with an arena are usable, and freed with it. */
+TEST arena_word_set() {
+    arena *a = arena_new(0);
+    set *s = word_set_init(0);
+    word *w;
+    set_use_arena(s, a);
+    w = word_add(s, "arena", 5);
+    ASSERT(w->pooled);
+    h_array_append(w->a, 23);
+    word_add(s, "arena", 5);
+    ASSERT_EQ(w, word_get(s, "arena"));
+    ASSERT_EQ(2, w->count);
+    ASSERT_STR_EQ("arena", w->name);
+    ASSERT_EQ(23, h_array_get(w->a, 0));
+    ASSERT(word_known(s, "arena"));
+    ASSERT_FALSE(word_known(s, "other"));
+    set_free(s, word_free);
+    arena_free(a);
+    PASS();
+}
+
+SUITE(arena_suite) {
+    RUN_TEST(arena_allocs);
+    RUN_TEST(arena_word_set);
+}
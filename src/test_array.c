@@ -103,6 +103,84 @@ TEST h_intersection() {
     PASS();
 }
 
+/* A short array against a long one gallops, and still finds the
+ * ends of the long one. */
+TEST h_intersection_skewed() {
+    h_array *a = h_array_new(10);
+    h_array *b = h_array_new(10);
+    for (int i=0; i<100000; i++) AP(b, 3*i);
+    AP(a, 0); AP(a, 1); AP(a, 2999); AP(a, 3000); AP(a, 299997);
+    AP(a, 300000);
+
+    h_array *u = h_array_intersection(a, b);
+    ASSERT_EQ(3, h_array_length(u));
+    EXP(u, 0, 0);
+    EXP(u, 1, 3000);
+    EXP(u, 2, 299997);
+
+    h_array_free(u);
+    u = h_array_intersection(b, a);
+    ASSERT_EQ(3, h_array_length(u));
+    EXP(u, 2, 299997);
+
+    h_array_free(a);
+    h_array_free(b);
+    h_array_free(u);
+    PASS();
+}
+
+/* Similar-sized arrays, of every length mod 4, merge block by block
+ * to the same result as a naive check. */
+TEST h_intersection_blocks() {
+    static char in_a[4000], in_b[4000];
+    srandom(22);
+    for (int t=0; t<200; t++) {
+        h_array *a = h_array_new(10);
+        h_array *b = h_array_new(10);
+        int range = 20 + t * 19, ct = 0;
+        for (int i=0; i<range; i++) {
+            in_a[i] = random() % 3 == 0;
+            in_b[i] = random() % (t % 2 ? 2 : 5) == 0;
+            if (in_a[i]) AP(a, i);
+            if (in_b[i]) AP(b, i);
+        }
+        h_array *u = h_array_intersection(a, b);
+        for (int i=0; i<range; i++) {
+            if (!(in_a[i] && in_b[i])) continue;
+            ASSERT(ct < (int) h_array_length(u));
+            EXP(u, ct, i);
+            ct++;
+        }
+        ASSERT_EQ(ct, h_array_length(u));
+        h_array_free(a);
+        h_array_free(b);
+        h_array_free(u);
+    }
+    PASS();
+}
+
+TEST h_intersection_n() {
+    h_array *as[3];
+    for (int j=0; j<3; j++) as[j] = h_array_new(10);
+    for (int i=0; i<6000; i++) {
+        AP(as[0], 2*i);         /* multiples of 6 are in all three */
+        if (i < 4000) AP(as[1], 3*i);
+        if (i < 50) AP(as[2], 120*i);
+    }
+
+    h_array *u = h_array_intersection_n(as, 3);
+    ASSERT_EQ(50, h_array_length(u));
+    for (int i=0; i<50; i++) EXP(u, i, 120*i);
+    h_array_free(u);
+
+    u = h_array_intersection_n(as, 1);
+    ASSERT_EQ(6000, h_array_length(u));
+    h_array_free(u);
+
+    for (int j=0; j<3; j++) h_array_free(as[j]);
+    PASS();
+}
+
 TEST h_complement() {
     h_array *a = h_array_new(10);
     h_array *b = h_array_new(10);
@@ -196,6 +274,9 @@ SUITE(array_suite) {
     RUN_TEST(h_uniq);
     RUN_TEST(h_union);
     RUN_TEST(h_intersection);
+    RUN_TEST(h_intersection_skewed);
+    RUN_TEST(h_intersection_blocks);
+    RUN_TEST(h_intersection_n);
     RUN_TEST(h_complement);
     RUN_TEST(v_append_and_check);
     RUN_TEST(v_sort);
@@ -0,0 +1,151 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "glean.h"
+#include "array.h"
+#include "docset.h"
+
+#include "greatest.h"
+
+#define MAX_DOC (4 * 65536)
+
+static char in_a[MAX_DOC], in_b[MAX_DOC];
+
+/* Fill S and IN with random docs, densely in some containers (to make
+ * bitmaps) and sparsely in others, in random order. */
+static void fill(docset *s, char *in, long seed) {
+    uint i, doc, ct;
+    srandom(seed);
+    memset(in, 0, MAX_DOC);
+    for (i=0; i<MAX_DOC / 65536; i++) {
+        ct = random() % 2 ? 20000 : 300;
+        while (ct-- > 0) {
+            doc = i * 65536 + random() % 65536;
+            docset_add(s, doc);
+            in[doc] = 1;
+        }
+    }
+}
+
+/* S holds exactly the docs flagged in IN, in order. */
+static int matches(docset *s, char *in) {
+    h_array *a = h_array_new(4);
+    uint i, j = 0, ok = 1;
+    docset_append_to(s, a);
+    for (i=0; i<MAX_DOC && ok; i++) {
+        if (!in[i]) continue;
+        ok = j < a->len && a->hs[j++] == i && docset_has(s, i);
+    }
+    ok = ok && j == a->len && docset_count(s) == a->len;
+    h_array_free(a);
+    return ok;
+}
+
+TEST docset_add_has() {
+    docset *s = docset_new();
+    uint i;
+    fill(s, in_a, 21);
+    ASSERT(matches(s, in_a));
+    for (i=0; i<MAX_DOC; i += 7) ASSERT_EQ(in_a[i], docset_has(s, i));
+    docset_free(s);
+    PASS();
+}
+
+/* AND, OR, and AND NOT match a naive set algebra, across every mix
+ * of array and bitmap containers. */
+TEST docset_ops() {
+    docset *a, *b;
+    uint i, op;
+    for (op=0; op<3; op++) {
+        a = docset_new();
+        b = docset_new();
+        fill(a, in_a, 22 + op);
+        fill(b, in_b, 32 + op);
+        if (op == 0) docset_and(a, b);
+        if (op == 1) docset_or(a, b);
+        if (op == 2) docset_andnot(a, b);
+        for (i=0; i<MAX_DOC; i++)
+            in_a[i] = op == 0 ? in_a[i] && in_b[i]
+                : op == 1 ? in_a[i] || in_b[i] : in_a[i] && !in_b[i];
+        ASSERT(matches(a, in_a));
+        ASSERT(matches(b, in_b));
+        docset_free(a);
+        docset_free(b);
+    }
+    PASS();
+}
+
+/* Arrays of very different sizes gallop, whichever side is larger. */
+TEST docset_and_skewed() {
+    docset *a, *b;
+    uint i, side;
+    for (side=0; side<2; side++) {
+        a = docset_new();
+        b = docset_new();
+        memset(in_a, 0, MAX_DOC);
+        for (i=0; i<4000; i++) docset_add(side ? a : b, 7 * i);
+        for (i=0; i<40; i++) {
+            docset_add(side ? b : a, 700 * i + i % 2);
+            in_a[700 * i + i % 2] = (i % 2) == 0;
+        }
+        docset_and(a, b);
+        ASSERT(matches(a, in_a));
+        docset_free(a);
+        docset_free(b);
+    }
+    PASS();
+}
+
+/* Similar-sized arrays merge, by blocks and then the leftovers. */
+TEST docset_and_merge() {
+    docset *a, *b;
+    uint i, doc, len, lens[] = { 1, 7, 8, 9, 17, 64, 300, 2000 };
+    for (len=0; len<sizeof(lens) / sizeof(lens[0]); len++) {
+        a = docset_new();
+        b = docset_new();
+        memset(in_a, 0, MAX_DOC);
+        memset(in_b, 0, MAX_DOC);
+        srandom(51 + len);
+        for (i=0; i<lens[len]; i++) {
+            doc = 65536 + random() % (3 * lens[len]);
+            docset_add(a, doc);
+            in_a[doc] = 1;
+            doc = 65536 + random() % (3 * lens[len]);
+            docset_add(b, doc);
+            in_b[doc] = 1;
+        }
+        docset_and(a, b);
+        for (i=0; i<MAX_DOC; i++) in_a[i] = in_a[i] && in_b[i];
+        ASSERT(matches(a, in_a));
+        docset_free(a);
+        docset_free(b);
+    }
+    PASS();
+}
+
+TEST docset_range() {
+    docset *s = docset_new();
+    uint i, lo, hi, want;
+    fill(s, in_a, 41);
+    srandom(42);
+    for (i=0; i<2000; i++) {
+        lo = random() % MAX_DOC;
+        hi = lo + random() % (i % 2 ? 100 : 100000);
+        if (hi >= MAX_DOC) hi = MAX_DOC - 1;
+        for (want = 0; lo + want <= hi && !in_a[lo + want]; want++) ;
+        ASSERT_EQ(lo + want <= hi, docset_has_range(s, lo, hi));
+    }
+    ASSERT_FALSE(docset_has_range(s, 5, 4));
+    docset_free(s);
+    PASS();
+}
+
+SUITE(docset_suite) {
+    RUN_TEST(docset_add_has);
+    RUN_TEST(docset_ops);
+    RUN_TEST(docset_and_skewed);
+    RUN_TEST(docset_and_merge);
+    RUN_TEST(docset_range);
+}
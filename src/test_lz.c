@@ -0,0 +1,84 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "glean.h"
+#include "lz.h"
+#include "dict.h"
+
+#include "greatest.h"
+
+#define BUF_SZ 4096
+
+static unsigned char in[BUF_SZ], out[LZ_BOUND(BUF_SZ)], back[BUF_SZ];
+
+static size_t round_trip(size_t len) {
+    size_t clen = lz_compress(NULL, in, len, out, sizeof(out));
+    size_t dlen;
+    if (clen == 0) return LZ_ERROR;
+    dlen = lz_decompress(NULL, 0, out, clen, back, sizeof(back));
+    if (dlen != len || memcmp(in, back, len) != 0) return LZ_ERROR;
+    return clen;
+}
+
+/* Repetitive input shrinks, and random input survives. */
+TEST lz_round_trip() {
+    size_t i, clen;
+    for (i=0; i<BUF_SZ; i++) in[i] = "glean tokens "[i % 13];
+    clen = round_trip(BUF_SZ);
+    ASSERT(clen != LZ_ERROR);
+    ASSERT(clen < BUF_SZ / 10);
+
+    srandom(23);
+    for (i=0; i<BUF_SZ; i++) in[i] = random() & 0xff;
+    ASSERT(round_trip(BUF_SZ) != LZ_ERROR);
+    for (i=0; i<20; i++) ASSERT(round_trip(i) != LZ_ERROR);
+    PASS();
+}
+
+/* Output that won't fit is refused, not overrun. */
+TEST lz_bounds() {
+    size_t i, clen;
+    for (i=0; i<BUF_SZ; i++) in[i] = random() & 0xff;
+    ASSERT_EQ(0, lz_compress(NULL, in, BUF_SZ, out, BUF_SZ / 2));
+    clen = lz_compress(NULL, in, BUF_SZ, out, sizeof(out));
+    ASSERT(clen > 0);
+    ASSERT_EQ(LZ_ERROR, lz_decompress(NULL, 0, out, clen, back, BUF_SZ - 1));
+    ASSERT_EQ(LZ_ERROR, lz_decompress(NULL, 0, out, clen - 1, back, BUF_SZ));
+    PASS();
+}
+
+/* A dictionary trained on similar samples helps, and is needed to
+ * decompress. */
+TEST lz_dict_round_trip() {
+    static const char *dirs[] = { "/usr/src/sys/kern/", "/usr/include/net/" };
+    unsigned char samples[BUF_SZ], dict[256];
+    size_t lens[64], len = 0, dictlen, plain, clen, dlen;
+    lz_dict *d;
+    uint i;
+    for (i=0; i<64; i++) {
+        lens[i] = sprintf((char *) samples + len, "%sfile%u.c", dirs[i % 2], i);
+        len += lens[i];
+    }
+    dictlen = dict_train(samples, lens, 64, dict, sizeof(dict));
+    ASSERT(dictlen > 0 && dictlen <= sizeof(dict));
+
+    len = sprintf((char *) in, "%sother.c", dirs[1]);
+    plain = lz_compress(NULL, in, len, out, sizeof(out));
+    d = lz_dict_new(dict, dictlen);
+    clen = lz_compress(d, in, len, out, sizeof(out));
+    lz_dict_free(d);
+    ASSERT(clen > 0 && clen < plain);
+    dlen = lz_decompress(dict, dictlen, out, clen, back, sizeof(back));
+    ASSERT_EQ(len, dlen);
+    ASSERT(memcmp(in, back, len) == 0);
+    ASSERT(lz_decompress(NULL, 0, out, clen, back, sizeof(back)) == LZ_ERROR);
+    PASS();
+}
+
+SUITE(lz_suite) {
+    RUN_TEST(lz_round_trip);
+    RUN_TEST(lz_bounds);
+    RUN_TEST(lz_dict_round_trip);
+}
@@ -0,0 +1,159 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "glean.h"
+#include "rules.h"
+
+#include "greatest.h"
+
+/* greatest's ASSERT_STR_EQ takes non-const strings. */
+static char *match(rules *r, const rules_dir *rd, const char *path) {
+    return (char *) rules_match(r, rd, path);
+}
+
+static rules *defaults() {
+    rules *r = rules_new(0);
+    rules_read(r, NULL);
+    rules_compile(r);
+    return r;
+}
+
+TEST rules_defaults() {
+    rules *r = defaults();
+    ASSERT_STR_EQ("index", match(r, NULL, "/src/glean/set.c"));
+    ASSERT_STR_EQ("ignore", match(r, NULL, "/src/glean/.git/HEAD"));
+    ASSERT_STR_EQ("ignore", match(r, NULL, "/src/glean/set.c~"));
+    ASSERT_STR_EQ("ignore", match(r, NULL, "/src/.emacs"));
+    ASSERT_STR_EQ("ignore", match(r, NULL, "/music/song.mp3"));
+    ASSERT_STR_EQ("ignore", match(r, NULL, "/music/SONG.MP3"));
+    ASSERT_STR_EQ("index", match(r, NULL, "/music/song.mp3.txt"));
+    rules_free(r);
+    PASS();
+}
+
+/* The first matching rule wins, whether it's a literal suffix
+ * rule or a regex, so the order of rules must be preserved. */
+TEST rules_first_match_wins() {
+    rules *r = rules_new(0);
+    rules_add(r, "keep\\.pdf$", "index");
+    rules_add(r, "\\.pdf$", "ignore");
+    rules_add(r, "docs/", "index");
+    rules_add(r, "\\.txt$", "ignore");
+    rules_compile(r);
+    ASSERT_STR_EQ("index", match(r, NULL, "/a/keep.pdf"));
+    ASSERT_STR_EQ("ignore", match(r, NULL, "/a/drop.pdf"));
+    ASSERT_STR_EQ("ignore", match(r, NULL, "/docs/drop.pdf"));
+    ASSERT_STR_EQ("index", match(r, NULL, "/docs/keep.txt"));
+    ASSERT_STR_EQ("ignore", match(r, NULL, "/a/drop.txt"));
+    rules_free(r);
+    PASS();
+}
+
+/* Matching with cached per-directory state gives the same results. */
+TEST rules_dir_cache() {
+    rules *r = rules_new(0);
+    rules_dir rd;
+    rules_add(r, "\\.pdf$", "ignore");
+    rules_add(r, "docs/", "index");
+    rules_add(r, "/tmp/", "ignore");
+    rules_compile(r);
+    rules_dir_init(r, &rd, "/home/docs/");
+    ASSERT_STR_EQ("ignore", match(r, &rd, "/home/docs/a.pdf"));
+    ASSERT_STR_EQ("index", match(r, &rd, "/home/docs/tmp/"));
+    rules_dir_init(r, &rd, "/home/tmp/");
+    ASSERT_STR_EQ("ignore", match(r, &rd, "/home/tmp/a.c"));
+    rules_dir_init(r, &rd, "/home/src/");
+    ASSERT_EQ(-1, rd.idx);
+    ASSERT_STR_EQ("index", match(r, &rd, "/home/src/a.c"));
+    rules_free(r);
+    PASS();
+}
+
+/* A directory is only pruned if none of its files could be indexed:
+ * an earlier index rule, even one for files, keeps it. */
+TEST rules_prune() {
+    rules *r = defaults();
+    ASSERT(rules_prune_dir(r, "/src/glean/.git/"));
+    ASSERT_FALSE(rules_prune_dir(r, "/src/glean/"));
+    rules_free(r);
+
+    r = rules_new(0);
+    rules_add(r, "keepme", "index");
+    rules_add(r, "skipdir", "ignore");
+    rules_compile(r);
+    ASSERT_FALSE(rules_prune_dir(r, "/a/skipdir/"));
+    ASSERT_STR_EQ("index", match(r, NULL, "/a/skipdir/keepme.c"));
+    ASSERT_STR_EQ("ignore", match(r, NULL, "/a/skipdir/other.c"));
+    rules_free(r);
+
+    r = rules_new(0);           /* a whitelist */
+    rules_add(r, "\\.c$", "index");
+    rules_add(r, ".", "ignore");
+    rules_compile(r);
+    ASSERT_FALSE(rules_prune_dir(r, "/a/src/"));
+    ASSERT_STR_EQ("index", match(r, NULL, "/a/src/x.c"));
+    rules_free(r);
+
+    r = rules_new(0);
+    rules_add(r, "build/", "ignore");
+    rules_add(r, "\\.c$", "index");
+    rules_compile(r);
+    ASSERT(rules_prune_dir(r, "/a/build/"));
+    ASSERT_FALSE(rules_prune_dir(r, "/a/src/"));
+    rules_free(r);
+    PASS();
+}
+
+#define MATCH_THREADS 4
+#define SUFFIX_CT 64
+
+/* Match paths ending in every suffix, over and over, counting results
+ * that aren't the rules' (the even suffixes are ignored). */
+static void *match_many(void *v) {
+    rules *r = (rules *) v;
+    char path[64];
+    long bad = 0;
+    int i, j;
+    for (i=0; i<20000; i++) {
+        j = (i * 7) % (SUFFIX_CT + 1);  /* SUFFIX_CT: none match */
+        snprintf(path, sizeof(path), "/src/f%d.x%d", i, j);
+        if (strcmp(rules_match(r, NULL, path),
+                j < SUFFIX_CT && j % 2 == 0 ? "ignore" : "index") != 0)
+            bad++;
+    }
+    return (void *) bad;
+}
+
+/* Matching doesn't change the rules, so threads can share them, as the
+ * directory walker's do: suffix lookups mustn't reorder the table. */
+TEST rules_threads() {
+    rules *r = rules_new(0);
+    pthread_t ts[MATCH_THREADS];
+    char pat[32];
+    void *bad;
+    int i;
+    for (i=0; i<SUFFIX_CT; i++) {
+        snprintf(pat, sizeof(pat), "\\.x%d$", i);
+        rules_add(r, pat, i % 2 == 0 ? "ignore" : "index");
+    }
+    rules_compile(r);
+    for (i=0; i<MATCH_THREADS; i++)
+        ASSERT_EQ(0, pthread_create(&ts[i], NULL, match_many, r));
+    for (i=0; i<MATCH_THREADS; i++) {
+        ASSERT_EQ(0, pthread_join(ts[i], &bad));
+        ASSERT_EQ(0, (long) bad);
+    }
+    rules_free(r);
+    PASS();
+}
+
+SUITE(rules_suite) {
+    RUN_TEST(rules_defaults);
+    RUN_TEST(rules_first_match_wins);
+    RUN_TEST(rules_dir_cache);
+    RUN_TEST(rules_prune);
+    RUN_TEST(rules_threads);
+}
@@ -0,0 +1,80 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+
+#include "glean.h"
+#include "set.h"
+#include "word.h"
+#include "array.h"
+#include "spill.h"
+
+#include "greatest.h"
+
+static word *add_posting(set *s, char *name, hash_t fhash) {
+    word *w = word_add(s, name, strlen(name));
+    h_array_append(w->a, fhash);
+    return w;
+}
+
+/* Collected (file, word) pairs, from spill_each_by_file. */
+typedef struct pairs {
+    hash_t k[8], v[8];
+    uint ct;
+} pairs;
+
+static void collect_cb(hash_t k, hash_t v, void *udata) {
+    pairs *p = (pairs *) udata;
+    if (p->ct < 8) { p->k[p->ct] = k; p->v[p->ct] = v; }
+    p->ct++;
+}
+
+/* Postings spilled across runs are merged back in order, by word
+ * and by file. */
+TEST spill_merges_runs() {
+    set *s = word_set_init(0);
+    spill *sp = spill_new("/tmp");
+    word *a, *b, *c;
+    pairs p;
+
+    a = add_posting(s, "a", 5);
+    add_posting(s, "a", 1);
+    b = add_posting(s, "b", 2);
+    spill_words(sp, s);
+    ASSERT_EQ(0, h_array_length(a->a));
+    add_posting(s, "a", 3);
+    c = add_posting(s, "c", 4);
+    spill_merge(sp, s);
+    ASSERT_EQ(2, spill_run_count(sp));
+
+    spill_load(sp, a);
+    ASSERT_EQ(3, h_array_length(a->a));
+    ASSERT_EQ(1, h_array_get(a->a, 0));
+    ASSERT_EQ(3, h_array_get(a->a, 1));
+    ASSERT_EQ(5, h_array_get(a->a, 2));
+    spill_load(sp, b);
+    ASSERT_EQ(1, h_array_length(b->a));
+    ASSERT_EQ(2, h_array_get(b->a, 0));
+    spill_load(sp, c);
+    ASSERT_EQ(1, h_array_length(c->a));
+    ASSERT_EQ(4, h_array_get(c->a, 0));
+
+    p.ct = 0;
+    spill_each_by_file(sp, collect_cb, &p);
+    ASSERT_EQ(5, p.ct);
+    for (uint i=0; i<5; i++) ASSERT_EQ(i + 1, p.k[i]);
+    ASSERT_EQ(a->hash, p.v[0]);
+    ASSERT_EQ(b->hash, p.v[1]);
+    ASSERT_EQ(a->hash, p.v[2]);
+    ASSERT_EQ(c->hash, p.v[3]);
+    ASSERT_EQ(a->hash, p.v[4]);
+
+    spill_free(sp);
+    set_free(s, word_free);
+    PASS();
+}
+
+SUITE(spill_suite) {
+    RUN_TEST(spill_merges_runs);
+}
@@ -0,0 +1,177 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "glean.h"
+#include "array.h"
+#include "terms.h"
+
+#include "greatest.h"
+
+#define MAX_CT 200
+
+static char *names[MAX_CT];
+static char found[MAX_CT][32];
+static uint found_ct;
+
+static void note_term(const char *term, uint len, void *udata) {
+    (void) udata;
+    if (found_ct < MAX_CT && len < sizeof(found[0]))
+        memcpy(found[found_ct++], term, len + 1);
+}
+
+static int cmp_name(const void *a, const void *b) {
+    return terms_cmp(*(char **) a, *(char **) b);
+}
+
+/* Sorted, several blocks' worth of terms, with shared prefixes and
+ * words differing only in case. */
+static uint fill(char *buf) {
+    uint i, n = 0;
+    for (i=0; i<60; i++) {
+        names[n++] = buf;
+        buf += sprintf(buf, "tok%u", i * 7) + 1;
+    }
+    names[n++] = "Token"; names[n++] = "token"; names[n++] = "TOKEN";
+    names[n++] = "a"; names[n++] = "zz";
+    qsort(names, n, sizeof(char *), cmp_name);
+    return n;
+}
+
+TEST terms_round_trip() {
+    char buf[1024], *enc;
+    uint i, n = fill(buf);
+    ulong len = terms_encode(names, n, &enc);
+    terms t;
+    ASSERT_EQ(0, terms_open(&t, enc, len));
+    ASSERT_EQ(n, t.ct);
+    ASSERT_EQ(-1, terms_open(&t, enc, len - 1));
+    ASSERT_EQ(0, terms_open(&t, enc, len));
+    found_ct = 0;
+    terms_each(&t, note_term, NULL);
+    ASSERT_EQ(n, found_ct);
+    for (i=0; i<n; i++) ASSERT_STR_EQ(names[i], found[i]);
+    dealloc(enc, 'K');
+    PASS();
+}
+
+TEST terms_lookup_case() {
+    char buf[1024], *enc;
+    uint i, n = fill(buf);
+    ulong len = terms_encode(names, n, &enc);
+    terms t;
+    ASSERT_EQ(0, terms_open(&t, enc, len));
+    for (i=0; i<n; i++) {
+        found_ct = 0;
+        terms_lookup(&t, names[i], 1, note_term, NULL);
+        ASSERT_EQ(1, found_ct);
+        ASSERT_STR_EQ(names[i], found[0]);
+    }
+    found_ct = 0;
+    terms_lookup(&t, "tOkEn", 0, note_term, NULL);
+    ASSERT_EQ(3, found_ct);
+    found_ct = 0;
+    terms_lookup(&t, "tOkEn", 1, note_term, NULL);
+    ASSERT_EQ(0, found_ct);
+    found_ct = 0;
+    terms_lookup(&t, "tok8", 0, note_term, NULL);
+    terms_lookup(&t, "", 0, note_term, NULL);
+    terms_lookup(&t, "zzz", 0, note_term, NULL);
+    ASSERT_EQ(0, found_ct);
+    dealloc(enc, 'K');
+    PASS();
+}
+
+TEST terms_prefix_glob() {
+    char buf[1024], *enc;
+    uint n = fill(buf);
+    ulong len = terms_encode(names, n, &enc);
+    terms t;
+    ASSERT_EQ(0, terms_open(&t, enc, len));
+    found_ct = 0;
+    terms_prefix(&t, "tok1", 1, note_term, NULL);  /* 14, 105, ..., 196 */
+    ASSERT_EQ(15, found_ct);
+    ASSERT_STR_EQ("tok105", found[0]);
+    found_ct = 0;
+    terms_prefix(&t, "TOK", 1, note_term, NULL);
+    ASSERT_EQ(1, found_ct);
+    found_ct = 0;
+    terms_prefix(&t, "TOK", 0, note_term, NULL);
+    ASSERT_EQ(63, found_ct);
+    found_ct = 0;
+    terms_prefix(&t, "", 0, note_term, NULL);
+    ASSERT_EQ(n, found_ct);
+
+    found_ct = 0;
+    terms_glob(&t, "tok?4", 0, note_term, NULL);  /* 14, 84 */
+    ASSERT_EQ(2, found_ct);
+    ASSERT_STR_EQ("tok84", found[1]);
+    found_ct = 0;
+    terms_glob(&t, "*k[!0-9]*", 0, note_term, NULL);
+    ASSERT_EQ(3, found_ct);
+    dealloc(enc, 'K');
+
+    ASSERT(terms_glob_match("a*b?c", "aXXbYc", 1));
+    ASSERT(terms_glob_match("a[bc-e]", "aD", 0));
+    ASSERT_FALSE(terms_glob_match("a[bc-e]", "aD", 1));
+    ASSERT(terms_glob_match("a\\*", "a*", 1));
+    ASSERT_FALSE(terms_glob_match("a\\*", "ab", 1));
+    ASSERT(terms_glob_match("[ab", "[ab", 1));
+    ASSERT_FALSE(terms_glob_match("*a", "b", 1));
+    PASS();
+}
+
+/* Does NAME contain LIT, ignoring case? */
+static int has_lit(const char *name, const char *lit) {
+    uint i, n = strlen(lit);
+    for (; *name != '\0'; name++) {
+        for (i=0; i<n && name[i] != '\0'
+                 && (name[i] | 0x20) == (lit[i] | 0x20); i++) ;
+        if (i == n) return 1;
+    }
+    return 0;
+}
+
+TEST terms_trigrams() {
+    char buf[1024], *enc;
+    char *lits[][2] = { {"OKE", NULL}, {"k14", "ok"}, {"ok", "1"},
+                        {"qqq", NULL}, {"ok1", "k10"} };
+    uint i, j, k, n = fill(buf);
+    ulong len = terms_encode(names, n, &enc);
+    h_array *ids;
+    terms t;
+    ASSERT_EQ(0, terms_open(&t, enc, len));
+    for (i=0; i<sizeof(lits) / sizeof(lits[0]); i++) {
+        k = lits[i][1] ? 2 : 1;
+        ids = terms_candidates(&t, lits[i], k);
+        if (i == 2) {           /* no trigrams */
+            ASSERT_EQ(NULL, ids);
+            continue;
+        }
+        ASSERT(ids != NULL);
+        /* All literals here are one trigram long, or redundant, so
+         * the candidates are exactly the terms containing them. */
+        for (j=0, k=0; j<n; j++)
+            if (has_lit(names[j], lits[i][0])
+                && (!lits[i][1] || has_lit(names[j], lits[i][1]))) {
+                ASSERT(k < ids->len);
+                ASSERT_EQ(j, ids->hs[k++]);
+            }
+        ASSERT_EQ(k, ids->len);
+        found_ct = 0;
+        terms_each_id(&t, ids, note_term, NULL);
+        ASSERT_EQ(ids->len, found_ct);
+        for (j=0; j<found_ct; j++) ASSERT_STR_EQ(names[ids->hs[j]], found[j]);
+        h_array_free(ids);
+    }
+    dealloc(enc, 'K');
+    PASS();
+}
+
+SUITE(terms_suite) {
+    RUN_TEST(terms_round_trip);
+    RUN_TEST(terms_lookup_case);
+    RUN_TEST(terms_prefix_glob);
+    RUN_TEST(terms_trigrams);
+}
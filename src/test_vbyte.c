@@ -0,0 +1,55 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "glean.h"
+#include "vbyte.h"
+
+#include "greatest.h"
+
+#define MAX_CT 1000
+
+static hash_t in[MAX_CT], back[MAX_CT];
+static unsigned char enc[VBYTE_BOUND(MAX_CT)];
+
+static int hash_cmp(const void *a, const void *b) {
+    hash_t ha = *(hash_t *) a, hb = *(hash_t *) b;
+    return ha < hb ? -1 : ha > hb ? 1 : 0;
+}
+
+/* Every delta size, at lengths that do and don't fill control bytes,
+ * round-trips, and the encoded size is exact. */
+TEST vbyte_round_trip() {
+    uint n, i;
+    size_t len;
+    srandom(18);
+    for (n=0; n<40; n++) {
+        for (i=0; i<n; i++) in[i] = random() >> (i % 4) * 8;
+        qsort(in, n, sizeof(hash_t), hash_cmp);
+        len = vbyte_encode(in, n, enc);
+        ASSERT(len <= VBYTE_BOUND(n));
+        ASSERT_EQ(len, n == 0 ? 0 : vbyte_decode(enc, len, n, back));
+        ASSERT(memcmp(in, back, n * sizeof(hash_t)) == 0);
+    }
+    PASS();
+}
+
+/* Dense lists take about a byte per hash; truncated input is caught. */
+TEST vbyte_dense() {
+    uint i;
+    size_t len;
+    for (i=0; i<MAX_CT; i++) in[i] = 0xf0000000 + 3 * i;
+    in[MAX_CT - 1] = 0xffffffff;
+    len = vbyte_encode(in, MAX_CT, enc);
+    ASSERT(len < MAX_CT + MAX_CT / 4 + 8);
+    ASSERT_EQ(len, vbyte_decode(enc, len, MAX_CT, back));
+    ASSERT(memcmp(in, back, sizeof(in)) == 0);
+    ASSERT_EQ(0, vbyte_decode(enc, len - 1, MAX_CT, back));
+    PASS();
+}
+
+SUITE(vbyte_suite) {
+    RUN_TEST(vbyte_round_trip);
+    RUN_TEST(vbyte_dense);
+}
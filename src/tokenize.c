@@ -31,13 +31,14 @@
 #include "set.h"
 #include "word.h"
 #include "tokenize.h"
+#include "proto.h"
 
-#define BUF_SZ 64 * 1024
+#define BUF_SZ TOKENIZE_BUF_SZ
 #define DEBUG_IMB (DEBUG || 0)
 
-typedef int (scan_fun)(set *s, int ct, int *inword, int case_sensitive);
+typedef int (scan_fun)(set *s, char *buf, int ct, int *inword, int case_sensitive);
 
-static char buf[BUF_SZ];
+static char static_buf[BUF_SZ];
 
 /* Based on the first read, is the file mostly textual?
  * If the first read is really small, just assume it's ok. */
@@ -56,7 +57,7 @@ static int is_mostly_binary(size_t ct, char *buf) {
  * 
  * This (and word_hash) will need to be changed for i18n.
  * It should probably be made a config option. */
-static int scanner(set *s, int ct, int *inword, int case_sensitive) {
+static int scanner(set *s, char *buf, int ct, int *inword, int case_sensitive) {
     int i, j, last = 0;
     char c;                   /* current byte */
     int alf, diff;            /* isalpha(c) flag; diff */
@@ -82,7 +83,7 @@ static int scanner(set *s, int ct, int *inword, int case_sensitive) {
 }
 
 /* Loop over the file, reading a chunk at a time, saving every known word. */
-static int readloop(int fd, set *s, int case_sensitive,
+static int readloop(int fd, set *s, char *buf, int case_sensitive,
                     scan_fun *scan) {
     int last=0, inword=0;
     size_t ct=0, read_sz, read_offset;
@@ -93,7 +94,7 @@ static int readloop(int fd, set *s, int case_sensitive,
     if (is_mostly_binary(ct, buf)) return 1;
     
     for (;;) {
-        last = scan(s, ct, &inword, case_sensitive);
+        last = scan(s, buf, ct, &inword, case_sensitive);
         
         read_sz = BUF_SZ; read_offset = 0;
         
@@ -117,23 +118,35 @@ static int readloop(int fd, set *s, int case_sensitive,
     }
     
     if (ct == -1) err(1, "read fail");
-    word_print_and_zero(s);
     return 0;
 }
 
-/* Read file FN into set<word> S, then print every (word, count)
- * pair to stdout.*/
-void tokenize_file(const char *fn, set *s, int case_sensitive) {
+/* Read file FN into set<word> S, using the TOKENIZE_BUF_SZ-byte
+ * scratch buffer BUF. Returns 0 if tokenized, 1 if it should be skipped. */
+int tokenize_file_words(const char *fn, set *s, char *buf, int case_sensitive) {
     int fd = open(fn, O_RDONLY, 0);
     int skipped, res;
     
     if (fd == -1) {         /* warn and skip it */
         perror(fn);
-        printf(" SKIP\n");
-    } else {
-        skipped = readloop(fd, s, case_sensitive, scanner);
-        res = close(fd);
-        assert(res == 0);
+        return 1;
+    }
+    skipped = readloop(fd, s, buf, case_sensitive, scanner);
+    res = close(fd);
+    assert(res == 0);
+    return skipped;
+}
+
+/* Read file FN into set<word> S, then send every (word, count)
+ * pair to stdout, followed by an end-of-file frame. (See proto.h.)
+ * If TEXT is set, print them as "word count" lines instead. */
+void tokenize_file(const char *fn, set *s, int case_sensitive, int text) {
+    int skipped = tokenize_file_words(fn, s, static_buf, case_sensitive);
+    if (text) {
+        if (!skipped) word_print_and_zero(s);
         printf(skipped ? " SKIP\n" : " DONE\n");
+    } else {
+        if (!skipped) word_send_and_zero(s);
+        proto_put_end(stdout, skipped);
     }
 }
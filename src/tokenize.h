@@ -1,8 +1,17 @@
 #ifndef TOKENIZE_H
 #define TOKENIZE_H
 
-/* Read file FN into set<word> S, then print every (word, count)
- * pair to stdout.*/
-void tokenize_file(const char *fn, set *s, int case_sensitive);
+/* Size of the per-tokenizer read buffer. */
+#define TOKENIZE_BUF_SZ (64 * 1024)
+
+/* Read file FN into set<word> S, using the TOKENIZE_BUF_SZ-byte
+ * scratch buffer BUF. Returns 0 if tokenized, 1 if it should be skipped.
+ * Each word's count is incremented, but nothing is printed. */
+int tokenize_file_words(const char *fn, set *s, char *buf, int case_sensitive);
+
+/* Read file FN into set<word> S, then send every (word, count)
+ * pair to stdout, followed by an end-of-file frame. (See proto.h.)
+ * If TEXT is set, print them as "word count" lines instead. */
+void tokenize_file(const char *fn, set *s, int case_sensitive, int text);
 
 #endif
@@ -0,0 +1,259 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <err.h>
+#include <errno.h>
+
+#include "glean.h"
+#include "set.h"
+#include "word.h"
+#include "fname.h"
+#include "array.h"
+#include "gln_index.h"
+#include "tokenize.h"
+#include "worker.h"
+#include "spill.h"
+#include "arena.h"
+#include "tpool.h"
+
+/* In-process tokenizer pool, used instead of the gln_tokens worker
+ * processes when gln_index is run with -t.
+ *
+ * Each thread tokenizes a file into a scratch set<word> (like gln_tokens
+ * does), then folds the per-file counts into its own accumulated
+ * set<word>, noting the file's hash in each word's array. Nothing is
+ * shared between threads except the file queue, so once every
+ * thread has been joined, the accumulated sets are merged into
+ * c->word_set on the main thread. Each accumulated set allocates its
+ * words from its own arena, which is kept until the index is written,
+ * since the words are moved rather than copied.
+ *
+ * Threads claim c->q_depth files at a time from the queue (largest
+ * first, or smallest for the small-file lane). Once it's empty, an idle
+ * thread steals the back half of the unstarted files claimed by the
+ * busiest other thread.
+ *
+ * With a spill budget (-m), each thread moves its postings out to a
+ * sorted run on disk whenever it's holding more than its share. */
+
+#define FLUSH_COUNT 100         /* clear scratch set every N files */
+
+/* Per-thread tokenizer state. */
+typedef struct tok_thread {
+    pthread_t t;
+    context *c;
+    struct tok_thread *ts;      /* all threads, for stealing */
+    pthread_mutex_t lock;       /* guards lo & hi */
+    uint lo, hi;                /* claimed, unstarted c->fnames indices */
+    set *acc;                   /* accumulated words + file hashes */
+    arena *arena;               /* acc's words & links */
+    v_array *done;              /* fnames tokenized (not skipped) */
+} tok_thread;
+
+/* Userdata/closure for fold_word's set_apply. */
+typedef struct fold_udata {
+    set *acc;
+    uint doc;
+    ulong postings;             /* postings held in acc */
+} fold_udata;
+
+/* Guards c->f_ni, c->f_tail, and progress output. */
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void lock(pthread_mutex_t *m) {
+    if (pthread_mutex_lock(m) != 0) errx(1, "mutex lock");
+}
+
+static void unlock(pthread_mutex_t *m) {
+    if (pthread_mutex_unlock(m) != 0) errx(1, "mutex unlock");
+}
+
+/* Claim the next batch of enqueued files: the largest remaining,
+ * or the smallest for threads in the small-file lane.
+ * Returns 0 if none remain. */
+static int claim_batch(tok_thread *tt) {
+    context *c = tt->c;
+    uint lo, hi, n = 0;
+    int small = tt - tt->ts < c->small_ct;
+    lock(&queue_lock);
+    while (c->f_ni < c->f_tail && n < c->q_depth) {
+        worker_progress(c);
+        if (small) c->f_tail--; else c->f_ni++;
+        n++;
+    }
+    lo = small ? c->f_tail : c->f_ni - n;
+    hi = lo + n;
+    unlock(&queue_lock);
+    if (n == 0) return 0;
+    lock(&tt->lock);
+    tt->lo = lo;
+    tt->hi = hi;
+    unlock(&tt->lock);
+    return 1;
+}
+
+/* Steal the back half of the busiest other thread's unstarted files.
+ * Returns 0 if there's nothing left to steal. */
+static int steal_batch(tok_thread *tt) {
+    context *c = tt->c;
+    tok_thread *v, *victim = NULL;
+    uint i, rem, most = 0, take, lo;
+    for (i=0; i<c->w_ct; i++) {
+        v = &tt->ts[i];
+        if (v == tt) continue;
+        lock(&v->lock);
+        rem = v->hi - v->lo;
+        unlock(&v->lock);
+        if (rem > most) { most = rem; victim = v; }
+    }
+    if (victim == NULL) return 0;
+
+    lock(&victim->lock);
+    rem = victim->hi - victim->lo;  /* may have changed */
+    take = (rem + 1) / 2;
+    lo = victim->hi - take;     /* read under the lock: once it's */
+    victim->hi = lo;            /* released, the victim may reclaim */
+    unlock(&victim->lock);
+    if (take == 0) return steal_batch(tt);
+
+    lock(&tt->lock);
+    tt->lo = lo;
+    tt->hi = lo + take;
+    unlock(&tt->lock);
+    return 1;
+}
+
+/* Get the thread's next file, claiming or stealing more as necessary.
+ * Returns NULL when every file has been started. */
+static fname *next_file(tok_thread *tt) {
+    fname *fn = NULL;
+    for (;;) {
+        lock(&tt->lock);
+        if (tt->lo < tt->hi)
+            fn = (fname *) v_array_get(tt->c->fnames, tt->lo++);
+        unlock(&tt->lock);
+        if (fn) return fn;
+        if (!claim_batch(tt) && !steal_batch(tt)) return NULL;
+    }
+}
+
+/* Add a scratch word's count for the current file to the thread's
+ * accumulated words, then zero it. */
+static void fold_word(void *v, void *udata) {
+    word *w = (word *) v, *aw;
+    fold_udata *ud = (fold_udata *) udata;
+    if (w->count == 0) return;
+    aw = word_get_hashed(ud->acc, w->name, w->hash);
+    if (aw == NULL) aw = word_intern(ud->acc, w->name, strlen(w->name), 0, w->hash);
+    aw->count += w->count;
+    h_array_append(aw->a, ud->doc);
+    ud->postings++;
+    w->count = 0;
+}
+
+static void *tok_thread_main(void *v) {
+    tok_thread *tt = (tok_thread *) v;
+    context *c = tt->c;
+    set *ts = word_set_init(0);
+    char *buf = alloc(TOKENIZE_BUF_SZ, 'b');
+    fold_udata ud;
+    fname *fn;
+    int files = 0;
+
+    ud.acc = tt->acc;
+    ud.postings = 0;
+    while ((fn = next_file(tt)) != NULL) {
+        if (tokenize_file_words(fn->name, ts, buf, c->case_sensitive)) {
+            if (c->verbose >= 1) printf(" -- Skipping file %s\n", fn->name);
+            continue;
+        }
+        ud.doc = fn->id;
+        set_apply(ts, fold_word, &ud);
+        v_array_append(tt->done, fn);
+        /* Each thread gets an even share of the spill budget. */
+        if (c->spill && ud.postings >= c->spill_limit / c->w_ct) {
+            spill_words(c->spill, tt->acc);
+            ud.postings = 0;
+        }
+
+        if (++files >= FLUSH_COUNT) {
+            set_free(ts, word_free);
+            ts = word_set_init(0);
+            files = 0;
+        }
+    }
+    set_free(ts, word_free);
+    dealloc(buf, 'b');
+    return NULL;
+}
+
+/* Merge a thread's accumulated word into c->word_set, moving it over
+ * if it's new and freeing it otherwise. */
+static void merge_word(void *v, void *udata) {
+    word *w = (word *) v, *cw;
+    context *c = (context *) udata;
+    uint i;
+    c->t_occ_ct += w->count;
+    cw = word_get_hashed(c->word_set, w->name, w->hash);
+    if (cw == NULL) {
+        if (set_store(c->word_set, w) == TABLE_SET_FAIL)
+            err(1, "set_store failure");
+        c->t_ct++;
+    } else {
+        cw->count += w->count;
+        for (i=0; i<h_array_length(w->a); i++)
+            h_array_append(cw->a, h_array_get(w->a, i));
+        word_free(w);
+    }
+}
+
+/* Tokenize every enqueued file in-process, on a pool of c->w_ct threads,
+ * then merge each thread's words into c->word_set. Returns <0 on error. */
+int tpool_tokenize_all(context *c) {
+    tok_thread *ts = alloc(sizeof(tok_thread) * c->w_ct, 'T');
+    int i, res;
+    uint j;
+
+    for (i=0; i<c->w_ct; i++) {
+        ts[i].lo = ts[i].hi = 0;
+        if (pthread_mutex_init(&ts[i].lock, NULL) != 0) errx(1, "mutex init");
+    }
+    for (i=0; i<c->w_ct; i++) {
+        ts[i].c = c;
+        ts[i].ts = ts;
+        ts[i].acc = word_set_init(0);
+        ts[i].arena = arena_new(0);
+        set_use_arena(ts[i].acc, ts[i].arena);
+        v_array_append(c->arenas, ts[i].arena);
+        ts[i].done = v_array_new(16);
+        res = pthread_create(&ts[i].t, NULL, tok_thread_main, &ts[i]);
+        if (res != 0) {
+            errno = res;
+            warn("pthread_create");
+            return -1;
+        }
+    }
+
+    for (i=0; i<c->w_ct; i++) {
+        res = pthread_join(ts[i].t, NULL);
+        if (res != 0) {
+            errno = res;
+            warn("pthread_join");
+            return -1;
+        }
+        if (c->show_progress && c->verbose)
+            fprintf(stderr, "-- Merging words from thread %d\n", i);
+        set_apply(ts[i].acc, merge_word, c);
+        set_free(ts[i].acc, NULL);
+        for (j=0; j<v_array_length(ts[i].done); j++)
+            fname_add(c->fn_set, v_array_get(ts[i].done, j));
+        v_array_free(ts[i].done, NULL);
+    }
+    for (i=0; i<c->w_ct; i++) pthread_mutex_destroy(&ts[i].lock);
+    dealloc(ts, 'T');
+    return 0;
+}
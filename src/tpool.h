@@ -0,0 +1,8 @@
+#ifndef TPOOL_H
+#define TPOOL_H
+
+/* Tokenize every enqueued file in-process, on a pool of c->w_ct threads,
+ * then merge each thread's words into c->word_set. Returns <0 on error. */
+int tpool_tokenize_all(context *c);
+
+#endif
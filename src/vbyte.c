@@ -0,0 +1,128 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+
+/* On x86 with GCC or Clang, decode with SSSE3 when the CPU has it. */
+#if (defined(__GNUC__) || defined(__clang__)) \
+    && (defined(__x86_64__) || defined(__i386__))
+#define VBYTE_SSSE3 1
+#include <tmmintrin.h>
+#define TARGET_SSSE3 __attribute__((target("ssse3")))
+#else
+#define VBYTE_SSSE3 0
+#endif
+
+#include "glean.h"
+#include "vbyte.h"
+
+/* Byte length (1-4) of the Ith delta, from the control bytes. */
+#define CODE_LEN(ctrl, i) ((((ctrl)[(i) >> 2] >> (2 * ((i) & 3))) & 3) + 1)
+
+size_t vbyte_encode(const hash_t *in, uint n, unsigned char *out) {
+    unsigned char *ctrl = out, *op = out + (n + 3) / 4;
+    hash_t prev = 0, d;
+    uint i, len;
+    memset(ctrl, 0, (n + 3) / 4);
+    for (i=0; i<n; i++) {
+        d = in[i] - prev;
+        prev = in[i];
+        len = d < (1U << 8) ? 1 : d < (1U << 16) ? 2 : d < (1U << 24) ? 3 : 4;
+        ctrl[i >> 2] |= (len - 1) << (2 * (i & 3));
+        do {
+            *op++ = d & 0xff;
+            d >>= 8;
+        } while (--len > 0);
+    }
+    return op - out;
+}
+
+/* Read a LEN-byte little-endian delta at IP, which has at least
+ * AVAIL bytes readable. */
+static hash_t read_delta(const unsigned char *ip, uint len, size_t avail) {
+    static const hash_t masks[] = { 0xff, 0xffff, 0xffffff, 0xffffffff };
+    hash_t d = 0;
+    uint b;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    if (avail >= 4) {
+        memcpy(&d, ip, 4);
+        return d & masks[len - 1];
+    }
+#endif
+    (void) masks;
+    for (b = 0; b < len; b++) d |= (hash_t) ip[b] << (8 * b);
+    return d;
+}
+
+/* Decode deltas START..N-1 one at a time, continuing from PREV. */
+static const unsigned char *decode_scalar(const unsigned char *ctrl,
+        const unsigned char *ip, const unsigned char *end,
+        uint start, uint n, hash_t prev, hash_t *out) {
+    uint i, len;
+    for (i=start; i<n; i++) {
+        len = CODE_LEN(ctrl, i);
+        if (len > end - ip) return NULL;
+        prev += read_delta(ip, len, end - ip);
+        ip += len;
+        out[i] = prev;
+    }
+    return ip;
+}
+
+#if VBYTE_SSSE3
+/* For each control byte, a shuffle that spreads its four deltas' bytes
+ * out to 32-bit lanes, and their total length. */
+static unsigned char shuffles[256][16];
+static unsigned char lengths[256];
+static int simd_ok = -1;       /* does the CPU have SSSE3? */
+
+static void init_tables(void) {
+    uint c, i, b, len, o;
+    for (c=0; c<256; c++) {
+        for (i=0, o=0; i<4; i++) {
+            len = ((c >> (2 * i)) & 3) + 1;
+            for (b=0; b<4; b++) shuffles[c][4*i + b] = b < len ? o + b : 0x80;
+            o += len;
+        }
+        lengths[c] = o;
+    }
+}
+
+/* Decode four deltas per control byte, while a whole 16-byte load fits
+ * in the input. Returns how many hashes were decoded. */
+TARGET_SSSE3 static uint decode_simd(const unsigned char *ctrl, const unsigned char **ipp,
+        const unsigned char *end, uint n, hash_t *out) {
+    const unsigned char *ip = *ipp;
+    __m128i v, prev = _mm_setzero_si128();
+    uint i;
+    for (i=0; i + 4 <= n && end - ip >= 16; i += 4) {
+        v = _mm_loadu_si128((const __m128i *) ip);
+        v = _mm_shuffle_epi8(v,
+            _mm_loadu_si128((const __m128i *) shuffles[ctrl[i >> 2]]));
+        v = _mm_add_epi32(v, _mm_slli_si128(v, 4));     /* prefix sum */
+        v = _mm_add_epi32(v, _mm_slli_si128(v, 8));
+        v = _mm_add_epi32(v, prev);
+        _mm_storeu_si128((__m128i *) (out + i), v);
+        prev = _mm_shuffle_epi32(v, 0xff);
+        ip += lengths[ctrl[i >> 2]];
+    }
+    *ipp = ip;
+    return i;
+}
+#endif
+
+size_t vbyte_decode(const unsigned char *in, size_t len, uint n, hash_t *out) {
+    const unsigned char *ctrl = in, *ip = in + (n + 3) / 4, *end = in + len;
+    uint i = 0;
+    if ((n + 3) / 4 > len) return 0;
+#if VBYTE_SSSE3
+    if (simd_ok == -1) {
+        __builtin_cpu_init();
+        if ((simd_ok = __builtin_cpu_supports("ssse3") != 0)) init_tables();
+    }
+    if (simd_ok) i = decode_simd(ctrl, &ip, end, n, out);
+#endif
+    ip = decode_scalar(ctrl, ip, end, i, n, i > 0 ? out[i - 1] : 0, out);
+    return ip == NULL ? 0 : ip - in;
+}
@@ -0,0 +1,25 @@
+#ifndef VBYTE_H
+#define VBYTE_H
+
+/* Stream VByte coding for sorted lists of hashes (postings).
+ *
+ * The list is delta-coded, and each delta is stored in 1 to 4 bytes,
+ * with the lengths kept apart from the data as 2-bit codes, four to a
+ * control byte: [control bytes/(N+3)/4][deltas]. Keeping the lengths
+ * separate lets the decoder unpack four deltas at once with a single
+ * shuffle, on x86 CPUs with SSSE3. Decoding isn't thread-safe until
+ * the first call has returned. */
+
+/* Worst-case encoded size of N hashes. */
+#define VBYTE_BOUND(n) (((n) + 3) / 4 + 4 * (n))
+
+/* Encode the N hashes at IN, which should be sorted (unsorted input
+ * still round-trips, but encodes poorly), into OUT. Returns the
+ * encoded length. */
+size_t vbyte_encode(const hash_t *in, uint n, unsigned char *out);
+
+/* Decode N hashes from the LEN bytes at IN into OUT. Returns how many
+ * bytes were read, or 0 if the input is truncated. */
+size_t vbyte_decode(const unsigned char *in, size_t len, uint n, hash_t *out);
+
+#endif
@@ -0,0 +1,258 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <err.h>
+#include <errno.h>
+
+#include "glean.h"
+#include "set.h"
+#include "word.h"
+#include "fname.h"
+#include "array.h"
+#include "gln_index.h"
+#include "rules.h"
+#include "filter.h"
+#include "walk.h"
+
+/* Built-in directory walker, used by gln_index to find the files to index
+ * (rather than reading the output of "find $ROOT -type f").
+ *
+ * A pool of threads shares a stack of directories still to be read. Each
+ * thread takes a directory, reads its entries, pushes its subdirectories,
+ * and enqueues its regular files. Symlinks are not followed, like find.
+ * Subdirectories are checked against the filter (as "path/") before being
+ * pushed, so ignored trees such as .git/ are pruned whole rather than
+ * listed file by file, as long as no earlier rule could index a file in
+ * them. Directory paths are kept with a trailing '/'. */
+
+/* A directory still to be read. */
+typedef struct walk_dir {
+    char *path;
+    struct walk_dir *next;
+} walk_dir;
+
+/* Shared walker state. */
+typedef struct walker {
+    context *c;
+    pthread_mutex_t lock;   /* guards everything below, c->fnames & c->seen */
+    pthread_cond_t cv;      /* signalled when dirs are pushed, or at end */
+    walk_dir *stack;        /* directories to read */
+    uint pending;           /* directories pushed but not yet finished */
+    uint ct;                /* files enqueued */
+} walker;
+
+static void lock(pthread_mutex_t *m) {
+    if (pthread_mutex_lock(m) != 0) errx(1, "mutex lock");
+}
+
+static void unlock(pthread_mutex_t *m) {
+    if (pthread_mutex_unlock(m) != 0) errx(1, "mutex unlock");
+}
+
+/* Join directory path DIR and entry NAME into a new string. */
+static char *join_path(const char *dir, const char *name) {
+    size_t dlen = strlen(dir), nlen = strlen(name);
+    int slash = (dlen > 0 && dir[dlen - 1] == '/') ? 0 : 1;
+    char *p = alloc(dlen + slash + nlen + 1, 'n');
+    memcpy(p, dir, dlen);
+    if (slash) p[dlen] = '/';
+    memcpy(p + dlen + slash, name, nlen + 1);
+    return p;
+}
+
+/* Push PATH onto the directory stack. Takes ownership of PATH.
+ * Must be called with the lock held. */
+static void push_dir(walker *wk, char *path) {
+    walk_dir *d = alloc(sizeof(*d), 'D');
+    d->path = path;
+    d->next = wk->stack;
+    wk->stack = d;
+    wk->pending++;
+    if (pthread_cond_signal(&wk->cv) != 0) errx(1, "cond signal");
+}
+
+/* Pop the next directory to read, blocking until one is available.
+ * Returns NULL once every directory has been finished. */
+static walk_dir *pop_dir(walker *wk) {
+    walk_dir *d;
+    lock(&wk->lock);
+    while (wk->stack == NULL && wk->pending > 0)
+        if (pthread_cond_wait(&wk->cv, &wk->lock) != 0) errx(1, "cond wait");
+    d = wk->stack;
+    if (d) wk->stack = d->next;
+    unlock(&wk->lock);
+    return d;
+}
+
+/* Note that a popped directory has been read; wake everyone at the end. */
+static void finish_dir(walker *wk) {
+    lock(&wk->lock);
+    if (--wk->pending == 0)
+        if (pthread_cond_broadcast(&wk->cv) != 0) errx(1, "cond broadcast");
+    unlock(&wk->lock);
+}
+
+/* Push the directory at DPATH (ending in '/', so patterns for directory
+ * contents such as "\.git/" match it) unless the filter ignores all of
+ * it. Takes ownership of DPATH. */
+static void add_dir(walker *wk, char *dpath) {
+    context *c = wk->c;
+    if (filter_should_prune(c, dpath)) {
+        if (c->verbose || DEBUG) fprintf(stderr, "Pruning: %s\n", dpath);
+        dealloc(dpath, 'n');
+        return;
+    }
+    lock(&wk->lock);
+    push_dir(wk, dpath);
+    unlock(&wk->lock);
+}
+
+/* Drop the file at PATH, which the filter ignores. When updating, it
+ * is neither seen nor enqueued, so its postings are tombstoned. Takes
+ * ownership of PATH. */
+static void skip_file(walker *wk, char *path) {
+    if (wk->c->verbose || DEBUG) fprintf(stderr, "Ignoring: %s\n", path);
+    dealloc(path, 'n');
+}
+
+/* Enqueue the file at PATH, of SIZE bytes. Takes ownership of PATH. */
+static void add_file(walker *wk, char *path, ulong size) {
+    context *c = wk->c;
+    fname *fn;
+    fn = alloc(sizeof(*fn), 'f');
+    fn->name = path;
+    fn->size = size;
+    fn->id = 0;
+    lock(&wk->lock);
+    v_array_append(c->fnames, fn);
+    if (c->verbose > 1) fprintf(stderr, "Appended: %d %s\n",
+        v_array_length(c->fnames), fn->name);
+    if (++wk->ct % ENQUEUE_PROGRESS_CT == 0)
+        fprintf(stderr, "%u files enqueued so far...\n", wk->ct);
+    unlock(&wk->lock);
+}
+
+/* Note an unchanged file at PATH, so its postings aren't tombstoned.
+ * Only for files the filter keeps: one that a new rule ignores goes to
+ * skip_file instead. Takes ownership of PATH. */
+static void add_unchanged(walker *wk, char *path) {
+    hash_t fhash = word_hash(path);
+    lock(&wk->lock);
+    h_array_append(wk->c->seen, fhash);
+    unlock(&wk->lock);
+    dealloc(path, 'n');
+}
+
+/* When updating, has the file been unchanged since the last index? */
+static int unchanged(context *c, struct stat *sb) {
+    if (!c->update) return 0;
+    return sb->st_mtime < c->since
+        || (sb->st_mtime == c->since && MTIME_NSEC(sb) < c->since_nsec);
+}
+
+/* Read the directory at D->path, pushing subdirectories & adding files. */
+static void read_dir(walker *wk, walk_dir *d) {
+    struct dirent *de;
+    struct stat sb;
+    rules_dir rd;
+    char *path;
+    int fd, type;
+    DIR *dir;
+
+    fd = openat(AT_FDCWD, d->path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    if (fd == -1 || (dir = fdopendir(fd)) == NULL) {
+        warn("%s", d->path);
+        if (fd != -1) close(fd);
+        return;
+    }
+    rules_dir_init(wk->c->rules, &rd, d->path);
+
+    while ((de = readdir(dir)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+        path = join_path(d->path, de->d_name);
+        type = de->d_type;
+        sb.st_size = 0;
+
+        /* Directories need no stat, unless d_type is unknown; files
+         * are stat'd relative to the open directory, for their size. */
+        if (type == DT_UNKNOWN || type == DT_REG) {
+            if (fstatat(dirfd(dir), de->d_name, &sb, AT_SYMLINK_NOFOLLOW) == -1) {
+                warn("%s", path);
+                dealloc(path, 'n');
+                continue;
+            }
+            if (S_ISDIR(sb.st_mode)) type = DT_DIR;
+            else if (S_ISREG(sb.st_mode)) type = DT_REG;
+        }
+
+        if (type == DT_DIR) {
+            add_dir(wk, join_path(path, ""));
+            dealloc(path, 'n');
+        } else if (type == DT_REG && filter_should_skip(wk->c, &rd, path)) {
+            skip_file(wk, path);
+        } else if (type == DT_REG && unchanged(wk->c, &sb)) {
+            add_unchanged(wk, path);
+        } else if (type == DT_REG) {
+            add_file(wk, path, sb.st_size);
+        } else {
+            dealloc(path, 'n');
+        }
+    }
+    if (closedir(dir) == -1) err(1, "closedir");
+}
+
+static void *walk_thread_main(void *v) {
+    walker *wk = (walker *) v;
+    walk_dir *d;
+    while ((d = pop_dir(wk)) != NULL) {
+        read_dir(wk, d);
+        dealloc(d->path, 'n');
+        dealloc(d, 'D');
+        finish_dir(wk);
+    }
+    return NULL;
+}
+
+/* Walk the tree under c->root with c->w_ct threads, appending every
+ * regular file the filter doesn't ignore to c->fnames.
+ * Returns the number of files enqueued, or <0 on error. */
+int walk_tree(context *c) {
+    pthread_t *ts = alloc(sizeof(pthread_t) * c->w_ct, 'T');
+    walker wk;
+    int i, res;
+
+    wk.c = c;
+    wk.stack = NULL;
+    wk.pending = wk.ct = 0;
+    if (pthread_mutex_init(&wk.lock, NULL) != 0) errx(1, "mutex init");
+    if (pthread_cond_init(&wk.cv, NULL) != 0) errx(1, "cond init");
+    push_dir(&wk, join_path(c->root, ""));
+
+    for (i=0; i<c->w_ct; i++) {
+        res = pthread_create(&ts[i], NULL, walk_thread_main, &wk);
+        if (res != 0) {
+            errno = res;
+            err(1, "pthread_create");
+        }
+    }
+    for (i=0; i<c->w_ct; i++) {
+        res = pthread_join(ts[i], NULL);
+        if (res != 0) {
+            errno = res;
+            err(1, "pthread_join");
+        }
+    }
+    assert(wk.stack == NULL && wk.pending == 0);
+    pthread_cond_destroy(&wk.cv);
+    pthread_mutex_destroy(&wk.lock);
+    dealloc(ts, 'T');
+    return wk.ct;
+}
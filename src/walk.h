@@ -0,0 +1,9 @@
+#ifndef WALK_H
+#define WALK_H
+
+/* Walk the tree under c->root with c->w_ct threads, appending every
+ * regular file the filter doesn't ignore to c->fnames.
+ * Returns the number of files enqueued, or <0 on error. */
+int walk_tree(context *c);
+
+#endif
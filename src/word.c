@@ -10,6 +10,8 @@
 #include "word.h"
 #include "tokenize.h"
 #include "array.h"
+#include "proto.h"
+#include "arena.h"
 
 /* 113, 139, 173 all seem to work well - they're relatively prime to
  * bytes used in hashed data. */
@@ -25,7 +27,7 @@ hash_t word_hash(char *w) {
 }
 
 static hash_t hash_cb(void *v) {
-    return word_hash(((word *)v)->name);
+    return ((word *)v)->hash;
 }
 
 static int cmp_cb(void *a, void *b) {
@@ -42,13 +44,22 @@ set *word_set_init(int sz_factor) {
 /* Create a new word from the LEN-byte string at W,
  * with starting count COUNT. */
 word *word_new(char *w, size_t len, uint count) {
+    word *ws = word_new_hashed(w, len, count, 0);
+    ws->hash = word_hash(ws->name);
+    return ws;
+}
+
+/* Same as word_new, but with an already-known word_hash of W. */
+word *word_new_hashed(char *w, size_t len, uint count, hash_t hash) {
     word *ws = alloc(sizeof(word), 'w');
     char *nbuf = alloc(len + 1, 'n');
     assert(len > 0);
     strncpy(nbuf, w, len);
     nbuf[len] = '\0';
     ws->name = nbuf;
+    ws->hash = hash;
     ws->stop = 0;
+    ws->pooled = 0;
     ws->a = h_array_new(2);
     assert(ws->a);
     ws->count = count;
@@ -57,32 +68,63 @@ word *word_new(char *w, size_t len, uint count) {
     return ws;
 }
 
-/* Free a word. */
+/* Allocate a word in a single block from arena A. */
+static word *word_new_pooled(arena *a, char *w, size_t len, uint count, hash_t hash) {
+    word *ws = arena_alloc(a, sizeof(word) + sizeof(h_array) + len + 1);
+    assert(len > 0);
+    ws->a = (h_array *) (ws + 1);
+    ws->name = (char *) (ws->a + 1);
+    memcpy(ws->name, w, len);
+    ws->name[len] = '\0';
+    ws->hash = hash;
+    ws->stop = 0;
+    ws->pooled = 1;
+    h_array_init(ws->a, 2);
+    ws->count = count;
+    return ws;
+}
+
+/* Create a new word and store it in the set<word> S, allocating
+ * from S's arena if it has one. */
+word *word_intern(set *s, char *w, size_t len, uint count, hash_t hash) {
+    word *nw;
+    if (s->arena) {
+        nw = word_new_pooled(s->arena, w, len, count, hash);
+    } else {
+        nw = word_new_hashed(w, len, count, hash);
+    }
+    if (set_store(s, nw) == TABLE_SET_FAIL) err(1, "set_store failure");
+    return nw;
+}
+
+/* Free a word. (For one from an arena, only its postings.) */
 void word_free(void *v) {
     word *w = (word *)v;
     assert(w); assert(w->name);
-    free(w->name);
+    if (w->pooled) {
+        h_array_release(w->a);
+        return;
+    }
+    dealloc(w->name, 'n');
     if (w->a) h_array_free(w->a);
-    free(w);
+    dealloc(w, 'w');
 }
 
 /* Add an occurance of a word to the known words, allocating it if necessary. */
 word *word_add(set *s, char *w, size_t len) {
     char wbuf[MAX_WORD_SZ];
     word *nw;
-    int res;
+    hash_t h;
     
     assert(len > 0);
     strncpy(wbuf, w, len);
     wbuf[len] = '\0';
-    nw = word_get(s, wbuf);
+    h = word_hash(wbuf);
+    nw = word_get_hashed(s, wbuf, h);
     if (nw == NULL) {             /* nonexistent */
-        nw = word_new(wbuf, len, 1);
+        nw = word_intern(s, wbuf, len, 1, h);
         if (DEBUG)
             fprintf(stderr, "-- Adding word %s (%lu) -> %s\n", wbuf, len, nw->name);
-        res = set_store(s, nw);
-        if (res == TABLE_SET_FAIL)
-            err(1, "set_store failure");
     } else if (nw->count == 0) {    /* present but cleared */
         nw->count = 1;
     } else {
@@ -93,8 +135,14 @@ word *word_add(set *s, char *w, size_t len) {
 
 /* Get the interned data for a word. */
 word *word_get(set *s, char *wname) {
+    return word_get_hashed(s, wname, word_hash(wname));
+}
+
+/* Get the interned data for a word whose word_hash is already known. */
+word *word_get_hashed(set *s, char *wname, hash_t hash) {
     word w, *res;
     w.name = wname;
+    w.hash = hash;
     res = (word*)set_get(s, &w);
     if (res != NULL) {
         if (DEBUG) fprintf(stderr, "Expected: %s\tGOT: %p, %p, %s\n",
@@ -116,5 +164,16 @@ static void print_and_zero(void *v, void *unused) {
     w->count = 0;
 }
 
-/* Print known words & location flags, clearing the flags along the way. */
+/* Print known words & counts, clearing the counts along the way. */
 void word_print_and_zero(set *s) { set_apply(s, print_and_zero, NULL); }
+
+/* Send each (word, count) pair and zero their counts. */
+static void send_and_zero(void *v, void *unused) {
+    word *w = (word *)v;
+    if (w->count > 0)
+        proto_put_word(stdout, w->name, strlen(w->name), w->hash, w->count);
+    w->count = 0;
+}
+
+/* Send known words & counts, clearing the counts along the way. */
+void word_send_and_zero(set *s) { set_apply(s, send_and_zero, NULL); }
@@ -4,8 +4,10 @@
 /* Word (token) and its metadata. */
 typedef struct word {
     char *name;                 /* internal copy of word string */
+    hash_t hash;                /* word_hash(name), computed once */
     uint count;                 /* word occurrence count */
     short stop;                 /* is it a stop word? */
+    short pooled;               /* allocated from a set's arena? */
     struct h_array *a;          /* array of occurrence hashes */
 } word;
 
@@ -20,7 +22,15 @@ set *word_set_init(int sz_factor);
  * with starting count COUNT. */
 word *word_new(char *w, size_t len, uint count);
 
-/* Free a word. */
+/* Same as word_new, but with an already-known word_hash of W. */
+word *word_new_hashed(char *w, size_t len, uint count, hash_t hash);
+
+/* Create a new word like word_new_hashed, and store it in the set<word>
+ * S. If S has an arena, the word, its name, and its array header are
+ * all allocated from it at once. */
+word *word_intern(set *s, char *w, size_t len, uint count, hash_t hash);
+
+/* Free a word. (For one from an arena, only its postings.) */
 void word_free(void *w);
 
 /* Add an occurance to the set<word>, allocating if necessary. */
@@ -29,10 +39,17 @@ word *word_add(set *s, char *w, size_t len);
 /* Get the interned data for a word. */
 word *word_get(set *s, char *wname);
 
+/* Get the interned data for a word whose word_hash is already known. */
+word *word_get_hashed(set *s, char *wname, hash_t hash);
+
 /* Is a word already in the set? */
 int word_known(set *s, char *wname);
 
 /* Print each (word, count) pair and zero their counts. */
 void word_print_and_zero(set *s);
 
+/* Send each (word, count) pair to stdout as a proto.h word frame,
+ * and zero their counts. */
+void word_send_and_zero(set *s);
+
 #endif
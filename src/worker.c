@@ -7,6 +7,7 @@
 #include <fcntl.h>
 #include <sys/socket.h>
 #include <sys/param.h>
+#include <sys/select.h>
 #include <err.h>
 #include <errno.h>
 
@@ -18,6 +19,18 @@
 #include "array.h"
 #include "gln_index.h"
 #include "worker.h"
+#include "spill.h"
+#include "proto.h"
+
+/* On Linux, wait for worker output (and, with input pending for a
+ * worker, for room to send it) with edge-triggered epoll; elsewhere,
+ * fall back on select. */
+#if defined(__linux__)
+#define USE_EPOLL 1
+#include <sys/epoll.h>
+#else
+#define USE_EPOLL 0
+#endif
 
 /* Start a tokenizer coprocess, setting its stdin & stdout to the socket. */
 static int worker_start(int fd, int case_sensitive) {
@@ -49,35 +62,115 @@ static int worker_init(context *c, worker *w) {
             return -1;
     } else {
         w->s = pair[0];
-        w->fname = NULL;
+        w->q = alloc(sizeof(inflight) * c->q_depth, 'q');
+        w->q_head = w->q_ct = 0;
         w->off = 0;
+        w->doc = 0;
         w->buf = alloc(sizeof(char) * (BUF_SZ+1), 'b');
+        w->out = NULL;
+        w->out_len = w->out_sz = 0;
     }
     return 0;
 }
 
 /* Initialize all worker sub-processes. Returns <0 on error. */
 int worker_init_all(context *c) {
-    worker *ws = alloc(sizeof(worker) * c->w_ct, 'w');
+    worker *ws = alloc(sizeof(worker) * c->w_ct, 'q');
     uint i, max_sock = 0;
+#if USE_EPOLL
+    struct epoll_event ev;
+#endif
     c->ws = ws;
     c->w_avail = c->w_ct;
     c->w_busy = 0;
+#if USE_EPOLL
+    if ((c->epfd = epoll_create(c->w_ct)) == -1) err(1, "epoll_create");
+#endif
     for (i=0; i < c->w_ct; i++) {
         if (worker_init(c, &c->ws[i]) < 0) return -1;
         if (c->ws[i].s > max_sock) max_sock = c->ws[i].s;
+#if USE_EPOLL
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.u32 = i;
+        if (epoll_ctl(c->epfd, EPOLL_CTL_ADD, c->ws[i].s, &ev) == -1)
+            err(1, "epoll_ctl");
+#endif
     }
     c->max_w_socket = max_sock;
     return 0;
 }
 
-/* Try to assign a file to an unoccupied worker, return 1 on success. */
-static int assign_file(context *c) {
-    fname *fn = (fname *) v_array_get(c->fnames, c->f_ni);
-    worker *w;
-    uint i, len, len2;
+/* The file worker W is currently tokenizing, or NULL if idle. */
+static inflight *cur_file(worker *w) {
+    return w->q_ct == 0 ? NULL : &w->q[w->q_head];
+}
+
+/* Have epoll report when worker WID's socket is writable (ON), or stop.
+ * (select is just given the sockets with output pending.) */
+static void watch_output(context *c, int wid, int on) {
+#if USE_EPOLL
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLET | (on ? EPOLLOUT : 0);
+    ev.data.u32 = wid;
+    if (epoll_ctl(c->epfd, EPOLL_CTL_MOD, c->ws[wid].s, &ev) == -1)
+        err(1, "epoll_ctl");
+#else
+    (void) c; (void) wid; (void) on;
+#endif
+}
+
+/* Write as much of the LEN bytes at BUF to worker W's socket as it
+ * takes without blocking. Returns how many were written. */
+static uint write_some(worker *w, const char *buf, uint len) {
+    ssize_t sz;
+    uint o = 0;
+    while (o < len) {
+        sz = write(w->s, buf + o, len - o);
+        if (sz > 0) {
+            o += sz;
+        } else if (sz == -1 && errno == EINTR) {
+            errno = 0;
+        } else if (sz == -1 && errno == EAGAIN) {
+            errno = 0;
+            break;
+        } else {
+            err(1, "worker write fail");
+        }
+    }
+    return o;
+}
+
+/* Send the LEN bytes at BUF to worker W, after any output still
+ * pending. Whatever its socket won't take now is kept in w->out, and
+ * sent once it's writable (by flush_output). */
+static void send_bytes(context *c, worker *w, const char *buf, uint len) {
+    uint sent = w->out_len == 0 ? write_some(w, buf, len) : 0;
+    if (sent == len) return;
+    if (w->out_len + len - sent > w->out_sz) {
+        w->out_sz = 2 * (w->out_len + len - sent);
+        w->out = ralloc(w->out, w->out_sz, 'b');
+    }
+    memcpy(w->out + w->out_len, buf + sent, len - sent);
+    if (w->out_len == 0) watch_output(c, w - c->ws, 1);
+    w->out_len += len - sent;
+}
+
+/* Send worker WID's pending output, as far as its socket takes it. */
+static void flush_output(context *c, int wid) {
+    worker *w = &c->ws[wid];
+    uint sent = write_some(w, w->out, w->out_len);
+    w->out_len -= sent;
+    memmove(w->out, w->out + sent, w->out_len);
+    if (w->out_len == 0) watch_output(c, wid, 0);
+}
+
+/* Send filename FN to worker W, adding it to W's in-flight queue. */
+static void send_file(context *c, worker *w, fname *fn) {
+    uint len;
     char fnbuf[PATH_MAX + 1]; /* for add'l \n */
+    inflight *inf;
     assert(fn);
+    assert(w->q_ct < c->q_depth);
     
     /* add a line break, since workers' IO is line-based */
     len = strlen(fn->name);
@@ -85,35 +178,83 @@ static int assign_file(context *c) {
         fprintf(stderr, "snprintf error\n");
         exit(EXIT_FAILURE);
     }
-    if (c->verbose) printf(" -- Starting file %s (0x%0x8)\n",
-        fn->name, word_hash(fn->name));
-
-    int w_ct = c->w_ct;
-    for (i=0; i<w_ct; i++) {
-        int w_id = (i + c->w_offset) % w_ct;
-        w = &c->ws[w_id];
-        if (w->fname == NULL) {
-            len2 = write(w->s, fnbuf, len + 1);
-            assert(len == len2 - 1);
-            w->fname = fn;
-            c->f_ni++;
-            c->w_offset++;
-            if (c->w_offset >= w_ct) c->w_offset = 0;
-            return 1;
-        }
+    if (c->verbose) printf(" -- Starting file %s (doc %u)\n", fn->name, fn->id);
+    
+    send_bytes(c, w, fnbuf, len + 1);
+    
+    inf = &w->q[(w->q_head + w->q_ct) % c->q_depth];
+    inf->fname = fn;
+    inf->stolen = 0;
+    if (w->q_ct++ == 0) {
+        w->doc = fn->id;
+        c->w_avail--;
+        c->w_busy++;
     }
-    err(1, "no worker could be assigned");
-    return 0;
 }
 
-/* Schedule the next enqueud file to an available worker.
- * Returns 1 on success, 0 if complete, or <0 on error. */
-int worker_schedule(context *c) {
-    int work = -1;
-    uint fni = c->f_ni, fnlen = v_array_length(c->fnames);
-    if (fni == fnlen) return 0; /* done */
+/* Send the next enqueued file to worker W. Files are sorted largest
+ * first; workers in the small-file lane take from the other end. */
+static void assign_file(context *c, worker *w) {
+    fname *fn;
+    worker_progress(c);
+    if (w - c->ws < c->small_ct) {
+        fn = (fname *) v_array_get(c->fnames, --c->f_tail);
+    } else {
+        fn = (fname *) v_array_get(c->fnames, c->f_ni++);
+    }
+    send_file(c, w, fn);
+}
+
+/* Steal a file that another worker has queued but not yet started,
+ * and give it to worker W. (Only files behind the victim's current
+ * file are known not to have started.) The victim is told to cancel it,
+ * and if it has already started anyway, its results for it are
+ * discarded. Returns 1 if a file was stolen. */
+static int steal_file(context *c, worker *w) {
+    worker *v, *victim = NULL;
+    inflight *inf = NULL;
+    uint i, j, waiting, most = 0;
+    char buf[PATH_MAX + 9];
+    int len;
     
-    /* Show progress */
+    for (i=0; i<c->w_ct; i++) {
+        v = &c->ws[i];
+        if (v == w) continue;
+        for (j=1, waiting=0; j<v->q_ct; j++)
+            if (!v->q[(v->q_head + j) % c->q_depth].stolen) waiting++;
+        if (waiting > most) { most = waiting; victim = v; }
+    }
+    if (victim == NULL) return 0;
+    
+    for (j=victim->q_ct - 1; j>0; j--) {    /* take from the back */
+        inf = &victim->q[(victim->q_head + j) % c->q_depth];
+        if (!inf->stolen) break;
+    }
+    assert(inf && !inf->stolen);
+    inf->stolen = 1;
+    len = snprintf(buf, sizeof(buf), " CANCEL %s\n", inf->fname->name);
+    if (len >= sizeof(buf)) {
+        fprintf(stderr, "snprintf error\n");
+        exit(EXIT_FAILURE);
+    }
+    send_bytes(c, victim, buf, len);
+    if (c->verbose > 1) printf(" -- Stealing file %s\n", inf->fname->name);
+    send_file(c, w, inf->fname);
+    return 1;
+}
+
+/* Top up worker W's queue. When the enqueued files run out, an idle
+ * worker steals from a loaded one, so a straggler doesn't hold up
+ * the files queued behind it. */
+static void fill_worker(context *c, worker *w) {
+    while (w->q_ct < c->q_depth && c->f_ni < c->f_tail) assign_file(c, w);
+    if (w->q_ct == 0 && c->q_depth > 1) steal_file(c, w);
+}
+
+/* Print progress, if enabled, every c->tick_max files. */
+void worker_progress(context *c) {
+    uint fnlen = v_array_length(c->fnames);
+    uint fni = c->f_ni + (fnlen - c->f_tail);   /* files started */
     if (c->show_progress && ++c->tick >= c->tick_max) {
         fprintf(stderr, "%.2f%%, %d of %d files, eta ",
             (100.0 * (fni+1)) / fnlen, fni + 1, fnlen);
@@ -121,124 +262,163 @@ int worker_schedule(context *c) {
         fprintf(stderr, "\n");
         c->tick = 0;
     }
+}
+
+/* Schedule enqueued files to every worker with room in its queue,
+ * least-loaded first, up to c->q_depth files in flight per worker.
+ * Returns 1 if any were scheduled, 0 if none remain. */
+int worker_schedule(context *c) {
+    uint i, depth;
+    int work = 0;
+    worker *w;
     
-    if (assign_file(c)) {
-        c->w_avail--;
-        c->w_busy++;
-        work = 1;               /* successfully scheduled */
+    /* Round-robin by queue depth, so a short run of files is
+     * spread across workers rather than queued on the first one. */
+    for (depth = 0; depth < c->q_depth; depth++) {
+        for (i=0; i<c->w_ct; i++) {
+            if (c->f_ni == c->f_tail) return work;
+            w = &c->ws[(i + c->w_offset) % c->w_ct];
+            if (w->q_ct <= depth) {
+                assign_file(c, w);
+                work = 1;
+            }
+        }
+        c->w_offset = (c->w_offset + 1) % c->w_ct;
     }
-    
     return work;
 }
 
-/* If word is new, assign token ID and emit "t $tokenid $token\n".
- * Always emit "$tokenid $fileid $data". */
-static void note_instance(context *c, worker *w, char *wbuf,
-                          uint count, uint len, hash_t fnhash) {
-    int known = word_known(c->word_set, wbuf);
+/* Note that the word in frame FR occurred in the worker's current file. */
+static void note_instance(context *c, worker *w, proto_frame *fr) {
+    char wbuf[MAX_WORD_SZ];
     word *word = NULL;
-    if (known) {
-        word = word_get(c->word_set, wbuf);
-        assert(strcmp(wbuf, word->name) == 0);
-        word->count += count;
-        c->t_occ_ct += count;
-    } else {
-        word = word_add(c->word_set, wbuf, len);
+    
+    memcpy(wbuf, fr->name, fr->len);
+    wbuf[fr->len] = '\0';
+    if (DEBUG) assert(fr->hash == word_hash(wbuf));
+    
+    word = word_get_hashed(c->word_set, wbuf, fr->hash);
+    if (word == NULL) {
+        word = word_intern(c->word_set, wbuf, fr->len, 0, fr->hash);
         c->t_ct++;
-    }        
-    if (word) {
-        h_array_append(word->a, fnhash);
-    } else {
-        fprintf(stderr, "Failed to allocate word\n");
-        exit(EXIT_FAILURE);
     }
-    if (c->verbose > 1) printf("GOT: %s (%d) in %04x, %d\n",
-        wbuf, len, fnhash, count);
+    word->count += fr->count;
+    c->t_occ_ct += fr->count;
+    h_array_append(word->a, w->doc);
+    if (c->spill && ++c->posting_ct >= c->spill_limit) {
+        if (c->verbose) fprintf(stderr, "-- Spilling %lu postings\n", c->posting_ct);
+        spill_words(c->spill, c->word_set);
+        c->posting_ct = 0;
+    }
+    if (c->verbose > 1) printf("GOT: %s (%d) in doc %u, %d\n",
+        wbuf, fr->len, w->doc, fr->count);
 }
 
-static int digits(uint d) {
-    uint r=0;
-    while (d >= 10) { r++; d /= 10; }
-    if (d > 0) r++;
-    return r;
+/* The worker's current file is done (or skipped); move on to its next
+ * one, and top up its queue right away. */
+static void finish_file(context *c, worker *w, int skipped) {
+    inflight *inf = cur_file(w);
+    if (inf->stolen) {
+        if (c->verbose > 1) printf(" -- Dropping stolen file %s\n", inf->fname->name);
+    } else if (skipped) {
+        if (c->verbose >= 1) printf(" -- Skipping file %s\n", inf->fname->name);
+    } else {
+        if (c->verbose > 1) printf(" -- Done with file %s\n", inf->fname->name);
+        fname_add(c->fn_set, inf->fname);
+    }
+    w->q_head = (w->q_head + 1) % c->q_depth;
+    if (--w->q_ct == 0) {
+        c->w_busy--; c->w_avail++;
+    } else {
+        w->doc = cur_file(w)->fname->id;
+    }
+    fill_worker(c, w);
 }
 
-/* Handle data read from a worker. */
+/* Handle data read from a worker: decode every complete frame in the
+ * LEN bytes at w->buf, then move any partial frame to the front. */
 static void process_read(context *c, worker *w, int len, int wid) {
-    int i, toks=0, last=0;
-    char wbuf[MAX_WORD_SZ];
+    int used, o = 0;
     char *in = w->buf;
-    uint count;
-    uint wlen;      /* current word's length */
-    hash_t fnhash = word_hash(w->fname->name);
-    if (DEBUG)
-        fprintf(stderr, "Current fname: %s -> %04x\n", w->fname->name, fnhash);
+    proto_frame fr;
     
-    for (i=0; i<len; i++) {
-        if (in[i] == '\n') {
-            toks = sscanf(in + last, "%s %u\n", wbuf, &count);
-            if (toks == 2) {
-                wlen = i - last - 1 - digits(count);
-                assert(wlen == strlen(wbuf));
-                note_instance(c, w, wbuf, count, wlen, fnhash);
-                last = i + 1;
-            } else if (strncmp(in + last, " SKIP", 5) == 0) {
-                if (c->verbose >= 1) printf(" -- Skipping file %s\n", w->fname->name);
-                w->fname = NULL; w->off = 0;
-                c->w_busy--; c->w_avail++;
-                return;                                
-            } else if (strncmp(in + last, " DONE", 5) == 0) {
-                if (c->verbose > 1) printf(" -- Done with file %s\n", w->fname->name);
-                fname_add(c->fn_set, w->fname);
-                w->fname = NULL; w->off = 0;
-                c->w_busy--; c->w_avail++;
-                return;
-            } else {
-                err(1, "printf-debugging corrupted worker input?");
-            }
+    while ((used = proto_get_frame(in + o, len - o, &fr)) > 0) {
+        if (w->q_ct == 0) errx(1, "unexpected input from worker %d", wid);
+        if (fr.type == PROTO_WORD) {
+            if (!cur_file(w)->stolen) note_instance(c, w, &fr);
+        } else {
+            finish_file(c, w, fr.type == PROTO_SKIP);
         }
+        o += used;
     }
+    if (used < 0) errx(1, "corrupt input from worker %d", wid);
     
-    w->off = len - last;
-    if (DEBUG) printf("Copying remaining %d of %d (last:%d): %s\n",
-        w->off, len, last, in + last);
-    strncpy(in, in + last, w->off + 1); /* strlcpy */
+    w->off = len - o;
+    if (DEBUG) fprintf(stderr, "Keeping remaining %d of %d bytes\n", w->off, len);
+    memmove(in, in + o, w->off);
+}
 
-    if (DEBUG) printf(" ==== Copied -- \n%s\n====\n", in);
-    assert(in[0] != '\n');
+/* Read and process everything available from worker WID, until
+ * the socket would block. */
+static void drain_worker(context *c, int wid) {
+    worker *w = &c->ws[wid];
+    int len;
+    for (;;) {
+        len = read(w->s, w->buf + w->off, BUF_SZ - w->off);
+        if (len > 0) {
+            process_read(c, w, len + w->off, wid);
+        } else if (len == 0) {
+            errx(1, "worker %d exited unexpectedly%s%s", wid,
+                w->q_ct ? " while reading " : "",
+                w->q_ct ? cur_file(w)->fname->name : "");
+        } else if (errno == EINTR) {
+            errno = 0;
+        } else if (errno == EAGAIN) {
+            errno = 0;
+            break;
+        } else {
+            err(1, "worker read fail");
+        }
+    }
 }
 
-/* Check worker sub-processes and and process input, if any. */
-int worker_check(context *c, fd_set *fdsr) {
-    int i, len=0;
-    int ready_ct;
-    struct timeval tv = { 0, 10 * 1000 };
-    worker *w;
+/* Block until at least one worker has output, or can take output
+ * pending for it, then process it. Workers that finish a file are
+ * immediately given the next one. Returns the number of sockets ready. */
+int worker_check(context *c) {
+    int i, wid, ready_ct;
+#if USE_EPOLL
+    struct epoll_event evs[MAX_WORKER_CT];
     
-    for (i=0; i<c->w_ct; i++) FD_SET(c->ws[i].s, fdsr);
-    ready_ct = select(c->max_w_socket + 1, fdsr, NULL, NULL, &tv);
-    if (ready_ct == -1) err(1, "select");
+    ready_ct = epoll_wait(c->epfd, evs, MAX_WORKER_CT, -1);
+    if (ready_ct == -1) {
+        if (errno == EINTR) return 0;
+        err(1, "epoll_wait");
+    }
+    for (i=0; i<ready_ct; i++) {
+        wid = evs[i].data.u32;
+        if ((evs[i].events & EPOLLOUT) && c->ws[wid].out_len > 0)
+            flush_output(c, wid);
+        if (evs[i].events != EPOLLOUT) drain_worker(c, wid);
+    }
+#else
+    fd_set fdsr, fdsw;
     
-    /* check if any workers are done, read + log data */
+    FD_ZERO(&fdsr);
+    FD_ZERO(&fdsw);
     for (i=0; i<c->w_ct; i++) {
-        w = &c->ws[i];
-        if (FD_ISSET(w->s, fdsr)) {
-            do {
-                len = read(w->s, w->buf + w->off, BUF_SZ - w->off);
-                if (len > 0) {
-                    w->buf[len + w->off] = '\0';
-                    process_read(c, w, len + w->off, i);
-                } else if (len == 0) {
-                    printf("EOF'd %d; %s\n", i, w->buf);
-                    /* EOF? */
-                } else if (errno == EAGAIN) {
-                    errno = 0;
-                    break;
-                } else {
-                    err(1, "worker read fail");
-                }
-            } while (len > 0);
-        }
+        FD_SET(c->ws[i].s, &fdsr);
+        if (c->ws[i].out_len > 0) FD_SET(c->ws[i].s, &fdsw);
     }
-    return 0;
+    ready_ct = select(c->max_w_socket + 1, &fdsr, &fdsw, NULL, NULL);
+    if (ready_ct == -1) {
+        if (errno == EINTR) return 0;
+        err(1, "select");
+    }
+    for (wid=0; wid<c->w_ct; wid++) {
+        if (FD_ISSET(c->ws[wid].s, &fdsw)) flush_output(c, wid);
+        if (FD_ISSET(c->ws[wid].s, &fdsr)) drain_worker(c, wid);
+    }
+#endif
+    return ready_ct;
 }
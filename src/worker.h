@@ -4,11 +4,17 @@
 /* Initialize a worker sub-process. Returns <0 on error. */
 int worker_init_all(context *c);
 
-/* Schedule the next enqueud file to an available worker.
- * Returns 1 on success, 0 if complete, or <0 on error. */
+/* Schedule enqueued files to every worker with room in its queue,
+ * least-loaded first, up to c->q_depth files in flight per worker.
+ * Returns 1 if any were scheduled, 0 if none remain. */
 int worker_schedule(context *c);
 
-/* Check worker sub-processes and and process input, if any. */
-int worker_check(context *c, fd_set *fdsr);
+/* Print progress, if enabled, every c->tick_max files. */
+void worker_progress(context *c);
+
+/* Block until at least one worker has output, or can take output
+ * pending for it, then process it. Workers that finish a file are
+ * immediately given the next one. Returns the number of sockets ready. */
+int worker_check(context *c);
 
 #endif